@@ -12,7 +12,8 @@ This is a derivative work based on:
 	license: CC BY-SA v3.0 - http://creativecommons.org/licenses/by-sa/3.0/
 	Source: http://www.sparkfun.com/tutorial/Barometric/BMP085_Example_Code.pde
 
-Compile with: gcc -Wall -o testBMP085 ./smbus.c ./testBMP085.c
+Compile with: gcc -Wall -DBMP085_MAIN -o getBMP085 ./getBMP085.c
+Without BMP085_MAIN it is the driver alone, as the weather station uses it.
 
 
 Circuit detail:
@@ -33,211 +34,296 @@ Circuit detail:
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <linux/i2c-dev.h>
 #include <linux/i2c.h>
 #include <sys/ioctl.h>
-#include "smbus.h" 
 
+#define BMP085_I2C_BUS "/dev/i2c-0"
 #define BMP085_I2C_ADDRESS 0x77
+#define BMP085_OVERSAMPLING_SETTING 3		// default, 0 (one sample) to 3 (eight)
+#define BMP085_CHIP_ID 0x55			// register 0xD0, the same on the BMP180
 
-const unsigned char BMP085_OVERSAMPLING_SETTING = 3;
+// Wait after starting a pressure conversion
+#define BMP085_UP_DELAY_MS(oss) (2 + (3 << (oss)))
 
 // Calibration values - These are stored in the BMP085
-short int ac1;
-short int ac2; 
-short int ac3; 
-unsigned short int ac4;
-unsigned short int ac5;
-unsigned short int ac6;
-short int b1; 
-short int b2;
-short int mb;
-short int mc;
-short int md;
-
-int b5; 
-
-unsigned int temperature, pressure;
-
-
-// Open a connection to the bmp085
-// Returns a file id
-int bmp085_i2c_Begin()
-{
+struct bmp085_calibration {
+	short int ac1;
+	short int ac2;
+	short int ac3;
+	unsigned short int ac4;
+	unsigned short int ac5;
+	unsigned short int ac6;
+	short int b1;
+	short int b2;
+	short int mb;
+	short int mc;
+	short int md;
+};
+
+// One sensor.  Set bus, address and oss with bmp085_Init(); an open
+// session keeps the bus open and the factory calibration read once, every
+// register access is one I2C_RDWR ioctl.  Nothing is shared between
+// sensors, so each can be driven from a thread of its own.  The BMP180 is
+// register compatible.
+struct bmp085 {
+	const char *bus;
+	int address;
+	int oss;				// oversampling setting
+	struct bmp085_calibration cal;
 	int fd;
-	char *fileName = "/dev/i2c-0";
-	
-	// Open port for reading and writing
-	if ((fd = open(fileName, O_RDWR)) < 0)
-		exit(1);
-	
-	// Set the port options and set the address of the device
-	if (ioctl(fd, I2C_SLAVE, BMP085_I2C_ADDRESS) < 0) {					
-		close(fd);
-		exit(1);
-	}
+	unsigned long transactions;
+	unsigned long errors;
+};
 
-	return fd;
+void bmp085_Init(struct bmp085 *dev, const char *bus, int address, int oss)
+{
+	memset(dev, 0, sizeof(*dev));
+	dev->bus = bus;
+	dev->address = address;
+	dev->oss = oss;
+	dev->fd = -1;
 }
 
-// Read two words from the BMP085 and supply it as a 16 bit integer
-__s32 bmp085_i2c_Read_Int(int fd, __u8 address)
+// Run a sequence of messages as one combined transaction (repeated start)
+// Returns 0 on success, -1 on error.
+int bmp085_i2c_Transfer(struct bmp085 *dev, struct i2c_msg *msgs, int count)
 {
-	__s32 res = i2c_smbus_read_word_data(fd, address);
-	if (res < 0) {
-		close(fd);
-		exit(1);
+	struct i2c_rdwr_ioctl_data data;
+
+	data.msgs = msgs;
+	data.nmsgs = count;
+	dev->transactions++;
+	if (ioctl(dev->fd, I2C_RDWR, &data) < 0) {
+		dev->errors++;
+		return -1;
 	}
+	return 0;
+}
 
-	// Convert result to 16 bits and swap bytes
-	res = ((res<<8) & 0xFF00) | ((res>>8) & 0xFF);
-
-	return res;
+// Read length bytes starting at register address
+int bmp085_i2c_Read_Block(struct bmp085 *dev, __u8 address, __u8 length, __u8 *values)
+{
+	struct i2c_msg msgs[2] = {
+		{ dev->address, 0, 1, &address },
+		{ dev->address, I2C_M_RD, length, values },
+	};
+	return bmp085_i2c_Transfer(dev, msgs, 2);
 }
 
 //Write a byte to the BMP085
-void bmp085_i2c_Write_Byte(int fd, __u8 address, __u8 value)
+int bmp085_i2c_Write_Byte(struct bmp085 *dev, __u8 address, __u8 value)
 {
-	if (i2c_smbus_write_byte_data(fd, address, value) < 0) {
-		close(fd);
-		exit(1);
-	}
+	__u8 buf[2] = { address, value };
+	struct i2c_msg msg = { dev->address, 0, 2, buf };
+	return bmp085_i2c_Transfer(dev, &msg, 1);
 }
 
-// Read a block of data BMP085
-void bmp085_i2c_Read_Block(int fd, __u8 address, __u8 length, __u8 *values)
+// The datasheet's check that the calibration was read: no word is 0 or
+// 0xFFFF.  That also keeps ac4 and md, which the compensation divides by,
+// from being 0.  Returns 0 if it passes, -1 if not.
+int bmp085_CheckCalibration(const struct bmp085_calibration *cal)
 {
-	if(i2c_smbus_read_i2c_block_data(fd, address,length,values)<0) {
-		close(fd);
-		exit(1);
-	}
+	const unsigned short int w[11] = { cal->ac1, cal->ac2, cal->ac3, cal->ac4, cal->ac5, cal->ac6,
+					   cal->b1, cal->b2, cal->mb, cal->mc, cal->md };
+	int i;
+
+	for (i = 0; i < 11; i++)
+		if (w[i] == 0 || w[i] == 0xFFFF)
+			return -1;
+	return 0;
 }
 
+// Read the 22 byte calibration block (0xAA-0xBF) in one transaction
+int bmp085_Calibration(struct bmp085 *dev)
+{
+	__u8 cal[22];
+
+	if (bmp085_i2c_Read_Block(dev, 0xAA, sizeof(cal), cal) < 0)
+		return -1;
+
+	// Stored MSB first
+	dev->cal.ac1 = (cal[0] << 8) | cal[1];
+	dev->cal.ac2 = (cal[2] << 8) | cal[3];
+	dev->cal.ac3 = (cal[4] << 8) | cal[5];
+	dev->cal.ac4 = (cal[6] << 8) | cal[7];
+	dev->cal.ac5 = (cal[8] << 8) | cal[9];
+	dev->cal.ac6 = (cal[10] << 8) | cal[11];
+	dev->cal.b1 = (cal[12] << 8) | cal[13];
+	dev->cal.b2 = (cal[14] << 8) | cal[15];
+	dev->cal.mb = (cal[16] << 8) | cal[17];
+	dev->cal.mc = (cal[18] << 8) | cal[19];
+	dev->cal.md = (cal[20] << 8) | cal[21];
+	return bmp085_CheckCalibration(&dev->cal);
+}
 
-void bmp085_Calibration()
+// Open dev->bus, check there is a BMP085 or BMP180 at dev->address and
+// read its calibration.  Returns 0 on success, -1 on error.
+int bmp085_Open(struct bmp085 *dev)
 {
-	int fd = bmp085_i2c_Begin();
-	ac1 = bmp085_i2c_Read_Int(fd,0xAA);
-	ac2 = bmp085_i2c_Read_Int(fd,0xAC);
-	ac3 = bmp085_i2c_Read_Int(fd,0xAE);
-	ac4 = bmp085_i2c_Read_Int(fd,0xB0);
-	ac5 = bmp085_i2c_Read_Int(fd,0xB2);
-	ac6 = bmp085_i2c_Read_Int(fd,0xB4);
-	b1 = bmp085_i2c_Read_Int(fd,0xB6);
-	b2 = bmp085_i2c_Read_Int(fd,0xB8);
-	mb = bmp085_i2c_Read_Int(fd,0xBA);
-	mc = bmp085_i2c_Read_Int(fd,0xBC);
-	md = bmp085_i2c_Read_Int(fd,0xBE);
-	close(fd);
+	__u8 id;
+
+	// Open port for reading and writing
+	if ((dev->fd = open(dev->bus, O_RDWR)) < 0)
+		return -1;
+
+	if (bmp085_i2c_Read_Block(dev, 0xD0, 1, &id) < 0 || id != BMP085_CHIP_ID ||
+	    bmp085_Calibration(dev) < 0) {
+		close(dev->fd);
+		dev->fd = -1;
+		return -1;
+	}
+	return 0;
 }
 
-// Read the uncompensated temperature value
-unsigned int bmp085_ReadUT()
+void bmp085_Close(struct bmp085 *dev)
 {
-	unsigned int ut = 0;
-	int fd = bmp085_i2c_Begin();
+	if (dev->fd >= 0)
+		close(dev->fd);
+	dev->fd = -1;
+}
 
+// Request a temperature reading.  The result is ready after 4.5ms
+int bmp085_StartUT(struct bmp085 *dev)
+{
 	// Write 0x2E into Register 0xF4
-	// This requests a temperature reading
-	bmp085_i2c_Write_Byte(fd,0xF4,0x2E);
-	
-	// Wait at least 4.5ms
-	usleep(5000);
-
-	// Read the two byte result from address 0xF6
-	ut = bmp085_i2c_Read_Int(fd,0xF6);
+	return bmp085_i2c_Write_Byte(dev, 0xF4, 0x2E);
+}
 
-	// Close the i2c file
-	close (fd);
-	
-	return ut;
+// Read the uncompensated temperature and request a pressure reading in the
+// same transaction.  The pressure is ready after (2 + (3<<oss)) ms
+int bmp085_ReadUTStartUP(struct bmp085 *dev, unsigned int *ut)
+{
+	__u8 reg = 0xF6;
+	__u8 values[2];
+	// Write 0x34+(oss<<6) into register 0xF4
+	__u8 cmd[2] = { 0xF4, 0x34 + (dev->oss<<6) };
+	struct i2c_msg msgs[3] = {
+		{ dev->address, 0, 1, &reg },
+		{ dev->address, I2C_M_RD, 2, values },
+		{ dev->address, 0, 2, cmd },
+	};
+
+	if (bmp085_i2c_Transfer(dev, msgs, 3) < 0)
+		return -1;
+
+	// Two byte result from address 0xF6, MSB first
+	*ut = (values[0] << 8) | values[1];
+	return 0;
 }
 
 // Read the uncompensated pressure value
-unsigned int bmp085_ReadUP()
+int bmp085_ReadUP(struct bmp085 *dev, unsigned int *up)
+{
+	// Read the three byte result from 0xF6
+	// 0xF6 = MSB, 0xF7 = LSB and 0xF8 = XLSB
+	__u8 values[3];
+	if (bmp085_i2c_Read_Block(dev, 0xF6, 3, values) < 0)
+		return -1;
+
+	*up = (((unsigned int) values[0] << 16) | ((unsigned int) values[1] << 8) | (unsigned int) values[2]) >> (8-dev->oss);
+	return 0;
+}
+
+// Read temperature then pressure, waiting for each conversion.
+// Three I2C transactions in all.  Returns 0 on success, -1 on error.
+int bmp085_ReadUTUP(struct bmp085 *dev, unsigned int *ut, unsigned int *up)
 {
-	unsigned int up = 0;
-	int fd = bmp085_i2c_Begin();
+	if (bmp085_StartUT(dev) < 0)
+		return -1;
 
-	// Write 0x34+(BMP085_OVERSAMPLING_SETTING<<6) into register 0xF4
-	// Request a pressure reading w/ oversampling setting
-	bmp085_i2c_Write_Byte(fd,0xF4,0x34 + (BMP085_OVERSAMPLING_SETTING<<6));
+	// Wait at least 4.5ms
+	usleep(5000);
+
+	if (bmp085_ReadUTStartUP(dev, ut) < 0)
+		return -1;
 
 	// Wait for conversion, delay time dependent on oversampling setting
-	usleep((2 + (3<<BMP085_OVERSAMPLING_SETTING)) * 1000);
+	usleep(BMP085_UP_DELAY_MS(dev->oss) * 1000);
 
-	// Read the three byte result from 0xF6
-	// 0xF6 = MSB, 0xF7 = LSB and 0xF8 = XLSB
-	__u8 values[3];
-	bmp085_i2c_Read_Block(fd, 0xF6, 3, values);
+	return bmp085_ReadUP(dev, up);
+}
 
-	up = (((unsigned int) values[0] << 16) | ((unsigned int) values[1] << 8) | (unsigned int) values[2]) >> (8-BMP085_OVERSAMPLING_SETTING);
+// The compensation is pure: it only depends on the calibration and the
+// raw values passed in, never on an earlier call.
 
-	// Close the i2c file
-	close (fd);
-	
-	return up;
+// B5, the temperature term the pressure compensation uses as well
+int bmp085_GetB5(const struct bmp085_calibration *cal, unsigned int ut)
+{
+	int x1, x2;
+
+	x1 = (((int)ut - (int)cal->ac6)*(int)cal->ac5) >> 15;
+	if (x1 + cal->md == 0)
+		return x1;                      // only a corrupt calibration or UT gets here
+	x2 = ((int)cal->mc << 11)/(x1 + cal->md);
+	return x1 + x2;
+}
+
+// Calculate temperature given uncalibrated temperature
+// Value returned will be in units of 0.1 deg C
+int bmp085_GetTemperature(const struct bmp085_calibration *cal, unsigned int ut)
+{
+	return (bmp085_GetB5(cal, ut) + 8)>>4;
 }
 
-// Calculate pressure given uncalibrated pressure
+// Calculate pressure given uncalibrated temperature and pressure, read
+// with oversampling setting oss
 // Value returned will be in units of Pa
-unsigned int bmp085_GetPressure(unsigned int up)
+int bmp085_GetPressure(const struct bmp085_calibration *cal, int oss, unsigned int ut, unsigned int up)
 {
 	int x1, x2, x3, b3, b6, p;
 	unsigned int b4, b7;
-  
-	b6 = b5 - 4000;
+
+	b6 = bmp085_GetB5(cal, ut) - 4000;
 	// Calculate B3
-	x1 = (b2 * (b6 * b6)>>12)>>11;
-	x2 = (ac2 * b6)>>11;
+	x1 = (cal->b2 * (b6 * b6)>>12)>>11;
+	x2 = (cal->ac2 * b6)>>11;
 	x3 = x1 + x2;
-	b3 = (((((int)ac1)*4 + x3)<<BMP085_OVERSAMPLING_SETTING) + 2)>>2;
-  
+	b3 = (((((int)cal->ac1)*4 + x3)<<oss) + 2)>>2;
+
 	// Calculate B4
-	x1 = (ac3 * b6)>>13;
-	x2 = (b1 * ((b6 * b6)>>12))>>16;
+	x1 = (cal->ac3 * b6)>>13;
+	x2 = (cal->b1 * ((b6 * b6)>>12))>>16;
 	x3 = ((x1 + x2) + 2)>>2;
-	b4 = (ac4 * (unsigned int)(x3 + 32768))>>15;
-  
-	b7 = ((unsigned int)(up - b3) * (50000>>BMP085_OVERSAMPLING_SETTING));
+	b4 = (cal->ac4 * (unsigned int)(x3 + 32768))>>15;
+	if (b4 == 0)
+		return 0;                       // as in bmp085_GetB5(), rather than divide by it
+
+	b7 = ((unsigned int)(up - b3) * (50000>>oss));
 	if (b7 < 0x80000000)
 		p = (b7<<1)/b4;
 	else
 		p = (b7/b4)<<1;
-	
+
 	x1 = (p>>8) * (p>>8);
 	x1 = (x1 * 3038)>>16;
 	x2 = (-7357 * p)>>16;
 	p += (x1 + x2 + 3791)>>4;
-  
+
 	return p;
 }
 
-// Calculate temperature given uncalibrated temperature
-// Value returned will be in units of 0.1 deg C
-unsigned int bmp085_GetTemperature(unsigned int ut)
+#ifdef BMP085_MAIN
+// getBMP085 [bus [address]]
+int main(int argc, char **argv)
 {
-	int x1, x2;
-  
-	x1 = (((int)ut - (int)ac6)*(int)ac5) >> 15;
-	x2 = ((int)mc << 11)/(x1 + md);
-	b5 = x1 + x2;
-
-	unsigned int result = ((b5 + 8)>>4);  
-
-	return result;
-}
-
-//int main(int argc, char **argv)
-//{
-//	bmp085_Calibration();
-//	temperature = bmp085_GetTemperature(bmp085_ReadUT());
-//	pressure = bmp085_GetPressure(bmp085_ReadUP());
-//	
-//	printf("Temperature %0.2f ", ((double)temperature)/10);
-//	printf("Pressure %0.2f\n", ((double)pressure)/100);
-//	return 0;
-//}
+	struct bmp085 dev;
+	unsigned int ut, up;
+
+	bmp085_Init(&dev, argc > 1 ? argv[1] : BMP085_I2C_BUS, argc > 2 ? (int)strtol(argv[2], NULL, 16) : BMP085_I2C_ADDRESS,
+		    BMP085_OVERSAMPLING_SETTING);
+	if (bmp085_Open(&dev) < 0 || bmp085_ReadUTUP(&dev, &ut, &up) < 0) {
+		fprintf(stderr, "No BMP085 at %s:%02x\n", dev.bus, dev.address);
+		return 1;
+	}
+
+	printf("Temperature %0.2f ", bmp085_GetTemperature(&dev.cal, ut) / 10.0);
+	printf("Pressure %0.2f\n", bmp085_GetPressure(&dev.cal, dev.oss, ut, up) / 100.0);
+	bmp085_Close(&dev);
+	return 0;
+}
+#endif
@@ -0,0 +1,397 @@
+/*
+Acquisition and publish path benchmarks
+
+Runs on any Linux box: the sensors are the simulated ones from hal/sim.h
+and MQTT goes over loopback to the stand-in in broker.h.  Every result is
+one line of JSON; "ns" is the figure to watch, nanoseconds per operation,
+or per cycle at the median for the end-to-end run.
+
+  bmp085_temperature    bmp085_GetTemperature()
+  bmp085_pressure       bmp085_GetPressure()
+  derived               dew point and absolute humidity
+  payload_fixed         one channel formatted
+  payload_json          a whole cycle with payload_json()
+  payload_cbor          and with payload_cbor()
+  filter                filter_apply() on every channel
+  oversample            one scan into a 64 sample window, and reducing it
+  mcp3008_<backend>     one bit-banged conversion through each GPIO backend;
+                        sysfs needs the pins exported and mmap /dev/gpiomem,
+                        so off the Pi only fake runs
+  isr_ingest            edges queued by another thread and drained here;
+                        ring_full is how often it found the ring full
+  cycle                 a sample cycle end to end, see bench_cycle()
+
+Given the output of an earlier run it compares against it and exits 1 if
+anything is more than the tolerance (default 0.25) slower.  Compare runs
+on the same, otherwise idle, machine.
+
+	make bench && ./acq_bench > before.jsonl
+	./acq_bench before.jsonl [tolerance]
+*/
+
+#define HAL_NO_WIRINGPI
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "../BMP085/getBMP085.c"
+#include "../mcp3008/mcp3008.h"
+#include "../mcp3008/oversample.h"
+#include "../dht22/dht22.h"
+#include "../mqtt/payload.h"
+#include "../scheduler/scheduler.h"
+#include "../pulses/pulses.h"
+#include "../weather/wind.h"
+#include "../weather/filter.h"
+#include "../weather/derived.h"
+#include "../hal/hal.h"
+#include "broker.h"
+#include "synth.h"
+
+#define BENCH_TOLERANCE         0.25            // slower than this fraction is a regression
+#define BENCH_MAX               32
+#define BENCH_REPEAT            5               // the micro benchmarks keep their best run
+#define CYCLES                  2000
+#define ISR_EDGES               2000000
+
+struct result {
+	char name[32];
+	double ns;
+};
+
+static struct result results[BENCH_MAX];
+static int nresults;
+static volatile float sink;                     // keeps the loops from being optimised out
+
+// {"bench":name,"n":n,"ns":per op,"per_s":ops a second} plus extra
+static void report(const char *name, long n, double secs, const char *extra)
+{
+	double ns = secs * 1e9 / n;
+
+	printf("{\"bench\":\"%s\",\"n\":%ld,\"ns\":%.1f,\"per_s\":%.0f%s}\n", name, n, ns, n / secs, extra ? extra : "");
+	fflush(stdout);
+	if (nresults < BENCH_MAX) {
+		snprintf(results[nresults].name, sizeof(results[nresults].name), "%s", name);
+		results[nresults++].ns = ns;
+	}
+}
+
+// Run the statements BENCH_REPEAT times, secs is the quickest
+#define BEST_OF(secs, ...) do {                                         \
+	double t_;                                                      \
+	secs = 1e30;                                                    \
+	for (int r_ = 0; r_ < BENCH_REPEAT; r_++) {                     \
+		t_ = now_s();                                           \
+		__VA_ARGS__;                                            \
+		if ((t_ = now_s() - t_) < secs)                         \
+			secs = t_;                                      \
+	}                                                               \
+} while (0)
+
+// ======================================================================
+
+static void bench_bmp085(void)
+{
+	struct bmp085 dev;
+	long i, n = 1000000;
+	unsigned int acc = 0;
+	double secs;
+
+	sim_bmp085_open(&dev);                  // the datasheet's calibration
+	BEST_OF(secs, for (i = 0; i < n; i++) acc += bmp085_GetTemperature(&dev.cal, 24000 + (i & 4095)));
+	report("bmp085_temperature", n, secs, NULL);
+
+	BEST_OF(secs, for (i = 0; i < n; i++) acc += bmp085_GetPressure(&dev.cal, 3, 27898, 20000 + (i & 32767)));
+	report("bmp085_pressure", n, secs, NULL);
+	sink = acc;
+}
+
+static void bench_derived(void)
+{
+	long i, n = 500000;
+	float acc = 0, t_c, rh;
+	double secs;
+
+	BEST_OF(secs, for (i = 0; i < n; i++) {
+		t_c = -10 + (i & 511) * 0.1;
+		rh = 20 + (i & 63);
+		acc += calculate_dew_point(t_c, rh) + absolute_humidity(t_c, rh);
+	});
+	report("derived", n, secs, NULL);
+	sink = acc;
+}
+
+static void bench_payload(void)
+{
+	char text[64];
+	static uint8_t buf[PAYLOAD_MAX];
+	float v[CH_COUNT];
+	long i, n = 100000, bytes = 0;
+	char extra[64];
+	double secs;
+	int c;
+
+	synth(0, v);
+	BEST_OF(secs, for (i = 0; i < n; i++) {
+		c = i % CH_COUNT;
+		bytes += payload_fixed(text, sizeof(text), v[c] + (i & 15), channels[c].decimals);
+	});
+	report("payload_fixed", n, secs, NULL);
+
+	BEST_OF(secs, bytes = 0; for (i = 0; i < n / 10; i++) {
+		synth(i, v);
+		bytes += payload_json((char *)buf, sizeof(buf), BENCH_START + i * 60, v, CH_ALL);
+	});
+	snprintf(extra, sizeof(extra), ",\"bytes\":%.1f", (double)bytes / (n / 10));
+	report("payload_json", n / 10, secs, extra);
+
+	BEST_OF(secs, bytes = 0; for (i = 0; i < n / 10; i++) {
+		synth(i, v);
+		bytes += payload_cbor(buf, sizeof(buf), BENCH_START + i * 60, v, CH_ALL);
+	});
+	snprintf(extra, sizeof(extra), ",\"bytes\":%.1f", (double)bytes / (n / 10));
+	report("payload_cbor", n / 10, secs, extra);
+}
+
+static void bench_filter(void)
+{
+	float v[CH_COUNT], x;
+	long i, n = 20000;
+	double secs;
+	int c;
+
+	filter_init();
+	BEST_OF(secs, for (i = 0; i < n; i++) {
+		synth(i, v);
+		for (c = 0; c < CH_COUNT; c++) {
+			x = v[c];
+			filter_apply(c, &x);
+		}
+	});
+	sink = x;
+	report("filter", n, secs, NULL);
+}
+
+static void bench_oversample(void)
+{
+	static struct oversample os;
+	struct mcp3008_scan scan = { { 0 } };
+	long i, n = 5000;
+	double secs;
+	int k;
+
+	oversample_init(&os);
+	oversample_parse_filter(&os, "median");
+	scan.mask = (1 << 0) | (1 << 3);
+	BEST_OF(secs, for (i = 0; i < n; i++) {
+		oversample_begin(&os);
+		for (k = 0; k < os.n; k++) {
+			scan.value[0] = 512 + (k * 7 & 15);
+			scan.value[3] = 100 + (k * 13 & 7);
+			oversample_add(&os, &scan);
+		}
+		oversample_finish(&os);
+	});
+	sink = os.value[0];
+	report("oversample", n * os.n, secs, NULL);
+}
+
+// Conversions on the pins the daemon uses: clock 11, in 9, out 10, cs 8
+static void bench_mcp3008(void)
+{
+	char name[32];
+	long i, n;
+	int acc = 0;
+	double secs;
+
+	for (i = 0; gpio_backends[i].name; i++) {
+		snprintf(name, sizeof(name), "mcp3008_%s", gpio_backends[i].name);
+		if (strncmp(gpio_backends[i].name, "sysfs", 5) == 0 && access("/sys/class/gpio/gpio11/value", W_OK) != 0) {
+			printf("{\"bench\":\"%s\",\"skipped\":\"pins not exported\"}\n", name);
+			continue;
+		}
+		if (gpio_select(gpio_backends[i].name) != 0) {
+			printf("{\"bench\":\"%s\",\"skipped\":\"backend unavailable\"}\n", name);
+			continue;
+		}
+		mcp3008_pins[0] = -1;                   // directions again for the new backend
+		n = strcmp(gpio_backends[i].name, "sysfs") == 0 ? 100 : 5000;
+		BEST_OF(secs, for (int k = 0; k < n; k++) acc += mcp3008_value(k & 7, 11, 9, 10, 8));
+		report(name, n, secs, NULL);
+	}
+	sink = acc;
+}
+
+// ======================================================================
+// Interrupt ingestion: a thread queues edges as fast as it can, as the
+// wiringPi ISR threads would, while this one drains them
+
+static struct pulse_source isr_src = { .name = "wind", .debounce_ns = 5000000ULL };
+static volatile int isr_done;
+
+// Waits for room rather than dropping, so every edge is counted through
+static void *isr_producer(void *arg)
+{
+	long i;
+
+	for (i = 0; i < ISR_EDGES; i++)
+		while (pulse_ring_push(&isr_src.ring, pulse_now_ns()) != 0)
+			;
+	isr_done = 1;
+	return NULL;
+}
+
+static void bench_isr(void)
+{
+	pthread_t thread;
+	char extra[64];
+	double t;
+
+	sched_virtual = 0;
+	t = now_s();
+	pthread_create(&thread, NULL, isr_producer, NULL);
+	while (!isr_done)
+		pulse_drain(&isr_src, NULL, NULL);
+	pthread_join(thread, NULL);
+	pulse_drain(&isr_src, NULL, NULL);
+	snprintf(extra, sizeof(extra), ",\"drained\":%lu,\"ring_full\":%lu", isr_src.edges, isr_src.ring.dropped);
+	report("isr_ingest", ISR_EDGES, now_s() - t, extra);
+}
+
+// ======================================================================
+// One sample cycle as the daemon runs it, less the time spent waiting on
+// the sensors: a 64 scan ADC window, a BMP085 read and compensation, a
+// DHT22 frame decoded, a minute of wind and rain edges drained, the
+// derived channels, the filters, a JSON payload, and a QoS 1 publish
+// acknowledged by the stand-in.
+
+static struct pulse_source rain = { .name = "rain", .debounce_ns = 200000000ULL };
+static struct pulse_source wind = { .name = "wind", .debounce_ns = 5000000ULL };
+
+static void bench_cycle(void)
+{
+	static struct oversample os;
+	static char payload[PAYLOAD_MAX];
+	struct mcp3008_scan scan;
+	struct bmp085 dev;
+	struct broker b;
+	struct hist h = { 0 }, pub = { 0 };
+	float v[CH_COUNT], dht_t = NAN, dht_h = NAN;
+	unsigned int ut, up;
+	double t, t_pub, total = 0;
+	char extra[160];
+	int fd, i, c, len, failed = 0;
+
+	hal.rain = &rain;
+	hal.wind = &wind;
+	hal.adc_channels = (1 << 0) | (1 << 3);
+	if (hal_select("sim:seed=1,faults=0,spikes=0,storms=0,start=1767225600") != 0 || hal_open(NULL) != 0 ||
+	    broker_start(&b, 0, 0) != 0 || (fd = broker_connect(b.port, "acq_bench")) < 0) {
+		printf("{\"bench\":\"cycle\",\"skipped\":\"no simulated hardware or broker stand-in\"}\n");
+		return;
+	}
+	oversample_init(&os);
+	filter_init();
+	bmp085_Init(&dev, BMP085_I2C_BUS, BMP085_I2C_ADDRESS, BMP085_OVERSAMPLING_SETTING);
+	memset(v, 0, sizeof(v));
+
+	for (i = 0; i < CYCLES; i++) {
+		sched_now_ns += 60 * 1000000000LL;
+		t = now_s();
+
+		oversample_begin(&os);
+		while (!oversample_add(&os, &scan))
+			hal_adc_scan(&scan);
+		oversample_finish(&os);
+		v[CH_UVI] = os.value[0] / 1023.0 * 3.3 / 471.0 * 1000.0 * (5.25 / 20.0);
+		v[CH_LIGHT] = os.value[3] / 1023.0 * 3.3 * 100.0 * 2;
+
+		if (dev.fd < 0)
+			hal_bmp085_open(&dev);
+		if (hal_bmp085_start_ut(&dev) == 0 && hal_bmp085_read_ut_start_up(&dev, &ut) == 0 &&
+		    hal_bmp085_read_up(&dev, &up) == 0) {
+			v[CH_TEMPERATURE] = bmp085_GetTemperature(&dev.cal, ut) / 10.0;
+			v[CH_PRESSURE] = bmp085_GetPressure(&dev.cal, dev.oss, ut, up);
+		}
+
+		hal_dht22_start();
+		hal_dht22_collect(&dht_t, &dht_h);
+
+		hal_pulses();
+		v[CH_RAIN] = rain.count * 0.2794 + pulse_drain(&rain, NULL, NULL) * 0.2794;
+		v[CH_WINDSPEED] = pulse_drain(&wind, NULL, NULL) / 60.0 / WIND_PULSES_PER_REV * WIND_CALIBRATION;
+
+		v[CH_DEWPOINT] = calculate_dew_point(dht_t, dht_h);
+		v[CH_ABS_HUM] = absolute_humidity(dht_t, dht_h);
+		for (c = 0; c < CH_COUNT; c++)
+			filter_apply(c, &v[c]);
+
+		len = payload_json(payload, sizeof(payload), sched_time(), v, CH_ALL);
+		t_pub = now_s();
+		if (len < 0 || broker_publish(fd, TOPIC_cycle, payload, len) != 0)
+			failed++;
+
+		hist_record_us(&pub, (now_s() - t_pub) * 1e6);
+		hist_record_us(&h, (now_s() - t) * 1e6);
+		total += now_s() - t;
+	}
+	close(fd);
+
+	snprintf(extra, sizeof(extra), ",\"p99_ns\":%.0f,\"max_ns\":%.0f,\"publish_ns\":%.0f,\"mean_ns\":%.0f,\"failed\":%d",
+		 hist_quantile_us(&h, 0.99) * 1000, h.max_us * 1000.0, hist_quantile_us(&pub, 0.5) * 1000,
+		 total * 1e9 / CYCLES, failed);
+	// The median rather than the mean is the figure compared between runs
+	report("cycle", CYCLES, hist_quantile_us(&h, 0.5) * CYCLES / 1e6, extra);
+}
+
+// ======================================================================
+
+// Lines of an earlier run's output that name a result we have
+static int compare(const char *path, double tolerance)
+{
+	FILE *f = fopen(path, "r");
+	char line[512], name[32];
+	const char *p;
+	double was;
+	int i, regressions = 0;
+
+	if (f == NULL) {
+		fprintf(stderr, "Unable to open %s\n", path);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if ((p = strstr(line, "\"bench\":\"")) == NULL || sscanf(p + 9, "%31[^\"]", name) != 1)
+			continue;
+		if ((p = strstr(line, "\"ns\":")) == NULL || sscanf(p + 5, "%lf", &was) != 1 || was <= 0)
+			continue;
+		for (i = 0; i < nresults; i++) {
+			if (strcmp(results[i].name, name) != 0)
+				continue;
+			if (results[i].ns > was * (1 + tolerance)) {
+				fprintf(stderr, "%s: %.1f ns, was %.1f ns (+%.0f%%)\n", name, results[i].ns, was,
+					(results[i].ns / was - 1) * 100);
+				regressions++;
+			}
+		}
+	}
+	fclose(f);
+	return regressions > 0;
+}
+
+int main(int argc, char **argv)
+{
+	sim.faults = 0;
+	bench_isr();
+	bench_bmp085();
+	bench_derived();
+	bench_payload();
+	bench_filter();
+	bench_oversample();
+	bench_mcp3008();
+	bench_cycle();
+	if (argc > 1)
+		return compare(argv[1], argc > 2 ? atof(argv[2]) : BENCH_TOLERANCE);
+	return 0;
+}
@@ -0,0 +1,40 @@
+/*
+MQTT broker stand-in
+
+broker.h on its own, for running the simulated daemon end to end without
+a real broker.  Every ten seconds it prints what it has been sent.
+
+	make sim bench
+	./broker 1883 2000 &
+	./weather-station-sim --broker tcp://127.0.0.1:1883
+
+[port] defaults to 1883, [ack_us] to 0: how long before each PUBACK.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "broker.h"
+
+int main(int argc, char **argv)
+{
+	struct broker b;
+	int port = argc > 1 ? atoi(argv[1]) : 1883;
+	long ack_us = argc > 2 ? atol(argv[2]) : 0;
+	unsigned long messages = 0;
+
+	if (broker_start(&b, port, ack_us) != 0) {
+		printf("Unable to listen on 127.0.0.1:%d\n", port);
+		return 1;
+	}
+	printf("Listening on 127.0.0.1:%d, acking after %ld us\n", b.port, ack_us);
+	fflush(stdout);
+	for (;;) {
+		sleep(10);
+		pthread_mutex_lock(&b.lock);
+		if (b.messages != messages)
+			printf("%lu connections, %lu messages, %lu bytes\n", b.connections, b.messages, b.bytes);
+		messages = b.messages;
+		pthread_mutex_unlock(&b.lock);
+		fflush(stdout);
+	}
+}
@@ -0,0 +1,290 @@
+/*
+MQTT broker stand-in
+
+Just enough MQTT 3.1.1 for a publisher: CONNECT gets a CONNACK, a QoS 1
+PUBLISH a PUBACK after ack_us microseconds, PINGREQ a PINGRESP.  Nothing
+is routed anywhere; messages and bytes are counted.  One thread per
+connection, listening on 127.0.0.1.  Setting drop_at makes the stand-in
+hang up on message number drop_at instead of acking it, as a broker that
+goes away mid batch would.
+
+broker_connect() and broker_publish() are the matching client side for
+the benchmarks, which don't link paho.
+*/
+
+#ifndef BENCH_BROKER_H
+#define BENCH_BROKER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+struct broker {
+	int fd;
+	int port;
+	long ack_us;
+	pthread_t acceptor;
+	pthread_mutex_t lock;
+	unsigned long connections;
+	unsigned long messages;
+	unsigned long bytes;
+	unsigned long drop_at;                  // hang up on this message, 0 for never
+};
+
+struct broker_conn {
+	struct broker *b;
+	int fd;
+};
+
+static int broker_read_full(int fd, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = read(fd, (char *)buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+// One packet: the first header byte, and the rest into buf.  Returns its
+// length or -1.
+static long broker_read_packet(int fd, uint8_t *type, uint8_t *buf, size_t max)
+{
+	uint8_t c;
+	long len = 0;
+	int shift = 0;
+
+	if (broker_read_full(fd, type, 1) < 0)
+		return -1;
+	do {
+		if (broker_read_full(fd, &c, 1) < 0 || shift > 21)
+			return -1;
+		len |= (long)(c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	if ((size_t)len > max || broker_read_full(fd, buf, len) < 0)
+		return -1;
+	return len;
+}
+
+static void *broker_serve(void *arg)
+{
+	struct broker_conn *conn = arg;
+	struct broker *b = conn->b;
+	static const uint8_t connack[] = { 0x20, 2, 0, 0 }, pingresp[] = { 0xD0, 0 };
+	struct timespec delay = { b->ack_us / 1000000, b->ack_us % 1000000 * 1000 };
+	uint8_t buf[65536], type, puback[4] = { 0x40, 2 };
+	long len;
+	int topic, drop;
+
+	for (;;) {
+		if ((len = broker_read_packet(conn->fd, &type, buf, sizeof(buf))) < 0)
+			break;
+		switch (type >> 4) {
+		case 1:                         // CONNECT
+			if (write(conn->fd, connack, sizeof(connack)) != sizeof(connack))
+				goto done;
+			break;
+		case 3:                         // PUBLISH
+			pthread_mutex_lock(&b->lock);
+			b->messages++;
+			b->bytes += len;
+			drop = b->messages == b->drop_at;
+			pthread_mutex_unlock(&b->lock);
+			if (drop)
+				goto done;
+			if (((type >> 1) & 3) == 0 || len < 2)
+				break;
+			topic = buf[0] << 8 | buf[1];
+			if (len < topic + 4)
+				goto done;
+			if (b->ack_us > 0)
+				nanosleep(&delay, NULL);
+			puback[2] = buf[2 + topic];
+			puback[3] = buf[3 + topic];
+			if (write(conn->fd, puback, sizeof(puback)) != sizeof(puback))
+				goto done;
+			break;
+		case 12:                        // PINGREQ
+			if (write(conn->fd, pingresp, sizeof(pingresp)) != sizeof(pingresp))
+				goto done;
+			break;
+		case 14:                        // DISCONNECT
+			goto done;
+		}
+	}
+done:
+	close(conn->fd);
+	free(conn);
+	return NULL;
+}
+
+static void *broker_accept(void *arg)
+{
+	struct broker *b = arg;
+	struct broker_conn *conn;
+	pthread_t thread;
+	int fd, one = 1;
+
+	for (;;) {
+		if ((fd = accept(b->fd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return NULL;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if ((conn = malloc(sizeof(*conn))) == NULL) {
+			close(fd);
+			continue;
+		}
+		conn->b = b;
+		conn->fd = fd;
+		pthread_mutex_lock(&b->lock);
+		b->connections++;
+		pthread_mutex_unlock(&b->lock);
+		if (pthread_create(&thread, NULL, broker_serve, conn) != 0) {
+			close(fd);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
+
+// Listen on 127.0.0.1:port, any free port if 0 (b->port has it after)
+int broker_start(struct broker *b, int port, long ack_us)
+{
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof(addr);
+	int one = 1;
+
+	memset(b, 0, sizeof(*b));
+	pthread_mutex_init(&b->lock, NULL);
+	b->ack_us = ack_us;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((b->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	setsockopt(b->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(b->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(b->fd, 16) < 0 ||
+	    getsockname(b->fd, (struct sockaddr *)&addr, &alen) < 0) {
+		close(b->fd);
+		return -1;
+	}
+	b->port = ntohs(addr.sin_port);
+	return pthread_create(&b->acceptor, NULL, broker_accept, b) == 0 ? 0 : -1;
+}
+
+// ======================================================================
+// Client side
+
+static int broker_put_string(uint8_t *p, const char *s)
+{
+	size_t len = strlen(s);
+
+	p[0] = len >> 8;
+	p[1] = len;
+	memcpy(p + 2, s, len);
+	return len + 2;
+}
+
+static int broker_put_length(uint8_t *p, size_t len)
+{
+	int n = 0;
+
+	do {
+		p[n] = len & 0x7F;
+		len >>= 7;
+		if (len)
+			p[n] |= 0x80;
+		n++;
+	} while (len);
+	return n;
+}
+
+// Connect to the stand-in as clientid.  Returns the socket or -1.
+int broker_connect(int port, const char *clientid)
+{
+	struct sockaddr_in addr;
+	uint8_t pkt[256], body[256], type;
+	int fd, n = 0, len, one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto fail;
+
+	len = broker_put_string(body, "MQTT");
+	body[len++] = 4;                        // protocol level 3.1.1
+	body[len++] = 0x02;                     // clean session
+	body[len++] = 0;
+	body[len++] = 20;                       // keep alive
+	len += broker_put_string(body + len, clientid);
+	pkt[n++] = 0x10;
+	n += broker_put_length(pkt + n, len);
+	memcpy(pkt + n, body, len);
+	if (write(fd, pkt, n + len) != n + len)
+		goto fail;
+	if (broker_read_packet(fd, &type, body, sizeof(body)) != 2 || type != 0x20 || body[1] != 0)
+		goto fail;
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+// Publish at QoS 1 and wait for the PUBACK.  Returns 0 once acked.
+int broker_publish(int fd, const char *topic, const void *payload, size_t len)
+{
+	static uint16_t id;
+	uint8_t head[8], tl[2], pid[2], ack[4], type;
+	size_t tlen = strlen(topic);
+	struct iovec iov[5];
+	ssize_t total;
+	int n = 0;
+
+	id = id == 0xFFFF ? 1 : id + 1;
+	head[n++] = 0x32;                       // PUBLISH, QoS 1
+	n += broker_put_length(head + n, 2 + tlen + 2 + len);
+	tl[0] = tlen >> 8;
+	tl[1] = tlen;
+	pid[0] = id >> 8;
+	pid[1] = id;
+	iov[0] = (struct iovec){ head, n };
+	iov[1] = (struct iovec){ tl, 2 };
+	iov[2] = (struct iovec){ (void *)topic, tlen };
+	iov[3] = (struct iovec){ pid, 2 };
+	iov[4] = (struct iovec){ (void *)payload, len };
+	total = n + 2 + tlen + 2 + len;
+	if (writev(fd, iov, 5) != total)
+		return -1;
+	if (broker_read_packet(fd, &type, ack, sizeof(ack)) != 2 || type != 0x40)
+		return -1;
+	return ack[0] == pid[0] && ack[1] == pid[1] ? 0 : -1;
+}
+
+#endif
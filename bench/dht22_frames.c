@@ -0,0 +1,125 @@
+/*
+DHT22 decoder test
+
+Feeds dht22_decode() edge traces built the way the sensor sends them, as
+hal/sim.h does, and checks each result: good frames (one below zero, one
+with a glitch before the response), a bad checksum, a frame cut short, a
+high pulse longer than DHT22_MAX_PULSE_US and a reading outside the
+sensor's range.  Prints one line per case and exits 1 if any is wrong.
+
+	make bench && ./dht22_frames
+*/
+
+#define HAL_NO_WIRINGPI
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../dht22/dht22.h"
+
+#define SHORT_BITS      30              // the sensor stopped answering
+
+struct frame {
+	struct dht22_edge edge[DHT22_MAX_EDGES];
+	int count;
+	uint32_t us;
+};
+
+static void edge(struct frame *f, uint32_t after_us, int level)
+{
+	f->us += after_us;
+	f->edge[f->count++] = (struct dht22_edge){ f->us, level };
+}
+
+// Response pulse then the first bits of data, each a 50us low and a high
+// of 27us for a 0 or 70us for a 1
+static void frame(struct frame *f, const uint8_t data[5], int bits)
+{
+	int i;
+
+	edge(f, 20, 0);
+	edge(f, 80, 1);
+	edge(f, 80, 0);
+	for (i = 0; i < bits; i++) {
+		edge(f, 50, 1);
+		edge(f, data[i / 8] & (0x80 >> (i % 8)) ? 70 : 27, 0);
+	}
+	edge(f, 50, 1);                         // released, the pull-up takes it high
+}
+
+// humidity and temperature in tenths, with the checksum they need
+static void reading(uint8_t data[5], int h10, int t10)
+{
+	data[0] = h10 >> 8;
+	data[1] = h10;
+	data[2] = (abs(t10) >> 8) | (t10 < 0 ? 0x80 : 0);
+	data[3] = abs(t10);
+	data[4] = data[0] + data[1] + data[2] + data[3];
+}
+
+static int failures;
+
+static void check(const char *name, struct frame *f, int want, float want_t, float want_h)
+{
+	float t = NAN, h = NAN;
+	int rc = dht22_decode(f->edge, f->count, &t, &h);
+	int ok = rc == want;
+
+	if (ok && want == DHT22_OK)
+		ok = fabsf(t - want_t) < 0.05 && fabsf(h - want_h) < 0.05;
+	else if (ok)
+		ok = isnan(t) && isnan(h);      // left alone on failure
+	printf("%-12s rc %2d (want %2d)  %.1f C %.1f %%  %s\n", name, rc, want, t, h, ok ? "ok" : "FAIL");
+	failures += !ok;
+}
+
+int main(void)
+{
+	struct frame f;
+	uint8_t data[5];
+	int i;
+
+	reading(data, 652, 215);
+	f = (struct frame){ .count = 0 };
+	frame(&f, data, 40);
+	check("good", &f, DHT22_OK, 21.5, 65.2);
+
+	reading(data, 1000, -101);
+	f = (struct frame){ .count = 0 };
+	frame(&f, data, 40);
+	check("negative", &f, DHT22_OK, -10.1, 100.0);
+
+	// A spike on the line before the sensor answers is ignored
+	reading(data, 437, 3);
+	f = (struct frame){ .count = 0 };
+	edge(&f, 5, 1);
+	edge(&f, 3, 0);
+	frame(&f, data, 40);
+	check("glitch", &f, DHT22_OK, 0.3, 43.7);
+
+	reading(data, 652, 215);
+	data[1] ^= 0x04;
+	f = (struct frame){ .count = 0 };
+	frame(&f, data, 40);
+	check("checksum", &f, DHT22_ERR_CHECKSUM, 0, 0);
+
+	reading(data, 652, 215);
+	f = (struct frame){ .count = 0 };
+	frame(&f, data, SHORT_BITS);
+	check("short", &f, DHT22_ERR_TIMEOUT, 0, 0);
+
+	// The line held high past the longest bit, in the middle of the frame
+	reading(data, 652, 215);
+	f = (struct frame){ .count = 0 };
+	frame(&f, data, 40);
+	for (i = 3 + 2 * 20 + 1; i < f.count; i++)
+		f.edge[i].us += DHT22_MAX_PULSE_US;     // bit 20's fall and everything after
+	check("long pulse", &f, DHT22_ERR_FRAME, 0, 0);
+
+	reading(data, 1010, 215);
+	f = (struct frame){ .count = 0 };
+	frame(&f, data, 40);
+	check("range", &f, DHT22_ERR_RANGE, 0, 0);
+
+	return failures > 0;
+}
@@ -0,0 +1,96 @@
+/*
+Outbox drain test
+
+Runs the outbox against a broker stand-in that can be stopped and started.
+Time is simulated a second at a time: a reading is produced every minute
+and, as in the daemon, goes to the outbox when the broker is down; the
+drain runs every second once it is back.  The stand-in acknowledges a
+batch after ACK_LATENCY_US of real time, roughly a LAN round trip, and
+checks that readings arrive oldest first with nothing missing that wasn't
+dropped.
+
+	make bench && ./outbox_drain [drain rate] [outage hours]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../mqtt/outbox.h"
+#include "synth.h"
+
+#define ACK_LATENCY_US  2000
+
+struct broker {
+	int up;
+	unsigned long batches;
+	unsigned long readings;
+	unsigned long out_of_order;
+	uint32_t last_ts;
+};
+
+static int broker_publish(void *ctx, const char *payload)
+{
+	struct broker *b = ctx;
+	const char *p = payload;
+	struct timespec rtt = { 0, ACK_LATENCY_US * 1000L };
+	unsigned long ts;
+
+	if (!b->up)
+		return -1;
+	nanosleep(&rtt, NULL);
+	while ((p = strstr(p, "{\"ts\":")) != NULL) {
+		ts = strtoul(p + 6, NULL, 10);
+		if (ts <= b->last_ts)
+			b->out_of_order++;
+		b->last_ts = ts;
+		b->readings++;
+		p++;
+	}
+	b->batches++;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static struct outbox ob;
+	struct broker b = { 1 };
+	int rate = argc > 1 ? atoi(argv[1]) : OUTBOX_DRAIN_RATE;
+	int outage_h = argc > 2 ? atoi(argv[2]) : 24;
+	int64_t down = BENCH_START + 3600;
+	int64_t up = down + outage_h * 3600LL;
+	int64_t now, drained = 0;
+	double t, wall = 0;
+	float v[CH_COUNT];
+	unsigned long queued = 0;
+	int i = 0;
+
+	outbox_open(&ob, "/dev/null", OUTBOX_MAX_AGE, rate);    // can't map, memory only
+
+	for (now = BENCH_START; now < up + 86400; now++) {
+		b.up = now < down || now >= up;
+
+		// Readings published live aren't part of the backlog
+		if (now % 60 == 0) {
+			synth(i++, v);
+			if (!b.up) {
+				outbox_push(&ob, now, v, CH_ALL);
+				queued++;
+			}
+		}
+
+		if (b.up && outbox_count(&ob) > 0) {
+			t = now_s();
+			outbox_drain(&ob, now, broker_publish, &b);
+			wall += now_s() - t;
+			if (outbox_count(&ob) == 0 && drained == 0)
+				drained = now;
+		}
+	}
+
+	printf("outage:  %d h, %lu readings queued, %llu dropped\n", outage_h, queued, (unsigned long long)ob.s->dropped);
+	printf("drain:   %d batches/s of %d, backlog cleared %lld s after the broker came back\n",
+	       rate, OUTBOX_BATCH, (long long)(drained ? drained - up : -1));
+	printf("rate:    %.0f readings/s simulated, %.0f readings/s of real send time, %lu batches\n",
+	       drained > up ? (double)b.readings / (drained - up) : 0.0, b.readings / wall, b.batches);
+	printf("order:   %lu delivered, %lu out of order\n", b.readings, b.out_of_order);
+	return b.out_of_order || b.readings + ob.s->dropped != queued;
+}
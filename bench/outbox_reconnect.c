@@ -0,0 +1,102 @@
+/*
+Outbox over a dropped connection
+
+The real publisher against the broker stand-in in broker.h, which hangs up
+in the middle of the traffic instead of acking.  Two cases:
+
+  cycle     a full window of messages pipelined, the connection dropped
+            after DROP_AT of them; publisher_flush() must count the ones
+            that were in flight as unacknowledged
+  backlog   the outbox drained as the daemon does, the connection dropped
+            on one batch; that batch must stay queued and go out again
+            after the reconnect, so every reading is delivered once acked
+
+Exits 1 if either fails.
+
+	make bench && ./outbox_reconnect
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../mqtt/publisher.h"
+#include "../mqtt/outbox.h"
+#include "broker.h"
+#include "synth.h"
+
+#define ACK_US          2000
+#define DROP_AT         3
+#define BACKLOG         (10 * OUTBOX_BATCH)
+#define TIMEOUT_MS      5000
+
+static struct publisher pub;
+
+// As the daemon's: a batch only leaves the outbox once it is acknowledged
+static int send_backlog(void *ctx, const char *payload)
+{
+	publisher_begin_cycle(&pub);
+	if (publisher_send(&pub, "bench/backlog", payload, TIMEOUT_MS) != 0)
+		return -1;
+	return publisher_flush(&pub, TIMEOUT_MS) == 0 ? 0 : -1;
+}
+
+int main(void)
+{
+	static struct outbox ob;
+	struct broker b;
+	char address[64], payload[16];
+	float v[CH_COUNT];
+	unsigned long batches = 0, messages;
+	int i, unacked, tries, fail = 0;
+
+	if (broker_start(&b, 0, ACK_US) != 0) {
+		printf("Unable to start the broker stand-in\n");
+		return 1;
+	}
+	snprintf(address, sizeof(address), "tcp://127.0.0.1:%d", b.port);
+	if (publisher_init(&pub, address, "outbox_reconnect", 1) != 0 || publisher_connect(&pub) != 0) {
+		printf("Unable to connect to %s\n", address);
+		return 1;
+	}
+
+	// A cycle with the connection lost part way through
+	b.drop_at = DROP_AT;
+	publisher_begin_cycle(&pub);
+	for (i = 0; i < PUBLISHER_WINDOW; i++) {
+		snprintf(payload, sizeof(payload), "%d", i);
+		publisher_send(&pub, "bench/cycle", payload, TIMEOUT_MS);
+	}
+	unacked = publisher_flush(&pub, TIMEOUT_MS);
+	printf("cycle:   %d sent, %lu failed, %d unacknowledged, %lu lost with the connection\n",
+	       PUBLISHER_WINDOW, pub.failed, unacked, pub.lost);
+	if (unacked == 0 || pub.lost == 0) {
+		printf("FAIL: messages lost with the connection counted as delivered\n");
+		fail = 1;
+	}
+
+	// A backlog drained with the connection lost on its third batch
+	outbox_open(&ob, "/dev/null", OUTBOX_MAX_AGE, 1);       // can't map, memory only
+	for (i = 0; i < BACKLOG; i++) {
+		synth(i, v);
+		outbox_push(&ob, BENCH_START + i * 60, v, CH_ALL);
+	}
+	pthread_mutex_lock(&b.lock);
+	messages = b.messages;
+	b.drop_at = messages + 3;
+	pthread_mutex_unlock(&b.lock);
+	for (tries = 0; outbox_count(&ob) > 0 && tries < 2 * BACKLOG; tries++)
+		if (outbox_drain(&ob, BENCH_START + BACKLOG * 60, send_backlog, NULL) > 0)
+			batches++;
+
+	pthread_mutex_lock(&b.lock);
+	messages = b.messages - messages;
+	pthread_mutex_unlock(&b.lock);
+	printf("backlog: %d readings, %llu sent in %lu batches, %lu messages to the broker, %u still queued\n",
+	       BACKLOG, (unsigned long long)ob.s->sent, batches, messages, outbox_count(&ob));
+	if (ob.s->sent != BACKLOG || outbox_count(&ob) != 0 || messages != batches + 1) {
+		printf("FAIL: the batch in flight when the connection dropped wasn't sent again\n");
+		fail = 1;
+	}
+
+	publisher_close(&pub);
+	return fail;
+}
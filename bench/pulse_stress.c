@@ -0,0 +1,130 @@
+/*
+Pulse ring stress test
+
+A producer thread pushes a known edge pattern into a pulse ring as fast as
+it can, as the wiringPi ISR threads would, while this thread drains it
+with pulse_drain().  Each pulse is an edge followed by PATTERN_BOUNCES
+bounces a millisecond apart, well inside the debounce, and pulses are
+PATTERN_GAP_NS apart, well outside it.
+
+The first pass never waits, so the ring fills and pushes are dropped: every
+edge pushed must be either drained or counted in ring.dropped, and the
+drained edges must come out in the order they went in.  The second pass
+waits for room, so nothing is lost and the debounced count and bounces
+must come out exactly.  Exits 1 if any check fails.
+
+	make bench && ./pulse_stress [edges]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../pulses/pulses.h"
+
+#define STRESS_EDGES            3000000
+#define PATTERN_BOUNCES         2               // after each real edge
+#define PATTERN_BOUNCE_NS       1000000ULL
+#define PATTERN_GAP_NS          20000000ULL
+#define PATTERN_DEBOUNCE_NS     5000000ULL
+
+static struct pulse_source src;
+static long edges;
+static int wait;                                // for room, rather than dropping
+static atomic_int done;
+
+static unsigned long pushed, failed;            // producer side
+static unsigned long out_of_order, strays;
+static uint64_t last;
+
+// Timestamp of edge i of the pattern
+static uint64_t pattern(long i)
+{
+	long pulse = i / (PATTERN_BOUNCES + 1);
+	long bounce = i % (PATTERN_BOUNCES + 1);
+
+	return 1000000000ULL + pulse * PATTERN_GAP_NS + bounce * PATTERN_BOUNCE_NS;
+}
+
+static void *producer(void *arg)
+{
+	long i;
+
+	for (i = 0; i < edges; i++) {
+		pushed++;
+		while (pulse_ring_push(&src.ring, pattern(i)) != 0) {
+			failed++;
+			if (!wait)
+				break;
+		}
+	}
+	done = 1;
+	return NULL;
+}
+
+// Sees every edge drained; they must be increasing and from the pattern
+static void tap(struct pulse_source *s, uint64_t ts)
+{
+	uint64_t off = ts - pattern(0);
+
+	if (ts <= last && s->edges > 0)
+		out_of_order++;
+	if (ts < pattern(0) || off % PATTERN_GAP_NS > PATTERN_BOUNCES * PATTERN_BOUNCE_NS ||
+	    off % PATTERN_GAP_NS % PATTERN_BOUNCE_NS != 0)
+		strays++;
+	last = ts;
+}
+
+static void run(int waiting)
+{
+	pthread_t thread;
+	struct timespec pause = { 0, 20000 };
+	long n = 0;
+
+	src = (struct pulse_source){ .name = "stress", .debounce_ns = PATTERN_DEBOUNCE_NS, .tap = tap };
+	wait = waiting;
+	done = 0;
+	pushed = failed = out_of_order = strays = 0;
+
+	pthread_create(&thread, NULL, producer, NULL);
+	while (!done) {
+		pulse_drain(&src, NULL, NULL);
+		// Now and then fall behind, so the ring fills
+		if (++n % 64 == 0)
+			nanosleep(&pause, NULL);
+	}
+	pthread_join(thread, NULL);
+	pulse_drain(&src, NULL, NULL);
+}
+
+int main(int argc, char **argv)
+{
+	long pulses;
+	int fail = 0;
+
+	edges = argc > 1 ? atol(argv[1]) : STRESS_EDGES;
+	edges -= edges % (PATTERN_BOUNCES + 1);         // whole pulses only
+	pulses = edges / (PATTERN_BOUNCES + 1);
+
+	run(0);
+	printf("dropping: %lu pushed, %lu drained, %lu dropped, %lu out of order, %lu not from the pattern\n",
+	       pushed, src.edges, src.ring.dropped, out_of_order, strays);
+	if (src.edges + src.ring.dropped != pushed || src.ring.dropped != failed || src.count + src.bounces != src.edges ||
+	    out_of_order || strays) {
+		printf("FAIL: edges lost or reordered\n");
+		fail = 1;
+	}
+
+	run(1);
+	printf("waiting:  %lu pushed, %lu drained, %lu pulses, %lu bounces, ring full %lu times\n",
+	       pushed, src.edges, src.count, src.bounces, src.ring.dropped);
+	if (src.edges != pushed || src.count != (unsigned long)pulses || src.bounces != (unsigned long)pulses * PATTERN_BOUNCES ||
+	    out_of_order || strays) {
+		printf("FAIL: expected %ld pulses and %ld bounces\n", pulses, pulses * PATTERN_BOUNCES);
+		fail = 1;
+	}
+
+	if (!fail)
+		printf("ok\n");
+	return fail;
+}
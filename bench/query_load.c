@@ -0,0 +1,186 @@
+/*
+Query server load test
+
+Fills a store with a year of synthetic history, starts the query server on
+a temporary socket and points QUERY_LOAD_CLIENTS client threads at it,
+each sending a mix of raw, rollup and long range queries.  Meanwhile a
+stand-in for the sensor loop appends a sample every 10ms and times each
+append, which is what would show up as a stall in acquisition.
+
+	make bench && ./query_load [clients] [queries per client]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../query/server.h"
+#include "synth.h"
+
+#define QUERY_LOAD_CLIENTS      48
+#define QUERY_LOAD_QUERIES      50
+#define QUERY_LOAD_SENSOR_MS    10
+
+static struct store st;
+static struct rollup ru;
+static struct query_server qs;
+static char socket_path[128];
+static volatile int running = 1;
+
+static int queries_per_client = QUERY_LOAD_QUERIES;
+static double *latency;                         // ms, one per query
+static unsigned long bytes_read;
+static unsigned long failures;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double sensor_max_ms;
+static unsigned long sensor_appends;
+
+static const char *mix[] = {
+	"channel=temperature from=%lld to=%lld step=raw\n",                  // one day raw
+	"channel=pressure from=%lld to=%lld step=1h agg=mean\n",              // one week hourly
+	"channel=rain from=%lld to=%lld step=1d\n",                           // the year, daily sums
+	"channel=windgust from=%lld to=%lld agg=all\n",                       // a month, auto
+};
+static const int64_t mix_range[] = { 86400, 7 * 86400, 365 * 86400LL, 30 * 86400 };
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void *client(void *arg)
+{
+	long id = (long)arg;
+	struct sockaddr_un addr;
+	char req[256], buf[16384];
+	unsigned long got = 0, failed = 0;
+	int i, fd, k;
+	ssize_t n;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	for (i = 0; i < queries_per_client; i++) {
+		int64_t to = BENCH_START + (BENCH_SAMPLES - 1) * 60LL - (id * 7919 + i * 104729) % (180 * 86400LL);
+		double t;
+
+		k = (id + i) % 4;
+		snprintf(req, sizeof(req), mix[k], (long long)(to - mix_range[k]), (long long)to);
+
+		t = now_s();
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		    connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		    write(fd, req, strlen(req)) != (ssize_t)strlen(req)) {
+			failed++;
+			if (fd >= 0)
+				close(fd);
+			latency[id * queries_per_client + i] = NAN;
+			continue;
+		}
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			got += n;
+		if (n < 0)
+			failed++;
+		close(fd);
+		latency[id * queries_per_client + i] = (now_s() - t) * 1000;
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	bytes_read += got;
+	failures += failed;
+	pthread_mutex_unlock(&stats_lock);
+	return NULL;
+}
+
+// Stand-in for the publish task: one sample every QUERY_LOAD_SENSOR_MS
+static void *sensor(void *arg)
+{
+	int64_t ts = BENCH_START + BENCH_SAMPLES * 60LL;
+	struct timespec pause = { 0, QUERY_LOAD_SENSOR_MS * 1000000L };
+	float v[CH_COUNT];
+	int i = 0;
+
+	while (running) {
+		double t = now_s();
+		synth(i++, v);
+		store_append(&st, ts, v);
+		rollup_add(&ru, ts, v);
+		t = (now_s() - t) * 1000;
+		if (t > sensor_max_ms)
+			sensor_max_ms = t;
+		sensor_appends++;
+		ts += 60;
+		nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	char dir[] = "/tmp/query_load.XXXXXX";
+	char cmd[64];
+	pthread_t *clients, sensor_thread;
+	int nclients = QUERY_LOAD_CLIENTS;
+	int total, ok, i;
+	double t, elapsed;
+	float v[CH_COUNT];
+
+	if (argc > 1)
+		nclients = atoi(argv[1]);
+	if (argc > 2)
+		queries_per_client = atoi(argv[2]);
+	if (nclients <= 0 || queries_per_client <= 0 || mkdtemp(dir) == NULL)
+		return 1;
+
+	store_open(&st, dir, 600);
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		synth(i, v);
+		store_append(&st, BENCH_START + i * 60LL, v);
+	}
+	store_flush(&st);
+	t = now_s();
+	rollup_open(&ru, &st);
+	printf("rollups: built from a year of history in %.2f s\n", now_s() - t);
+
+	snprintf(socket_path, sizeof(socket_path), "%s/%s", dir, QUERY_SOCKET_NAME);
+	if (query_start(&qs, &st, &ru, socket_path, 0, NULL, NULL) != 0) {
+		printf("Unable to start the query server on %s\n", socket_path);
+		return 1;
+	}
+
+	total = nclients * queries_per_client;
+	latency = calloc(total, sizeof(double));
+	clients = calloc(nclients, sizeof(pthread_t));
+	pthread_create(&sensor_thread, NULL, sensor, NULL);
+
+	t = now_s();
+	for (i = 0; i < nclients; i++)
+		pthread_create(&clients[i], NULL, client, (void *)(long)i);
+	for (i = 0; i < nclients; i++)
+		pthread_join(clients[i], NULL);
+	elapsed = now_s() - t;
+	running = 0;
+	pthread_join(sensor_thread, NULL);
+
+	// Drop the failed queries (NAN) before taking percentiles
+	for (ok = 0, i = 0; i < total; i++) {
+		if (!isnan(latency[i]))
+			latency[ok++] = latency[i];
+	}
+	qsort(latency, ok, sizeof(double), compare_double);
+
+	printf("clients: %d x %d queries, %d worker threads\n", nclients, queries_per_client, QUERY_THREADS);
+	printf("queries: %d ok, %lu failed, %lu rejected, %.0f queries/s, %.1f MB returned\n",
+	       ok, failures, qs.rejected, ok / elapsed, bytes_read / 1e6);
+	if (ok > 0)
+		printf("latency: p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+		       latency[ok / 2], latency[ok * 99 / 100], latency[ok - 1]);
+	printf("sensor:  %lu appends, slowest %.3f ms\n", sensor_appends, sensor_max_ms);
+
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	if (system(cmd) != 0)
+		printf("Unable to remove %s\n", dir);
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+History store benchmark
+
+Writes a year of one-a-minute synthetic samples shaped like the station's
+channels through the store, packs each month, and reports the compression
+ratio and how fast the packed history decodes.  Every value read back
+must be the one appended, rounded to the places its channel publishes;
+exits 1 if any isn't.  Needs no hardware.
+
+	make bench && ./store_bench [dir]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../store/store.h"
+#include "synth.h"
+
+static float (*appended)[CH_COUNT];
+static unsigned long mismatched;
+
+static int count_visit(void *ctx, int64_t ts, const float *values, int columns)
+{
+	double *sum = ctx;
+	sum[0] += 1;
+	sum[1] += values[CH_TEMPERATURE];
+	return 0;
+}
+
+static int check_visit(void *ctx, int64_t ts, const float *values, int columns)
+{
+	const float *v = appended[(ts - BENCH_START) / 60];
+	int c;
+
+	for (c = 0; c < columns; c++) {
+		float scale = powf(10, channels[c].decimals);
+		if (values[c] != roundf(v[c] * scale) / scale)
+			mismatched++;
+	}
+	return 0;
+}
+
+static off_t dir_bytes(struct store *st, const char *ext)
+{
+	char path[256];
+	struct stat sb;
+	off_t total = 0;
+	int month;
+
+	for (month = store_month_of(BENCH_START); month <= store_month_of(BENCH_START + BENCH_SAMPLES * 60LL); month++) {
+		snprintf(path, sizeof(path), "%s/%04d-%02d.%s", st->dir, month / 12, month % 12 + 1, ext);
+		if (stat(path, &sb) == 0)
+			total += sb.st_size;
+	}
+	return total;
+}
+
+int main(int argc, char **argv)
+{
+	static struct store st;
+	char dir[] = "/tmp/store_bench.XXXXXX";
+	float v[CH_COUNT];
+	double sum[2], t, elapsed;
+	off_t raw, packed;
+	int64_t end = BENCH_START + (BENCH_SAMPLES - 1) * 60LL;
+	int month;
+	int i;
+
+	appended = malloc(BENCH_SAMPLES * sizeof(*appended));
+	if (appended == NULL)
+		return 1;
+	if (argc > 1)
+		snprintf(dir, sizeof(dir), "%s", argv[1]);
+	else if (mkdtemp(dir) == NULL)
+		return 1;
+	if (store_open(&st, dir, 1 << 30) < 0) {
+		printf("Unable to create %s\n", dir);
+		return 1;
+	}
+
+	// The store packs each month as the next one starts; the last one is
+	// still open, so size it raw and then pack it too.
+	t = now_s();
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		synth(i, v);
+		store_append(&st, BENCH_START + i * 60LL, v);
+		memcpy(appended[i], v, sizeof(v));
+	}
+	store_flush(&st);
+	elapsed = now_s() - t;
+	printf("append:  %d samples in %.2f s (%.0f samples/s, includes packing)\n",
+	       BENCH_SAMPLES, elapsed, BENCH_SAMPLES / elapsed);
+
+	raw = (off_t)BENCH_SAMPLES * sizeof(struct store_sample) + 12 * sizeof(struct store_header);
+	month = st.month;
+	close(st.fd);
+	st.fd = -1;
+	store_compact(&st, month);
+	packed = dir_bytes(&st, "gor");
+	printf("size:    raw %lld bytes, packed %lld bytes, ratio %.2f, %.2f bytes/sample\n",
+	       (long long)raw, (long long)packed, (double)raw / packed, (double)packed / BENCH_SAMPLES);
+
+	memset(sum, 0, sizeof(sum));
+	t = now_s();
+	store_scan(&st, BENCH_START, end, count_visit, sum);
+	elapsed = now_s() - t;
+	printf("decode:  %.0f samples in %.3f s (%.0f samples/s, %.1f MB/s raw equivalent)\n",
+	       sum[0], elapsed, sum[0] / elapsed, sum[0] * sizeof(struct store_sample) / elapsed / 1e6);
+
+	memset(sum, 0, sizeof(sum));
+	t = now_s();
+	store_scan(&st, BENCH_START + 200 * 86400LL, BENCH_START + 201 * 86400LL - 1, count_visit, sum);
+	elapsed = now_s() - t;
+	printf("one day: %.0f samples in %.3f ms\n", sum[0], elapsed * 1000);
+
+	store_scan(&st, BENCH_START, end, check_visit, NULL);
+	printf("check:   %lu values differ from those appended\n", mismatched);
+
+	if (argc <= 1) {
+		char cmd[64];
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+		if (system(cmd) != 0)
+			printf("Unable to remove %s\n", dir);
+	}
+	return mismatched > 0;
+}
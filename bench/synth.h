@@ -0,0 +1,73 @@
+/*
+Synthetic station data for the benchmarks
+
+One sample a minute shaped like the real channels: daily and yearly
+temperature cycles at the BMP085's 0.1 degree resolution, slowly wandering
+pressure, ADC counts for light and UV, gusty wind and the odd rainy day.
+Deterministic, so runs are comparable.
+*/
+
+#ifndef BENCH_SYNTH_H
+#define BENCH_SYNTH_H
+
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include "../readings.h"
+
+#define BENCH_START     1767225600              // 2026-01-01 00:00 UTC
+#define BENCH_SAMPLES   (365 * 24 * 60)
+
+static uint32_t seed = 12345;
+
+static float noise(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 8) & 0xFFFF) / 65536.0 - 0.5;
+}
+
+// Round to the resolution a sensor reports at
+static float quantize(float v, float step)
+{
+	return roundf(v / step) * step;
+}
+
+static void synth(int i, float *v)
+{
+	static float pressure = 101300;         // Pa, as the channel
+	static int rain_tips;
+	double day = 2 * M_PI * (i % 1440) / 1440.0;
+	double year = 2 * M_PI * i / (double)BENCH_SAMPLES;
+	float sun = fmaxf(0, -cos(day));
+	float wind = fmaxf(0, 12 + 8 * sin(year * 50) + 4 * noise());
+
+	pressure += noise() * 5;
+	if (i % 1440 == 0)
+		rain_tips = 0;
+	if (sin(year * 37) > 0.8 && noise() > 0.3)
+		rain_tips++;
+
+	v[CH_TEMPERATURE] = quantize(10 - 8 * cos(year) - 5 * cos(day) + 0.2 * noise(), 0.1);
+	v[CH_DEWPOINT] = v[CH_TEMPERATURE] - 4 - 2 * noise();
+	v[CH_PRESSURE] = quantize(pressure, 1);
+	v[CH_LIGHT] = quantize(1000 * sun + 10 * noise(), 1);
+	v[CH_UVI] = quantize(300 * sun * sun + 5 * noise(), 1);
+	v[CH_ABS_HUM] = 7 + 3 * cos(year) + 0.1 * noise();
+	v[CH_WINDSPEED] = quantize(wind, 0.02);
+	v[CH_WINDSPEED_10M] = quantize(wind * 0.95, 0.004);
+	v[CH_WINDGUST] = quantize(wind * 1.5, 0.2);
+	v[CH_WINDLULL] = quantize(wind * 0.5, 0.2);
+	v[CH_RAIN] = rain_tips * 0.2794;
+	v[CH_RAIN_1H] = 0;
+	v[CH_RAIN_24H] = v[CH_RAIN];
+	v[CH_RAIN_RATE] = 0;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
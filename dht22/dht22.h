@@ -0,0 +1,169 @@
+/*
+DHT22 / AM2302 reader
+
+Replaces the call out to Adafruit's python script.  dht22_start() and
+dht22_capture() wake the sensor and record the time of every level change
+on the data line, dht22_decode() turns those edge timestamps into the 40 bit
+frame.  The decoder does no I/O so it can be fed recorded edge traces.
+Built with -DHAL_NO_WIRINGPI only the decoder is there.
+
+Frame format (MSB first): 16 bit humidity x10, 16 bit temperature x10 with
+the top bit as sign, 8 bit checksum of the first four bytes.  Each bit is a
+~50us low followed by a high of ~27us for a 0 or ~70us for a 1.
+*/
+
+#ifndef DHT22_H
+#define DHT22_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sched.h>
+#ifndef HAL_NO_WIRINGPI
+#include <wiringPi.h>
+#endif
+
+#define DHT22_PIN               7               // wiringPi pin 7 = BCM GPIO 4
+#define DHT22_START_MS          10              // host start signal, datasheet 1-10ms
+#define DHT22_CAPTURE_US        10000           // whole frame is ~5ms
+#define DHT22_MAX_EDGES         100             // 2 response + 80 data + a few spare
+#define DHT22_BIT_THRESHOLD_US  50              // high longer than this is a 1
+#define DHT22_MAX_PULSE_US      120
+#define DHT22_MIN_INTERVAL_MS   2000            // sensor needs 2s between reads
+#define DHT22_DEADLINE_MS       5000            // give up on a sample after this
+
+#define DHT22_OK                0
+#define DHT22_ERR_TIMEOUT       -1              // too few edges, sensor didn't answer
+#define DHT22_ERR_FRAME         -2              // pulse widths make no sense
+#define DHT22_ERR_CHECKSUM      -3
+#define DHT22_ERR_RANGE         -4              // decoded but outside sensor range
+
+struct dht22_edge {
+	uint32_t us;                            // time since the start of the capture
+	uint8_t level;                          // line level after this edge
+};
+
+// Kept by the thread reading the sensor, read by the metrics scrape
+struct dht22_stats {
+	atomic_ulong reads;
+	atomic_ulong retries;
+	atomic_ulong failures;
+	atomic_int last_error;
+};
+
+struct dht22_stats dht22_stats;
+
+// ======================================================================
+// Decode a captured edge trace.  Only the last 40 high pulses are used so
+// the sensor's 80us response pulse and any glitch before it are ignored.
+
+int dht22_decode(const struct dht22_edge *edges, int count, float *temperature, float *humidity)
+{
+	uint32_t width[DHT22_MAX_EDGES];
+	uint8_t data[5] = { 0, 0, 0, 0, 0 };
+	int pulses = 0;
+	int first;
+	int i;
+
+	for (i = 0; i + 1 < count && pulses < DHT22_MAX_EDGES; i++) {
+		if (edges[i].level == 1 && edges[i + 1].level == 0)
+			width[pulses++] = edges[i + 1].us - edges[i].us;
+	}
+	if (pulses < 40)
+		return DHT22_ERR_TIMEOUT;
+
+	first = pulses - 40;
+	for (i = 0; i < 40; i++) {
+		if (width[first + i] > DHT22_MAX_PULSE_US)
+			return DHT22_ERR_FRAME;
+		data[i / 8] <<= 1;
+		if (width[first + i] > DHT22_BIT_THRESHOLD_US)
+			data[i / 8] |= 1;
+	}
+
+	if (((data[0] + data[1] + data[2] + data[3]) & 0xFF) != data[4])
+		return DHT22_ERR_CHECKSUM;
+
+	float h = ((data[0] << 8) | data[1]) / 10.0;
+	float t = (((data[2] & 0x7F) << 8) | data[3]) / 10.0;
+	if (data[2] & 0x80)
+		t = -t;
+
+	if (h > 100.0 || t < -40.0 || t > 80.0)
+		return DHT22_ERR_RANGE;
+
+	*humidity = h;
+	*temperature = t;
+	return DHT22_OK;
+}
+
+#ifndef HAL_NO_WIRINGPI
+
+// ======================================================================
+// A read is two steps so the caller need not block during the start
+// signal: dht22_start() pulls the line low, and at least DHT22_START_MS
+// later dht22_capture() releases it and records edges until the frame is
+// complete.  The capture runs at real time priority for the ~5ms the frame
+// takes, like the Adafruit driver, so we are not scheduled out in the
+// middle of a bit.  Returns the number of edges recorded.
+
+static uint32_t dht22_micros(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+void dht22_start(int pin)
+{
+	pinMode(pin, OUTPUT);
+	digitalWrite(pin, LOW);
+}
+
+int dht22_capture(int pin, struct dht22_edge *edges, int max)
+{
+	struct sched_param param, saved_param;
+	int saved_policy;
+	struct timespec start;
+	int count = 0;
+	int level, last;
+	uint32_t now;
+
+	saved_policy = sched_getscheduler(0);
+	sched_getparam(0, &saved_param);
+	param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+	sched_setscheduler(0, SCHED_FIFO, &param);     // best effort, needs root
+
+	pinMode(pin, INPUT);                    // release, the pull-up takes the line high
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = digitalRead(pin);
+	do {
+		level = digitalRead(pin);
+		now = dht22_micros(&start);
+		if (level != last) {
+			edges[count].us = now;
+			edges[count].level = level;
+			count++;
+			last = level;
+		}
+	} while (count < max && now < DHT22_CAPTURE_US);
+
+	sched_setscheduler(0, saved_policy, &saved_param);
+	return count;
+}
+
+// Finish a read started with dht22_start().  temperature/humidity are only
+// written on success.
+int dht22_collect(int pin, float *temperature, float *humidity)
+{
+	struct dht22_edge edges[DHT22_MAX_EDGES];
+	int count;
+
+	count = dht22_capture(pin, edges, DHT22_MAX_EDGES);
+	return dht22_decode(edges, count, temperature, humidity);
+}
+
+#endif /* HAL_NO_WIRINGPI */
+
+#endif
@@ -0,0 +1,281 @@
+/*
+Hardware abstraction
+
+The sensor tasks only reach the hardware through the hal_*() calls, which
+go to one of three backends picked with --hal:
+
+  real          wiringPi interrupts, the MCP3008 on GPIO or SPI, the BMP085s
+                on I2C and the DHT22 on its pin
+  sim[:opts]    synthetic weather with noise, sensor faults and pulse
+                storms, see sim.h
+  replay:FILE   plays back a file written with --record
+
+sim and replay run on the virtual clock (scheduler/clock.h), so a day of
+samples takes seconds, and go through the same BMP085 compensation, DHT22
+decoder, pulse debouncing, filters and MQTT output as the real thing.
+
+--record FILE writes every raw sample that comes through here to FILE, one
+per line, whatever the backend.  <ns> is CLOCK_REALTIME.
+
+  S <ns> <backend>                      first line, the clock when recording started
+  A <ns> <mask> <code0> ... <code7>     MCP3008 scan, mask -1 if it failed
+  C <ns> <ac1> ... <md> <dev>           BMP085 calibration on open, C <ns> -1 <dev> if it failed
+  T <ns> <ut> <dev>                     BMP085 raw temperature, -1 if the read failed
+                                        and -2 if starting the conversion did
+  P <ns> <up> <dev>                     raw pressure, -1 if the read failed
+  D <ns> <rc> <temperature> <humidity>  DHT22 read
+  E <ns> <source>                       an edge on the rain or wind input
+
+<dev> is the BMP085's bus:address, /dev/i2c-1:77.  Recordings made with
+a single BMP085 before there could be several leave it out.
+
+Include after the sensor drivers.  Built with -DHAL_NO_WIRINGPI (make sim)
+the real backend is left out and the daemon runs on any Linux box.
+*/
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "../scheduler/clock.h"
+#include "../pulses/pulses.h"
+#include "../mcp3008/mcp3008_spi.h"
+#include "../log/log.h"
+
+#ifdef HAL_NO_WIRINGPI
+#define HAL_DEFAULT_BACKEND "sim"
+#else
+#define HAL_DEFAULT_BACKEND "real"
+#endif
+
+#define HAL_BMP085_MAX          4
+
+struct hal_backend {
+	const char *name;
+	int (*open)(const char *arg);           // returns 0 on success
+	int (*adc_scan)(struct mcp3008_scan *scan);
+	int (*bmp085_open)(struct bmp085 *dev);
+	void (*bmp085_close)(struct bmp085 *dev);
+	int (*bmp085_start_ut)(struct bmp085 *dev);
+	int (*bmp085_read_ut_start_up)(struct bmp085 *dev, unsigned int *ut);
+	int (*bmp085_read_up)(struct bmp085 *dev, unsigned int *up);
+	void (*dht22_start)(void);
+	int (*dht22_collect)(float *temperature, float *humidity);
+	void (*pulses)(void);                   // queue the rain and wind edges due by now
+};
+
+struct hal {
+	const struct hal_backend *backend;
+	const char *arg;                        // after the ':' in --hal
+
+	// Filled in by the daemon before hal_open()
+	struct pulse_source *rain, *wind;
+	void (*rain_isr)(void);
+	void (*wind_isr)(void);
+	int rain_pin, wind_pin, dht22_pin;
+	uint8_t adc_channels;                   // mcp3008 channels read every scan
+	int adc_use_spi;                        // through /dev/spidev instead of bit-banging
+	struct mcp3008_spi adc_spi;
+
+	FILE *record;
+	int64_t record_offset;                  // CLOCK_REALTIME - CLOCK_MONOTONIC, for edges
+
+	struct bmp085 *bmp085[HAL_BMP085_MAX];  // in the order they were first opened
+	int bmp085_count;
+};
+
+struct hal hal;
+
+// For backends that keep state per BMP085: the sensor's slot, or -1 if
+// there are more than HAL_BMP085_MAX.  Only the virtual clock backends use
+// it, which run every task on one thread.
+static int hal_bmp085_index(struct bmp085 *dev)
+{
+	int i;
+
+	for (i = 0; i < hal.bmp085_count; i++)
+		if (hal.bmp085[i] == dev)
+			return i;
+	if (i == HAL_BMP085_MAX)
+		return -1;
+	hal.bmp085[hal.bmp085_count++] = dev;
+	return i;
+}
+
+// bus:address, the <dev> of the record lines
+static const char *hal_bmp085_name(const struct bmp085 *dev, char *buf, size_t size)
+{
+	snprintf(buf, size, "%s:%02x", dev->bus, dev->address);
+	return buf;
+}
+
+#include "real.h"
+#include "sim.h"
+#include "replay.h"
+
+static const struct hal_backend hal_backends[] = {
+#ifndef HAL_NO_WIRINGPI
+	{ "real", hal_real_open, hal_real_adc_scan, bmp085_Open, bmp085_Close, bmp085_StartUT,
+	  bmp085_ReadUTStartUP, bmp085_ReadUP, hal_real_dht22_start, hal_real_dht22_collect, NULL },
+#endif
+	{ "sim", sim_open, sim_adc_scan, sim_bmp085_open, sim_bmp085_close, sim_bmp085_start_ut,
+	  sim_bmp085_read_ut_start_up, sim_bmp085_read_up, sim_dht22_start, sim_dht22_collect, sim_pulses },
+	{ "replay", replay_open, replay_adc_scan, replay_bmp085_open, replay_bmp085_close, replay_bmp085_start_ut,
+	  replay_bmp085_read_ut_start_up, replay_bmp085_read_up, replay_dht22_start, replay_dht22_collect, replay_pulses },
+};
+
+// "name" or "name:arg".  Returns 0 if there is such a backend.
+int hal_select(const char *spec)
+{
+	size_t len = strcspn(spec, ":");
+	unsigned int i;
+
+	for (i = 0; i < sizeof(hal_backends) / sizeof(hal_backends[0]); i++) {
+		if (strlen(hal_backends[i].name) == len && strncmp(spec, hal_backends[i].name, len) == 0) {
+			hal.backend = &hal_backends[i];
+			hal.arg = spec[len] ? spec + len + 1 : NULL;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int64_t hal_now_ns(void)
+{
+	struct timespec ts;
+
+	sched_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void hal_record_edge(struct pulse_source *src, uint64_t ts)
+{
+	fprintf(hal.record, "E %lld %s\n", (long long)(ts + hal.record_offset), src->name);
+}
+
+// Open the selected backend, and the record file if there is one
+int hal_open(const char *record)
+{
+	struct timespec real, mono;
+
+	if (hal.backend == NULL && hal_select(HAL_DEFAULT_BACKEND) != 0)
+		return -1;
+	if (hal.backend->open(hal.arg) != 0)
+		return -1;
+
+	if (record) {
+		if ((hal.record = fopen(record, "w")) == NULL)
+			return -1;
+		if (!sched_virtual) {
+			clock_gettime(CLOCK_REALTIME, &real);
+			clock_gettime(CLOCK_MONOTONIC, &mono);
+			hal.record_offset = (real.tv_sec - mono.tv_sec) * 1000000000LL + (real.tv_nsec - mono.tv_nsec);
+		}
+		fprintf(hal.record, "S %lld %s\n", (long long)hal_now_ns(), hal.backend->name);
+		hal.rain->tap = hal_record_edge;
+		hal.wind->tap = hal_record_edge;
+	}
+	return 0;
+}
+
+void hal_close(void)
+{
+	if (hal.record)
+		fclose(hal.record);
+	hal.record = NULL;
+}
+
+int hal_adc_scan(struct mcp3008_scan *scan)
+{
+	int rc = hal.backend->adc_scan(scan);
+	int ch;
+
+	if (hal.record) {
+		flockfile(hal.record);          // one line, with the sensor workers recording too
+		fprintf(hal.record, "A %lld %d", (long long)hal_now_ns(), rc == 0 ? scan->mask : -1);
+		for (ch = 0; rc == 0 && ch < MCP3008_CHANNELS; ch++)
+			fprintf(hal.record, " %u", scan->mask & (1 << ch) ? scan->value[ch] : 0);
+		fputc('\n', hal.record);
+		funlockfile(hal.record);
+	}
+	return rc;
+}
+
+int hal_bmp085_open(struct bmp085 *dev)
+{
+	int rc = hal.backend->bmp085_open(dev);
+	const struct bmp085_calibration *c = &dev->cal;
+	char name[64];
+
+	if (hal.record && rc == 0)
+		fprintf(hal.record, "C %lld %d %d %d %u %u %u %d %d %d %d %d %s\n", (long long)hal_now_ns(),
+			c->ac1, c->ac2, c->ac3, c->ac4, c->ac5, c->ac6, c->b1, c->b2, c->mb, c->mc, c->md,
+			hal_bmp085_name(dev, name, sizeof(name)));
+	else if (hal.record)
+		fprintf(hal.record, "C %lld -1 %s\n", (long long)hal_now_ns(), hal_bmp085_name(dev, name, sizeof(name)));
+	return rc;
+}
+
+void hal_bmp085_close(struct bmp085 *dev)
+{
+	hal.backend->bmp085_close(dev);
+}
+
+int hal_bmp085_start_ut(struct bmp085 *dev)
+{
+	int rc = hal.backend->bmp085_start_ut(dev);
+	char name[64];
+
+	if (hal.record && rc != 0)
+		fprintf(hal.record, "T %lld -2 %s\n", (long long)hal_now_ns(), hal_bmp085_name(dev, name, sizeof(name)));
+	return rc;
+}
+
+int hal_bmp085_read_ut_start_up(struct bmp085 *dev, unsigned int *ut)
+{
+	int rc = hal.backend->bmp085_read_ut_start_up(dev, ut);
+	char name[64];
+
+	if (hal.record)
+		fprintf(hal.record, "T %lld %lld %s\n", (long long)hal_now_ns(), rc == 0 ? (long long)*ut : -1LL,
+			hal_bmp085_name(dev, name, sizeof(name)));
+	return rc;
+}
+
+int hal_bmp085_read_up(struct bmp085 *dev, unsigned int *up)
+{
+	int rc = hal.backend->bmp085_read_up(dev, up);
+	char name[64];
+
+	if (hal.record)
+		fprintf(hal.record, "P %lld %lld %s\n", (long long)hal_now_ns(), rc == 0 ? (long long)*up : -1LL,
+			hal_bmp085_name(dev, name, sizeof(name)));
+	return rc;
+}
+
+void hal_dht22_start(void)
+{
+	hal.backend->dht22_start();
+}
+
+// temperature/humidity are only written on success, as with dht22_collect()
+int hal_dht22_collect(float *temperature, float *humidity)
+{
+	int rc = hal.backend->dht22_collect(temperature, humidity);
+
+	if (hal.record)
+		fprintf(hal.record, "D %lld %d %.1f %.1f\n", (long long)hal_now_ns(), rc,
+			rc == DHT22_OK ? *temperature : NAN, rc == DHT22_OK ? *humidity : NAN);
+	return rc;
+}
+
+void hal_pulses(void)
+{
+	if (hal.backend->pulses)
+		hal.backend->pulses();
+}
+
+#endif
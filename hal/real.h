@@ -0,0 +1,68 @@
+/*
+Real hardware
+
+wiringPi for the interrupts and the DHT22's pin, the MCP3008 through SPI
+or bit-banged GPIO, the BMP085 through /dev/i2c-0.  Left out of builds
+without wiringPi.
+*/
+
+#ifndef HAL_REAL_H
+#define HAL_REAL_H
+
+#ifndef HAL_NO_WIRINGPI
+
+#include <wiringPi.h>
+
+static int hal_real_open(const char *arg)
+{
+	if (wiringPiSetup() == -1) {
+		log_error("Error on wiringPiSetup");
+		return -1;
+	}
+
+	if (hal.adc_use_spi && mcp3008_spi_open(&hal.adc_spi, MCP3008_SPI_DEVICE, MCP3008_SPI_SPEED, hal.adc_channels) != 0) {
+		log_warn("Unable to open %s, falling back to bit-banged mcp3008", MCP3008_SPI_DEVICE);
+		hal.adc_use_spi = 0;
+	}
+
+	if (wiringPiISR(hal.rain_pin, INT_EDGE_BOTH, hal.rain_isr) < 0)
+		log_error("Unable to setup the rain gauge ISR");
+	if (wiringPiISR(hal.wind_pin, INT_EDGE_FALLING, hal.wind_isr) < 0)
+		log_error("Unable to setup the anemometer ISR");
+	return 0;
+}
+
+// Read every channel in adc_channels, in one SPI burst when available
+// or one bit-banged conversion per channel otherwise.
+static int hal_real_adc_scan(struct mcp3008_scan *scan)
+{
+	int ch;
+
+	if (hal.adc_use_spi)
+		return mcp3008_spi_scan(&hal.adc_spi, scan);
+
+	clock_gettime(CLOCK_REALTIME, &scan->ts);
+	scan->mask = 0;
+	for (ch = 0; ch < MCP3008_CHANNELS; ch++) {
+		if (hal.adc_channels & (1 << ch)) {
+			// Channel, Clock, Output, Input, CS
+			scan->value[ch] = mcp3008_value(ch, 11, 9, 10, 8);
+			scan->mask |= 1 << ch;
+		}
+	}
+	return 0;
+}
+
+static void hal_real_dht22_start(void)
+{
+	dht22_start(hal.dht22_pin);
+}
+
+static int hal_real_dht22_collect(float *temperature, float *humidity)
+{
+	return dht22_collect(hal.dht22_pin, temperature, humidity);
+}
+
+#endif /* HAL_NO_WIRINGPI */
+
+#endif
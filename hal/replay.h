@@ -0,0 +1,233 @@
+/*
+Replay of recorded raw samples
+
+Reads a file written with --record (format in hal.h).  Each kind of
+sample, and each BMP085's, is read in order by its own stream over the
+file, so every hal call gets the next recorded answer of its kind,
+failures included, and the tasks go through the same sequence they did
+when it was recorded.
+Edges go into the pulse rings as the virtual clock passes their time.
+
+The clock starts where the recording did, at its first line, and the
+daemon stops when a sensor asks for more than the file holds.
+
+  --hal replay:FILE
+*/
+
+#ifndef HAL_REPLAY_H
+#define HAL_REPLAY_H
+
+#include <stdlib.h>
+#include <math.h>
+
+#define REPLAY_KINDS            "ADE"          // the BMP085's C and T/P are per sensor
+
+struct replay_stream {
+	FILE *f;
+	char line[256];
+	int ready;                              // line holds the next record
+};
+
+struct replay {
+	const char *path;
+	struct replay_stream stream[sizeof(REPLAY_KINDS) - 1];
+	struct replay_stream bmp085[HAL_BMP085_MAX][2];
+	unsigned long records;
+};
+
+struct replay replay;
+
+static struct replay_stream *replay_stream(char kind, struct bmp085 *dev)
+{
+	if (dev)
+		return &replay.bmp085[hal_bmp085_index(dev)][kind == 'C' ? 0 : 1];
+	return &replay.stream[strchr(REPLAY_KINDS, kind) - REPLAY_KINDS];
+}
+
+// Whether a BMP085 record is dev's: its last field is the bus:address, or
+// there is none in a recording made with only the one sensor
+static int replay_device(const char *line, const char *name)
+{
+	const char *last = strrchr(line, ' ');
+	size_t len;
+
+	if (last == NULL || strchr(last, ':') == NULL)
+		return 1;
+	len = strcspn(++last, "\n");
+	return strlen(name) == len && strncmp(last, name, len) == 0;
+}
+
+// The next record of a kind, and for a BMP085 of dev's, left in place
+// until taken.  NULL at the end.
+static const char *replay_peek(char kind, struct bmp085 *dev)
+{
+	struct replay_stream *s = replay_stream(kind, dev);
+	char name[64];
+
+	if (dev)
+		hal_bmp085_name(dev, name, sizeof(name));
+	while (!s->ready) {
+		if (s->f == NULL && (s->f = fopen(replay.path, "r")) == NULL)
+			return NULL;
+		if (fgets(s->line, sizeof(s->line), s->f) == NULL)
+			return NULL;
+		s->ready = (s->line[0] == kind || (kind == 'T' && s->line[0] == 'P')) &&
+			   (dev == NULL || replay_device(s->line, name));
+	}
+	return s->line;
+}
+
+static const char *replay_take(char kind, struct bmp085 *dev)
+{
+	const char *line = replay_peek(kind, dev);
+
+	if (line == NULL) {
+		sched_stop = 1;                 // out of recording
+		return NULL;
+	}
+	replay_stream(kind, dev)->ready = 0;
+	replay.records++;
+	return line;
+}
+
+static int replay_open(const char *arg)
+{
+	FILE *f;
+	char line[256];
+	long long ns = -1;
+
+	if (arg == NULL || (f = fopen(arg, "r")) == NULL)
+		return -1;
+	while (ns < 0 && fgets(line, sizeof(line), f)) {
+		if (sscanf(line + 1, "%lld", &ns) != 1)
+			ns = -1;
+	}
+	fclose(f);
+	if (ns < 0)
+		return -1;
+
+	replay.path = arg;
+	sched_virtual = 1;
+	sched_now_ns = ns;
+	return 0;
+}
+
+static int replay_adc_scan(struct mcp3008_scan *scan)
+{
+	const char *line = replay_take('A', NULL);
+	unsigned int v[MCP3008_CHANNELS];
+	long long ns;
+	int mask, ch;
+
+	sched_gettime(CLOCK_REALTIME, &scan->ts);
+	scan->mask = 0;
+	if (line == NULL || sscanf(line, "A %lld %d %u %u %u %u %u %u %u %u", &ns, &mask,
+				   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) != 10)
+		return -1;
+	for (ch = 0; ch < MCP3008_CHANNELS; ch++)
+		scan->value[ch] = v[ch];
+	scan->mask = mask;
+	return 0;
+}
+
+static int replay_bmp085_open(struct bmp085 *dev)
+{
+	const char *line;
+	long long ns;
+	int c[11];
+
+	if (hal_bmp085_index(dev) < 0)
+		return -1;
+	line = replay_take('C', dev);
+	if (line == NULL || sscanf(line, "C %lld %d %d %d %d %d %d %d %d %d %d %d", &ns, &c[0], &c[1], &c[2],
+				   &c[3], &c[4], &c[5], &c[6], &c[7], &c[8], &c[9], &c[10]) != 12)
+		return -1;
+	dev->cal = (struct bmp085_calibration){ c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7], c[8], c[9], c[10] };
+	if (bmp085_CheckCalibration(&dev->cal) < 0)
+		return -1;                      // a corrupt recording, as a sensor would fail to open
+	dev->fd = 0;
+	return 0;
+}
+
+static void replay_bmp085_close(struct bmp085 *dev)
+{
+	dev->fd = -1;
+}
+
+// A start that failed was recorded as "T <ns> -2"
+static int replay_bmp085_start_ut(struct bmp085 *dev)
+{
+	const char *line = replay_peek('T', dev);
+	long long ns, ut;
+
+	if (line && line[0] == 'T' && sscanf(line, "T %lld %lld", &ns, &ut) == 2 && ut == -2) {
+		replay_take('T', dev);
+		return -1;
+	}
+	return 0;
+}
+
+// T and P share a stream so a failed read of either keeps them in step
+static int replay_raw(struct bmp085 *dev, char kind, unsigned int *raw)
+{
+	const char *line = replay_take('T', dev);
+	long long ns, v;
+	char k;
+
+	if (line == NULL || sscanf(line, "%c %lld %lld", &k, &ns, &v) != 3 || k != kind || v < 0)
+		return -1;
+	*raw = v;
+	return 0;
+}
+
+static int replay_bmp085_read_ut_start_up(struct bmp085 *dev, unsigned int *ut)
+{
+	return replay_raw(dev, 'T', ut);
+}
+
+static int replay_bmp085_read_up(struct bmp085 *dev, unsigned int *up)
+{
+	return replay_raw(dev, 'P', up);
+}
+
+static void replay_dht22_start(void)
+{
+}
+
+static int replay_dht22_collect(float *temperature, float *humidity)
+{
+	const char *line = replay_take('D', NULL);
+	long long ns;
+	float t, h;
+	int rc;
+
+	if (line == NULL || sscanf(line, "D %lld %d %f %f", &ns, &rc, &t, &h) != 4)
+		return DHT22_ERR_TIMEOUT;
+	if (rc == DHT22_OK) {
+		*temperature = t;
+		*humidity = h;
+	}
+	return rc;
+}
+
+// Edges up to the virtual clock
+static void replay_pulses(void)
+{
+	const char *line;
+	long long ts;
+	char name[8];
+
+	while ((line = replay_peek('E', NULL)) != NULL) {
+		if (sscanf(line, "E %lld %7s", &ts, name) == 2) {
+			if (ts > sched_now_ns)
+				break;
+			if (strcmp(name, hal.rain->name) == 0)
+				pulse_ring_push(&hal.rain->ring, ts);
+			else if (strcmp(name, hal.wind->name) == 0)
+				pulse_ring_push(&hal.wind->ring, ts);
+		}
+		replay_take('E', NULL);
+	}
+}
+
+#endif
@@ -0,0 +1,381 @@
+/*
+Simulated hardware
+
+A made-up but plausible climate: a daily temperature cycle with weather
+fronts moving through over days, humidity that follows temperature,
+pressure systems, daylight with passing clouds, wind and the odd shower.
+Every quantity is a smooth function of time and the seed, so two runs
+with the same options see the same weather.
+
+The sensors are simulated at the level the drivers see:
+
+  MCP3008   10 bit codes with gaussian noise, `noise` LSB
+  BMP085    the datasheet's example calibration, and raw UT/UP found by
+            searching the compensation for the simulated reading.  Each
+            sensor past the first reads up to SIM_BMP085_SPREAD off, and
+            the last of them drifts by `drift` Pa a day.
+  DHT22     an edge trace of the 40 bit frame, fed to dht22_decode()
+  pulses    anemometer and rain gauge edges, the gauge with contact bounce
+
+Faults: each read fails with probability `faults` (I2C error, bad DHT22
+frame, failed scan), a BMP085 value is corrupted with probability
+`spikes`, and with probability `storms` a second brings a burst of
+SIM_STORM_EDGES edges of interference on the wind input, enough to
+overflow the pulse ring.
+
+  --hal sim:seed=1,noise=1,faults=0.01,spikes=0.002,storms=0.0001,drift=0,days=7,start=1767225600
+
+days=0 runs until stopped; start defaults to now.
+*/
+
+#ifndef HAL_SIM_H
+#define HAL_SIM_H
+
+#include <stdlib.h>
+#include <math.h>
+
+#define SIM_STORM_EDGES         6000
+#define SIM_RAIN_MM_PER_TIP     0.2794
+#define SIM_BOUNCE_NS           50000000        // the gauge's reed switch opening again
+#define SIM_BMP085_SPREAD       30              // Pa between redundant sensors
+
+struct sim {
+	uint64_t seed;
+	uint64_t rng;
+	double noise;                           // LSB
+	double faults;                          // probability per read
+	double spikes;
+	double storms;                          // probability per second
+	double drift;                           // Pa a day, on the last of several BMP085s
+	int days;
+	int64_t start;
+	int64_t end_ns;
+
+	int64_t last_wind_ns;                   // last edge queued
+	int64_t next_wind_ns;
+	int64_t last_rain_ns;
+	double bucket_mm;                       // in the gauge's bucket, tips at SIM_RAIN_MM_PER_TIP
+	struct {
+		float temperature;              // what the BMP085 is reading
+		float pressure;
+		unsigned int ut;                // for the pressure search
+	} bmp085[HAL_BMP085_MAX];
+};
+
+struct sim sim = { .seed = 1, .noise = 1, .faults = 0.01, .spikes = 0.002, .storms = 0.0001 };
+
+// xorshift64*
+static uint64_t sim_rand(void)
+{
+	sim.rng ^= sim.rng >> 12;
+	sim.rng ^= sim.rng << 25;
+	sim.rng ^= sim.rng >> 27;
+	return sim.rng * 2685821657736338717ULL;
+}
+
+// Uniform in (0, 1]
+static double sim_uniform(void)
+{
+	return ((sim_rand() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static double sim_gauss(void)
+{
+	return sqrt(-2 * log(sim_uniform())) * cos(2 * M_PI * sim_uniform());
+}
+
+static int sim_chance(double p)
+{
+	return p > 0 && sim_uniform() <= p;
+}
+
+// -1..1 for each (k, i), the same every run with the same seed
+static double sim_hash(int k, int64_t i)
+{
+	uint64_t x = sim.seed * 0x9E3779B97F4A7C15ULL ^ (uint64_t)k << 56 ^ (uint64_t)i;
+
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDULL;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ULL;
+	x ^= x >> 33;
+	return (x >> 11) * (2.0 / 9007199254740992.0) - 1;
+}
+
+// Smooth noise in -1..1 varying over about period seconds
+static double sim_smooth(int k, double t, double period)
+{
+	double x = t / period, f = x - floor(x);
+	int64_t i = floor(x);
+
+	f = (1 - cos(f * M_PI)) / 2;
+	return sim_hash(k, i) * (1 - f) + sim_hash(k, i + 1) * f;
+}
+
+struct sim_weather {
+	double temperature;                     // C
+	double humidity;                        // %
+	double pressure;                        // Pa
+	double sun;                             // 0..1 at the ground
+	double wind;                            // km/h
+	double rain;                            // mm/h
+};
+
+static void sim_weather(double t, struct sim_weather *w)
+{
+	double hour = fmod(t / 3600, 24);
+	double day = sin(M_PI * (hour - 6) / 12);               // daylight 6-18
+	double cloud = 0.5 + 0.5 * sim_smooth(1, t, 1200);
+
+	w->temperature = 10 + 6 * sin(2 * M_PI * (hour - 9) / 24) + 6 * sim_smooth(2, t, 3 * 86400) + 2 * sim_smooth(3, t, 6 * 3600);
+	w->humidity = fmin(100, fmax(5, 70 - 2.5 * (w->temperature - 10) + 15 * sim_smooth(4, t, 86400)));
+	w->pressure = 101300 + 1200 * sim_smooth(5, t, 4 * 86400) + 300 * sim_smooth(6, t, 12 * 3600);
+	w->sun = day > 0 ? day * (1 - 0.7 * cloud) : 0;
+	w->wind = fmax(0, 10 + 8 * sim_smooth(7, t, 86400) + 6 * sim_smooth(8, t, 600));
+	w->rain = fmax(0, 10 * sim_smooth(9, t, 3 * 3600) - 4);
+}
+
+// "key=value,..."
+static int sim_open(const char *arg)
+{
+	char key[16];
+	double v;
+	int n;
+
+	sim.start = time(NULL);
+	while (arg && *arg) {
+		if (sscanf(arg, "%15[a-z]=%lf%n", key, &v, &n) != 2)
+			return -1;
+		if (strcmp(key, "seed") == 0)
+			sim.seed = v;
+		else if (strcmp(key, "noise") == 0)
+			sim.noise = v;
+		else if (strcmp(key, "faults") == 0)
+			sim.faults = v;
+		else if (strcmp(key, "spikes") == 0)
+			sim.spikes = v;
+		else if (strcmp(key, "storms") == 0)
+			sim.storms = v;
+		else if (strcmp(key, "drift") == 0)
+			sim.drift = v;
+		else if (strcmp(key, "days") == 0)
+			sim.days = v;
+		else if (strcmp(key, "start") == 0)
+			sim.start = v;
+		else
+			return -1;
+		arg += n;
+		if (*arg == ',')
+			arg++;
+		else if (*arg)
+			return -1;
+	}
+
+	sim.rng = sim.seed * 0x9E3779B97F4A7C15ULL | 1;
+	sched_virtual = 1;
+	sched_now_ns = sim.start * 1000000000LL;
+	sim.end_ns = sim.days ? sched_now_ns + sim.days * 86400LL * 1000000000LL : 0;
+	sim.last_wind_ns = sim.next_wind_ns = sim.last_rain_ns = sched_now_ns;
+	return 0;
+}
+
+static void sim_now(struct sim_weather *w)
+{
+	sim_weather(sched_now_ns / 1e9, w);
+}
+
+static uint16_t sim_code(double v)
+{
+	v = round(v + sim.noise * sim_gauss());
+	return v < 0 ? 0 : v > 1023 ? 1023 : v;
+}
+
+// The inverse of the conversions in task_adc()
+static int sim_adc_scan(struct mcp3008_scan *scan)
+{
+	struct sim_weather w;
+	double uvi, light;
+	int ch;
+
+	sched_gettime(CLOCK_REALTIME, &scan->ts);
+	scan->mask = 0;
+	if (sim_chance(sim.faults))
+		return -1;
+
+	sim_now(&w);
+	uvi = 9 * w.sun * w.sun;
+	light = 600 * w.sun;
+	for (ch = 0; ch < MCP3008_CHANNELS; ch++) {
+		if (!(hal.adc_channels & (1 << ch)))
+			continue;
+		scan->value[ch] = sim_code(0);
+		scan->mask |= 1 << ch;
+	}
+	scan->value[0] = sim_code(uvi * 20 / 5.25 / 1000 * 471 / 3.3 * 1023);  // UVI
+	scan->value[3] = sim_code(light / 2 / 100 / 3.3 * 1023);              // TEMT6000
+	return 0;
+}
+
+// Datasheet example calibration
+static int sim_bmp085_open(struct bmp085 *dev)
+{
+	static const struct bmp085_calibration cal = {
+		.ac1 = 408, .ac2 = -72, .ac3 = -14383, .ac4 = 32741, .ac5 = 32757, .ac6 = 23153,
+		.b1 = 6190, .b2 = 4, .mb = -32768, .mc = -8711, .md = 2868,
+	};
+
+	if (hal_bmp085_index(dev) < 0 || sim_chance(sim.faults))
+		return -1;
+	dev->cal = cal;
+	dev->fd = 0;
+	return 0;
+}
+
+static void sim_bmp085_close(struct bmp085 *dev)
+{
+	dev->fd = -1;
+}
+
+static int sim_bmp085_start_ut(struct bmp085 *dev)
+{
+	int i = hal_bmp085_index(dev);
+	struct sim_weather w;
+	double offset = 0;
+
+	if (i > 0)
+		offset = SIM_BMP085_SPREAD * sim_hash(10, i);
+	if (i > 0 && i == hal.bmp085_count - 1)
+		offset += sim.drift * (sched_now_ns / 1e9 - sim.start) / 86400;
+	sim_now(&w);
+	sim.bmp085[i].temperature = w.temperature + 0.1 * sim.noise * sim_gauss();
+	sim.bmp085[i].pressure = w.pressure + offset + 3 * sim.noise * sim_gauss();
+	return sim_chance(sim.faults) ? -1 : 0;
+}
+
+static void sim_glitch(unsigned int *raw, int bits)
+{
+	if (sim_chance(sim.spikes))
+		*raw ^= 1u << (sim_rand() % bits);
+}
+
+// Smallest raw value that compensates to at least the simulated reading
+static int sim_bmp085_read_ut_start_up(struct bmp085 *dev, unsigned int *ut)
+{
+	const struct bmp085_calibration *cal = &dev->cal;
+	int i = hal_bmp085_index(dev);
+	unsigned int lo = 0, hi = 0xFFFF, mid;
+
+	if (sim_chance(sim.faults))
+		return -1;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		// Below the pole of the compensation, far colder than -40C
+		if (((((int)mid - cal->ac6) * cal->ac5) >> 15) + cal->md <= 0 ||
+		    bmp085_GetTemperature(cal, mid) < sim.bmp085[i].temperature * 10)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	sim.bmp085[i].ut = lo;
+	*ut = lo;
+	sim_glitch(ut, 16);
+	return 0;
+}
+
+static int sim_bmp085_read_up(struct bmp085 *dev, unsigned int *up)
+{
+	int i = hal_bmp085_index(dev);
+	unsigned int lo = 0, hi = (1 << (16 + dev->oss)) - 1, mid;
+
+	if (sim_chance(sim.faults))
+		return -1;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (bmp085_GetPressure(&dev->cal, dev->oss, sim.bmp085[i].ut, mid) < sim.bmp085[i].pressure)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*up = lo;
+	sim_glitch(up, 16 + dev->oss);
+	return 0;
+}
+
+static void sim_dht22_start(void)
+{
+}
+
+// Build the edge trace of a frame the way dht22_capture() records it
+static int sim_dht22_collect(float *temperature, float *humidity)
+{
+	struct dht22_edge edges[DHT22_MAX_EDGES];
+	struct sim_weather w;
+	uint8_t data[5];
+	uint32_t us = 0;
+	int t10, h10, count = 0, i;
+
+	sim_now(&w);
+	h10 = lround((w.humidity + sim.noise * sim_gauss()) * 10);
+	t10 = lround((w.temperature + 0.2 * sim.noise * sim_gauss()) * 10);
+	h10 = h10 < 0 ? 0 : h10 > 1000 ? 1000 : h10;
+	data[0] = h10 >> 8;
+	data[1] = h10;
+	data[2] = (abs(t10) >> 8) | (t10 < 0 ? 0x80 : 0);
+	data[3] = abs(t10);
+	data[4] = data[0] + data[1] + data[2] + data[3];
+	if (sim_chance(sim.faults))
+		data[sim_rand() % 4] ^= 1 << (sim_rand() % 8);    // checksum error
+
+	edges[count++] = (struct dht22_edge){ us += 20, 0 };   // sensor response
+	edges[count++] = (struct dht22_edge){ us += 80, 1 };
+	edges[count++] = (struct dht22_edge){ us += 80, 0 };
+	for (i = 0; i < 40; i++) {
+		edges[count++] = (struct dht22_edge){ us += 50, 1 };
+		us += data[i / 8] & (0x80 >> (i % 8)) ? 70 : 27;
+		edges[count++] = (struct dht22_edge){ us, 0 };
+	}
+	return dht22_decode(edges, count, temperature, humidity);
+}
+
+// Queue the edges due since the last call, as the ISRs would have
+static void sim_pulses(void)
+{
+	struct sim_weather w;
+	double rate;
+	int i;
+
+	if (sim.end_ns && sched_now_ns >= sim.end_ns)
+		sched_stop = 1;
+	sim_now(&w);
+
+	// Gusting about the mean, re-drawn every call
+	rate = fmax(0, w.wind * (1 + 0.3 * sim_gauss())) / WIND_CALIBRATION * WIND_PULSES_PER_REV;
+	while (sim.next_wind_ns <= sched_now_ns) {
+		if (rate < 0.1) {
+			sim.next_wind_ns = sched_now_ns + 1000000000LL;
+			break;
+		}
+		pulse_ring_push(&hal.wind->ring, sim.next_wind_ns);
+		sim.last_wind_ns = sim.next_wind_ns;
+		sim.next_wind_ns += 1e9 / rate;
+	}
+
+	// The bucket tips each time it fills, and the switch bounces
+	sim.bucket_mm += w.rain * (sched_now_ns - sim.last_rain_ns) / 3600e9;
+	sim.last_rain_ns = sched_now_ns;
+	if (sim.bucket_mm >= SIM_RAIN_MM_PER_TIP) {
+		sim.bucket_mm -= SIM_RAIN_MM_PER_TIP;
+		pulse_ring_push(&hal.rain->ring, sched_now_ns - SIM_BOUNCE_NS);
+		pulse_ring_push(&hal.rain->ring, sched_now_ns);
+	}
+
+	// A burst of interference ending now, 100ns apart, if it fits after
+	// the last real edge
+	if (sim_chance(sim.storms) && sched_now_ns - SIM_STORM_EDGES * 100 > sim.last_wind_ns) {
+		for (i = SIM_STORM_EDGES - 1; i >= 0; i--)
+			pulse_ring_push(&hal.wind->ring, sched_now_ns - i * 100);
+		sim.last_wind_ns = sched_now_ns;
+	}
+}
+
+#endif
@@ -0,0 +1,315 @@
+/*
+Logging
+
+log_error(), log_warn(), log_info() and log_debug() take printf arguments.
+The caller formats into a fixed size record claimed from a lock-free ring
+and that's all: no locks, no system calls and no allocation, so they can
+be used on the sensor tasks' timing path and from the interrupt and MQTT
+threads.  A message below the current level costs a load and a compare.
+
+Formatting is done by the caller, not the writer, because arguments such
+as %s strings needn't outlive the call, and keeping them would mean copying
+each one by type.  It costs about a microsecond, between conversions that
+wait milliseconds on timers; nothing logs inside the DHT22 capture or an
+interrupt handler.
+
+A writer thread wakes every LOG_FLUSH_MS (sooner while the ring is filling
+up), stamps and writes everything queued in one write(), and once the file
+passes --log-size renames it to FILE.1, FILE.1 to FILE.2 and so on up to
+LOG_KEEP.  Errors and warnings go to stdout as well.  If the ring fills,
+records are dropped, counted, and the count noted in the log; on the
+virtual clock the caller waits for room instead.
+
+  2026-01-01 12:00:00.125 debug acquisition 412.3 ms
+
+The level is set with --log-level (error, warn, info or debug) and can be
+changed while running: SIGUSR1 for one level more, SIGUSR2 for one less.
+
+	kill -USR1 $(pidof weather-station)
+*/
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "../scheduler/clock.h"
+
+#define LOG_FILE                "/tmp/weather-station.log"
+#define LOG_SIZE                (1024 * 1024)   // bytes before the file is rotated
+#define LOG_KEEP                3               // rotated files kept
+#define LOG_RING_ORDER          10              // 1024 records between flushes
+#define LOG_RING                (1u << LOG_RING_ORDER)
+#define LOG_TEXT                112             // a record is 128 bytes
+#define LOG_FLUSH_MS            100
+#define LOG_BATCH               (64 * 1024)
+
+enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG, LOG_LEVELS };
+
+static const char *log_levels[LOG_LEVELS] = { "error", "warn", "info", "debug" };
+
+// A slot's seq is the first position of the lap it is free for, + 1 once
+// that lap's record is in it.  All zero is an empty ring, so records
+// logged before log_open() wait for the writer.
+struct log_record {
+	atomic_uint seq;
+	uint8_t level;
+	int64_t ts_ns;                          // CLOCK_REALTIME, or virtual time
+	char text[LOG_TEXT];
+};
+
+struct log {
+	struct log_record slot[LOG_RING];
+	_Alignas(64) atomic_uint head;          // next position to claim, any thread
+	atomic_ulong dropped;
+	_Alignas(64) unsigned int tail;         // writer thread only
+
+	const char *path;
+	long max_size;
+	int fd;
+	long size;
+	atomic_int stop;
+	pthread_t writer;
+	int started;                            // writer is running
+	char buf[LOG_BATCH];
+};
+
+struct log logger;
+
+#ifdef DEBUG
+atomic_int log_level = LOG_DEBUG;
+#else
+atomic_int log_level = LOG_INFO;
+#endif
+
+#define log_enabled(level)      (atomic_load_explicit(&log_level, memory_order_relaxed) >= (level))
+#define log_error(...)          do { if (log_enabled(LOG_ERROR)) log_write(LOG_ERROR, __VA_ARGS__); } while (0)
+#define log_warn(...)           do { if (log_enabled(LOG_WARN)) log_write(LOG_WARN, __VA_ARGS__); } while (0)
+#define log_info(...)           do { if (log_enabled(LOG_INFO)) log_write(LOG_INFO, __VA_ARGS__); } while (0)
+#define log_debug(...)          do { if (log_enabled(LOG_DEBUG)) log_write(LOG_DEBUG, __VA_ARGS__); } while (0)
+
+// Returns the level or -1
+int log_parse_level(const char *name)
+{
+	int i;
+
+	for (i = 0; i < LOG_LEVELS; i++)
+		if (strcmp(name, log_levels[i]) == 0)
+			return i;
+	return -1;
+}
+
+// Any thread.  Multi-producer version of the ring in pulses/spsc_ring.h:
+// a producer claims a position by moving head past it, once the slot's
+// seq says it is free for that lap.
+__attribute__((format(printf, 2, 3)))
+void log_write(int level, const char *fmt, ...)
+{
+	struct log_record *r;
+	struct timespec ts;
+	unsigned int pos, lap, seq;
+	va_list ap;
+
+	pos = atomic_load_explicit(&logger.head, memory_order_relaxed);
+	for (;;) {
+		r = &logger.slot[pos & (LOG_RING - 1)];
+		lap = pos & ~(LOG_RING - 1);
+		seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+		if (seq == lap) {
+			if (atomic_compare_exchange_weak_explicit(&logger.head, &pos, pos + 1,
+								  memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if ((int)(seq - lap) < 0) {
+			// The writer hasn't got to it yet.  On the virtual clock
+			// nothing is timed, so wait rather than lose it.
+			if (sched_virtual && logger.started) {
+				sched_yield();
+				pos = atomic_load_explicit(&logger.head, memory_order_relaxed);
+				continue;
+			}
+			atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+			return;
+		} else {
+			pos = atomic_load_explicit(&logger.head, memory_order_relaxed);
+		}
+	}
+
+	sched_gettime(CLOCK_REALTIME, &ts);
+	r->ts_ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	r->level = level;
+	va_start(ap, fmt);
+	vsnprintf(r->text, sizeof(r->text), fmt, ap);
+	va_end(ap);
+	atomic_store_explicit(&r->seq, lap + 1, memory_order_release);
+}
+
+// ======================================================================
+// Writer thread
+
+static void log_signal(int sig)
+{
+	int level = atomic_load(&log_level);
+
+	if (sig == SIGUSR1 && level < LOG_DEBUG)
+		atomic_store(&log_level, level + 1);
+	else if (sig == SIGUSR2 && level > LOG_ERROR)
+		atomic_store(&log_level, level - 1);
+}
+
+static void log_reopen(struct log *lg)
+{
+	struct stat st;
+
+	if (lg->fd >= 0)
+		close(lg->fd);
+	lg->fd = open(lg->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	lg->size = lg->fd >= 0 && fstat(lg->fd, &st) == 0 ? st.st_size : 0;
+}
+
+// FILE.2 -> FILE.3, FILE.1 -> FILE.2, FILE -> FILE.1
+static void log_rotate(struct log *lg)
+{
+	char from[256], to[256];
+	int i;
+
+	for (i = LOG_KEEP - 1; i >= 1; i--) {
+		snprintf(from, sizeof(from), "%s.%d", lg->path, i);
+		snprintf(to, sizeof(to), "%s.%d", lg->path, i + 1);
+		rename(from, to);
+	}
+	snprintf(to, sizeof(to), "%s.1", lg->path);
+	rename(lg->path, to);
+	log_reopen(lg);
+}
+
+static void log_flush(struct log *lg, size_t len)
+{
+	if (len == 0)
+		return;
+	if (lg->fd >= 0 && write(lg->fd, lg->buf, len) == (ssize_t)len)
+		lg->size += len;
+	if (lg->fd >= 0 && lg->size >= lg->max_size)
+		log_rotate(lg);
+}
+
+// Everything written so far.  Returns how many records there were.
+static unsigned int log_drain(struct log *lg)
+{
+	static time_t last_sec = -1;
+	static char stamp[32];
+	struct log_record *r;
+	unsigned int n = 0, lap;
+	size_t len = 0;
+	struct tm tm;
+	time_t sec;
+
+	for (;;) {
+		r = &lg->slot[lg->tail & (LOG_RING - 1)];
+		lap = lg->tail & ~(LOG_RING - 1);
+		if (atomic_load_explicit(&r->seq, memory_order_acquire) != lap + 1)
+			break;
+		if (len + LOG_TEXT + 64 > sizeof(lg->buf)) {
+			log_flush(lg, len);
+			len = 0;
+		}
+		sec = r->ts_ns / 1000000000;
+		if (sec != last_sec) {
+			localtime_r(&sec, &tm);
+			strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+			last_sec = sec;
+		}
+		len += snprintf(lg->buf + len, sizeof(lg->buf) - len, "%s.%03d %s %s\n", stamp,
+				(int)(r->ts_ns / 1000000 % 1000), log_levels[r->level], r->text);
+		if (r->level <= LOG_WARN)
+			printf("%s\n", r->text);
+		atomic_store_explicit(&r->seq, lap + LOG_RING, memory_order_release);
+		lg->tail++;
+		n++;
+	}
+	log_flush(lg, len);
+	if (n)
+		fflush(stdout);
+	return n;
+}
+
+static void *log_writer(void *arg)
+{
+	struct log *lg = arg;
+	struct timespec delay;
+	unsigned long dropped = 0, now_dropped;
+	int level = atomic_load(&log_level), now_level;
+	unsigned int n;
+
+	for (;;) {
+		n = log_drain(lg);
+
+		// Noted through the ring like everything else, whatever the level
+		now_dropped = atomic_load_explicit(&lg->dropped, memory_order_relaxed);
+		if (now_dropped != dropped)
+			log_write(LOG_WARN, "%lu log records dropped, the ring was full", now_dropped - dropped);
+		dropped = now_dropped;
+		now_level = atomic_load(&log_level);
+		if (now_level != level)
+			log_write(LOG_INFO, "log level now %s", log_levels[now_level]);
+		level = now_level;
+
+		if (atomic_load(&lg->stop) && n == 0) {
+			log_drain(lg);          // the notes above
+			return NULL;
+		}
+		// Come back sooner while the ring is more than a quarter full
+		delay.tv_sec = 0;
+		delay.tv_nsec = (n > LOG_RING / 4 ? 1 : LOG_FLUSH_MS) * 1000000L;
+		nanosleep(&delay, NULL);
+	}
+}
+
+// Start the writer on path (which may be NULL for stdout only) and take
+// SIGUSR1/SIGUSR2.  Returns -1 if the file can't be opened; warnings and
+// errors still reach stdout.
+int log_open(const char *path, long max_size)
+{
+	struct sigaction sa;
+
+	logger.path = path;
+	logger.max_size = max_size > 0 ? max_size : LOG_SIZE;
+	logger.fd = -1;
+	if (path)
+		log_reopen(&logger);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = log_signal;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+
+	if (pthread_create(&logger.writer, NULL, log_writer, &logger) != 0)
+		return -1;
+	logger.started = 1;
+	return path && logger.fd < 0 ? -1 : 0;
+}
+
+// Write out what's queued and stop the writer
+void log_close(void)
+{
+	if (logger.started) {
+		atomic_store(&logger.stop, 1);
+		pthread_join(logger.writer, NULL);
+		logger.started = 0;
+	}
+	if (logger.fd >= 0)
+		close(logger.fd);
+	logger.fd = -1;
+}
+
+#endif
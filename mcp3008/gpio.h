@@ -22,11 +22,52 @@
 
 */
 
+/*
+  Pluggable backends.  gpio_init/gpio_write/gpio_read dispatch through
+  gpio_backend, chosen with gpio_select() or at build time with
+  -DGPIO_DEFAULT_BACKEND=\"name\".
+
+  sysfs     the original code, opens the sysfs file on every access
+  sysfs-fd  keeps one file descriptor per pin open
+  mmap      writes the BCM283x GPIO registers through /dev/gpiomem
+  fake      in-memory pin levels, for running without hardware
+*/
+
+#ifndef GPIO_H
+#define GPIO_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef GPIO_DEFAULT_BACKEND
+#define GPIO_DEFAULT_BACKEND "sysfs-fd"
+#endif
+
+#define GPIO_MAX_PINS 54
+
+struct gpio_backend {
+  const char *name;
+  int (*open)(void);  // returns 0 on success
+  void (*init)(int pin, char *direction);
+  void (*write)(int pin, int value);
+  int (*read)(int pin);
+};
+
 const char path[] = "/sys/class/gpio/gpio";
 char pinpath[40];
 
 
-void gpio_init(int pin, char *direction) { // sets the direction of a pin. Allowed values are "in" and "out"
+// ======================================================================
+// sysfs: one open/write/close per access
+
+int gpio_sysfs_open(void) {
+  return 0;
+}
+
+void gpio_sysfs_init(int pin, char *direction) { // sets the direction of a pin. Allowed values are "in" and "out"
   FILE *f;
   sprintf(pinpath, "%s%d/direction", path,  pin);
   f = fopen(pinpath, "w");
@@ -34,7 +75,7 @@ void gpio_init(int pin, char *direction) { // sets the direction of a pin. Allow
   fclose(f);
 }
 
-void gpio_write(int pin, int value) { // sets the output value of the pin. Allowed values are 1 and 0.
+void gpio_sysfs_write(int pin, int value) { // sets the output value of the pin. Allowed values are 1 and 0.
   sprintf(pinpath, "%s%d/value", path, pin);
   FILE *f;
   f = fopen(pinpath, "w");
@@ -42,7 +83,7 @@ void gpio_write(int pin, int value) { // sets the output value of the pin. Allow
   fclose(f);
 }
 
-int gpio_read(int pin) { // reads input value from the specified GPIO pin. Returns 1 or 0.
+int gpio_sysfs_read(int pin) { // reads input value from the specified GPIO pin. Returns 1 or 0.
   sprintf(pinpath, "%s%d/value", path, pin);
   FILE *f;
   f = fopen(pinpath, "r");
@@ -56,4 +97,151 @@ int gpio_read(int pin) { // reads input value from the specified GPIO pin. Retur
   fclose(f);
   return x;       
 }
-  
+
+// ======================================================================
+// sysfs-fd: the value file of each pin stays open, one pwrite/pread per access
+
+int gpio_fd[GPIO_MAX_PINS];
+
+int gpio_sysfs_fd_open(void) {
+  int i;
+  for (i = 0; i < GPIO_MAX_PINS; i++)
+    gpio_fd[i] = -1;
+  return 0;
+}
+
+int gpio_sysfs_fd_get(int pin) {
+  if (pin < 0 || pin >= GPIO_MAX_PINS)
+    return -1;
+  if (gpio_fd[pin] < 0) {
+    sprintf(pinpath, "%s%d/value", path, pin);
+    gpio_fd[pin] = open(pinpath, O_RDWR);
+  }
+  return gpio_fd[pin];
+}
+
+void gpio_sysfs_fd_write(int pin, int value) {
+  int fd = gpio_sysfs_fd_get(pin);
+  if (fd >= 0)
+    pwrite(fd, value ? "1" : "0", 1, 0);
+}
+
+int gpio_sysfs_fd_read(int pin) {
+  char c;
+  int fd = gpio_sysfs_fd_get(pin);
+  if (fd < 0 || pread(fd, &c, 1, 0) != 1)
+    return -1;
+  return c == '1';
+}
+
+// ======================================================================
+// mmap: BCM283x registers via /dev/gpiomem, no system calls per access
+
+#define GPIO_GPFSEL0  0   // word offsets into the register block
+#define GPIO_GPSET0   7
+#define GPIO_GPCLR0  10
+#define GPIO_GPLEV0  13
+#define GPIO_SETTLE_READS 4   // keeps the bit-banged clock below the MCP3008's 1.35MHz limit at 2.7V
+
+volatile uint32_t *gpio_map;
+
+int gpio_mmap_open(void) {
+  int fd = open("/dev/gpiomem", O_RDWR | O_SYNC);
+  if (fd < 0)
+    return -1;
+  void *map = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+  gpio_map = map;
+  return 0;
+}
+
+void gpio_mmap_init(int pin, char *direction) {
+  int reg = GPIO_GPFSEL0 + pin / 10;
+  int shift = (pin % 10) * 3;
+  uint32_t fsel = gpio_map[reg] & ~(7u << shift);
+  if (strcmp(direction, "out") == 0)
+    fsel |= 1u << shift;
+  gpio_map[reg] = fsel;
+}
+
+void gpio_mmap_write(int pin, int value) {
+  int i;
+  gpio_map[(value ? GPIO_GPSET0 : GPIO_GPCLR0) + pin / 32] = 1u << (pin % 32);
+  for (i = 0; i < GPIO_SETTLE_READS; i++)
+    (void)gpio_map[GPIO_GPLEV0];
+}
+
+int gpio_mmap_read(int pin) {
+  return (gpio_map[GPIO_GPLEV0 + pin / 32] >> (pin % 32)) & 1;
+}
+
+// ======================================================================
+// fake: levels live in memory.  gpio_fake_hook, if set, is called after
+// every write so a model of the attached chip can drive the input pins.
+
+int gpio_fake_level[GPIO_MAX_PINS];
+int gpio_fake_output[GPIO_MAX_PINS];
+void (*gpio_fake_hook)(int pin, int value);
+
+int gpio_fake_open(void) {
+  memset(gpio_fake_level, 0, sizeof(gpio_fake_level));
+  memset(gpio_fake_output, 0, sizeof(gpio_fake_output));
+  return 0;
+}
+
+void gpio_fake_init(int pin, char *direction) {
+  gpio_fake_output[pin] = strcmp(direction, "out") == 0;
+}
+
+void gpio_fake_write(int pin, int value) {
+  gpio_fake_level[pin] = value;
+  if (gpio_fake_hook)
+    gpio_fake_hook(pin, value);
+}
+
+int gpio_fake_read(int pin) {
+  return gpio_fake_level[pin];
+}
+
+// ======================================================================
+
+const struct gpio_backend gpio_backends[] = {
+  { "sysfs", gpio_sysfs_open, gpio_sysfs_init, gpio_sysfs_write, gpio_sysfs_read },
+  { "sysfs-fd", gpio_sysfs_fd_open, gpio_sysfs_init, gpio_sysfs_fd_write, gpio_sysfs_fd_read },
+  { "mmap", gpio_mmap_open, gpio_mmap_init, gpio_mmap_write, gpio_mmap_read },
+  { "fake", gpio_fake_open, gpio_fake_init, gpio_fake_write, gpio_fake_read },
+  { NULL, NULL, NULL, NULL, NULL }
+};
+
+const struct gpio_backend *gpio_backend;
+
+int gpio_select(const char *name) { // picks and opens a backend by name. Returns 0 on success, -1 if unknown or it can't be opened.
+  const struct gpio_backend *b;
+  for (b = gpio_backends; b->name; b++) {
+    if (strcmp(b->name, name) == 0) {
+      if (b->open() != 0)
+        return -1;
+      gpio_backend = b;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void gpio_init(int pin, char *direction) { // sets the direction of a pin. Allowed values are "in" and "out"
+  if (!gpio_backend && gpio_select(GPIO_DEFAULT_BACKEND) != 0)
+    gpio_select("sysfs");
+  gpio_backend->init(pin, direction);
+}
+
+void gpio_write(int pin, int value) { // sets the output value of the pin. Allowed values are 1 and 0.
+  gpio_backend->write(pin, value);
+}
+
+int gpio_read(int pin) { // reads input value from the specified GPIO pin. Returns 1 or 0.
+  return gpio_backend->read(pin);
+}
+
+#endif
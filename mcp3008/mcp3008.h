@@ -61,17 +61,28 @@ int power_of_2(int exp) {
   return output;
 }
 
-int mcp3008_value(int inputnum, int clock, int in, int out, int cs) {
-  int i; // "for-loop-integer"
-  int inputarray[5]; // will contain the input number
-  int output = 0; // this will be returned
+int mcp3008_pins[4] = { -1, -1, -1, -1 }; // pins the directions were last set for
+
+void mcp3008_setup(int clock, int in, int out, int cs) { // sets the pin directions, only when the pins change
+  if (mcp3008_pins[0] == clock && mcp3008_pins[1] == in &&
+      mcp3008_pins[2] == out && mcp3008_pins[3] == cs)
+    return;
   gpio_init(clock, "out");
   gpio_init(in, "in");
   gpio_init(out, "out");
   gpio_init(cs, "out");
+  mcp3008_pins[0] = clock; mcp3008_pins[1] = in;
+  mcp3008_pins[2] = out; mcp3008_pins[3] = cs;
+}
+
+int mcp3008_value(int inputnum, int clock, int in, int out, int cs) {
+  int i; // "for-loop-integer"
+  int inputarray[5]; // will contain the input number
+  int output = 0; // this will be returned
   if (inputnum < 0 || inputnum > 7) {
     return -1; // Those inputs don't exist !
   }
+  mcp3008_setup(clock, in, out, cs);
   gpio_write(cs, 1);
   gpio_write(clock, 0);
   gpio_write(cs, 0);
@@ -83,7 +94,7 @@ int mcp3008_value(int inputnum, int clock, int in, int out, int cs) {
 
   for (i=12; i>0; i--) {
     if (clocked_read(clock, in)) {
-      output += power_of_2(i);
+      output |= 1 << i;
     }
   }
   gpio_write(cs, 1);
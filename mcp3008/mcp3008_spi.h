@@ -0,0 +1,128 @@
+/*
+MCP3008 on the kernel SPI driver
+
+Reads a set of channels, up to all eight, with a single SPI_IOC_MESSAGE
+ioctl per scan.  Each channel is its own 3 byte transfer with cs_change set
+so chip select is released between conversions as the MCP3008 requires.
+The transfers are built once when the device is opened.
+
+Uses the same pins the bit-banged driver does (BCM 8-11 are SPI0), so only
+the device tree overlay needs to change to switch modes.
+*/
+
+#ifndef MCP3008_SPI_H
+#define MCP3008_SPI_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#define MCP3008_SPI_DEVICE      "/dev/spidev0.0"
+#define MCP3008_SPI_SPEED       1000000         // 1.35MHz max at 2.7V, 3.6MHz at 5V
+#define MCP3008_CHANNELS        8
+
+struct mcp3008_scan {
+	struct timespec ts;                     // CLOCK_REALTIME when the burst was issued
+	uint8_t mask;                           // channels present in value[]
+	uint16_t value[MCP3008_CHANNELS];
+};
+
+struct mcp3008_spi {
+	int fd;
+	uint8_t mask;
+	int count;                              // number of enabled channels
+	uint8_t channel[MCP3008_CHANNELS];      // channel of each transfer
+	uint8_t tx[MCP3008_CHANNELS][3];
+	uint8_t rx[MCP3008_CHANNELS][3];
+	struct spi_ioc_transfer xfer[MCP3008_CHANNELS];
+
+	unsigned long scans;
+	unsigned long errors;
+	long scan_ns;                           // duration of the last burst
+};
+
+// Open the SPI device and prepare one transfer per channel in mask.
+// Returns 0 on success, -1 on error.
+int mcp3008_spi_open(struct mcp3008_spi *adc, const char *device, uint32_t speed, uint8_t mask)
+{
+	uint8_t mode = SPI_MODE_0;
+	uint8_t bits = 8;
+	int ch;
+
+	memset(adc, 0, sizeof(*adc));
+	if ((adc->fd = open(device, O_RDWR)) < 0)
+		return -1;
+	if (ioctl(adc->fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+	    ioctl(adc->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0 ||
+	    ioctl(adc->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0) {
+		close(adc->fd);
+		adc->fd = -1;
+		return -1;
+	}
+
+	adc->mask = mask;
+	for (ch = 0; ch < MCP3008_CHANNELS; ch++) {
+		if (!(mask & (1 << ch)))
+			continue;
+		int i = adc->count++;
+		adc->channel[i] = ch;
+		adc->tx[i][0] = 0x01;                   // start bit
+		adc->tx[i][1] = 0x80 | (ch << 4);       // single ended, channel
+		adc->tx[i][2] = 0x00;
+		adc->xfer[i].tx_buf = (unsigned long)adc->tx[i];
+		adc->xfer[i].rx_buf = (unsigned long)adc->rx[i];
+		adc->xfer[i].len = 3;
+		adc->xfer[i].speed_hz = speed;
+		adc->xfer[i].bits_per_word = 8;
+		adc->xfer[i].cs_change = 1;             // release CS between conversions
+	}
+	if (adc->count > 0)
+		adc->xfer[adc->count - 1].cs_change = 0;
+
+	return 0;
+}
+
+// Convert every enabled channel in one ioctl.  Returns 0 on success.
+int mcp3008_spi_scan(struct mcp3008_spi *adc, struct mcp3008_scan *scan)
+{
+	struct timespec start, end;
+	int i;
+
+	clock_gettime(CLOCK_REALTIME, &scan->ts);
+	scan->mask = 0;
+	if (adc->count == 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (ioctl(adc->fd, SPI_IOC_MESSAGE(adc->count), adc->xfer) < 0) {
+		adc->errors++;
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	adc->scan_ns = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+
+	for (i = 0; i < adc->count; i++)
+		scan->value[adc->channel[i]] = ((adc->rx[i][1] & 0x03) << 8) | adc->rx[i][2];
+	scan->mask = adc->mask;
+	adc->scans++;
+	return 0;
+}
+
+// Scans per second the device sustains, from the duration of the last burst
+double mcp3008_spi_rate(const struct mcp3008_spi *adc)
+{
+	return adc->scan_ns > 0 ? 1e9 / adc->scan_ns : 0;
+}
+
+void mcp3008_spi_close(struct mcp3008_spi *adc)
+{
+	if (adc->fd >= 0)
+		close(adc->fd);
+	adc->fd = -1;
+}
+
+#endif
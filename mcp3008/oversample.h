@@ -0,0 +1,196 @@
+/*
+Oversampling and decimation for the MCP3008
+
+Instead of one conversion a minute, each analog channel is sampled n times
+at a fixed rate and the window is reduced to one value:
+
+  mean          all samples
+  median        the middle one (or two), for spikes
+  trim=PCT      mean of what is left after dropping PCT percent of the
+                samples at each end
+
+With at least about half an LSB of noise to dither the quantizer,
+averaging n independent samples adds log2(n)/2 bits of resolution.  bits[]
+is that nominal figure, 10 + log2(samples the filter used)/2 when the
+window's variance shows the dither is there and 10 when it doesn't.  It
+is not measured: noise that is correlated from sample to sample, or a
+signal that drifts during the window, gains less.  variance[] is the
+window's spread in LSB squared, which is also the first sign of a cloud
+passing or a noisy supply.
+
+Samples are kept per channel in contiguous arrays.  The sums run over
+them with 32 bit accumulators, a loop compilers vectorize at -O2 (NEON on
+the Pi 2 and later); n is capped at OVERSAMPLE_MAX so the sum of squares
+fits.  Median and trimmed mean count samples into a histogram of the
+1024 codes rather than sorting, so every filter is O(n).
+*/
+
+#ifndef OVERSAMPLE_H
+#define OVERSAMPLE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "mcp3008_spi.h"
+
+#define MCP3008_CODES           1024
+#define OVERSAMPLE_MAX          1024            // n * 1023^2 has to fit in 32 bits
+#define OVERSAMPLE_N            64              // samples per window, default
+#define OVERSAMPLE_RATE         100             // Hz, default
+#define OVERSAMPLE_TRIM         25              // percent at each end, default for trim
+
+enum oversample_filter { OVERSAMPLE_MEAN, OVERSAMPLE_MEDIAN, OVERSAMPLE_TRIMMED };
+
+struct oversample {
+	int n;                                  // samples per window
+	int rate;                               // Hz
+	int filter;
+	int trim;                               // percent
+
+	int count[MCP3008_CHANNELS];            // samples so far this window
+	uint16_t sample[MCP3008_CHANNELS][OVERSAMPLE_MAX];
+
+	// Result of the last window, per channel in its mask
+	uint8_t mask;
+	float value[MCP3008_CHANNELS];          // in codes, fractional
+	float variance[MCP3008_CHANNELS];       // LSB^2
+	float bits[MCP3008_CHANNELS];           // nominal resolution, see above
+};
+
+// "mean", "median", "trim" or "trim=PCT".  Returns 0 if understood.
+int oversample_parse_filter(struct oversample *os, const char *spec)
+{
+	char *end;
+	long pct;
+
+	if (strcmp(spec, "mean") == 0)
+		os->filter = OVERSAMPLE_MEAN;
+	else if (strcmp(spec, "median") == 0)
+		os->filter = OVERSAMPLE_MEDIAN;
+	else if (strcmp(spec, "trim") == 0)
+		os->filter = OVERSAMPLE_TRIMMED;
+	else if (strncmp(spec, "trim=", 5) == 0) {
+		pct = strtol(spec + 5, &end, 10);
+		if (end == spec + 5 || *end || pct < 0 || pct >= 50)
+			return -1;
+		os->filter = OVERSAMPLE_TRIMMED;
+		os->trim = pct;
+	} else
+		return -1;
+	return 0;
+}
+
+void oversample_init(struct oversample *os)
+{
+	os->n = OVERSAMPLE_N;
+	os->rate = OVERSAMPLE_RATE;
+	os->filter = OVERSAMPLE_MEAN;
+	os->trim = OVERSAMPLE_TRIM;
+}
+
+// Milliseconds between scans
+static inline long oversample_interval_ms(const struct oversample *os)
+{
+	return 1000 / os->rate;
+}
+
+void oversample_begin(struct oversample *os)
+{
+	memset(os->count, 0, sizeof(os->count));
+}
+
+// Add one scan; returns 1 once every channel has n samples
+int oversample_add(struct oversample *os, const struct mcp3008_scan *scan)
+{
+	int ch, full = scan->mask != 0;
+
+	for (ch = 0; ch < MCP3008_CHANNELS; ch++) {
+		if (!(scan->mask & (1 << ch)))
+			continue;
+		if (os->count[ch] < os->n)
+			os->sample[ch][os->count[ch]++] = scan->value[ch];
+		if (os->count[ch] < os->n)
+			full = 0;
+	}
+	return full;
+}
+
+// Sum and sum of squares.  Kept free of branches and 64 bit arithmetic
+// so it vectorizes.
+static void oversample_sums(const uint16_t *x, int n, uint32_t *sum, uint32_t *sumsq)
+{
+	uint32_t s = 0, q = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		s += x[i];
+		q += (uint32_t)x[i] * x[i];
+	}
+	*sum = s;
+	*sumsq = q;
+}
+
+// Mean of the samples ranked lo to hi-1, from a histogram of the codes
+static float oversample_ranked(const uint16_t *x, int n, int lo, int hi)
+{
+	static uint16_t hist[MCP3008_CODES];
+	uint32_t sum = 0;
+	int rank = 0, code, take;
+
+	memset(hist, 0, sizeof(hist));
+	for (code = 0; code < n; code++)
+		hist[x[code] & (MCP3008_CODES - 1)]++;
+
+	for (code = 0; code < MCP3008_CODES && rank < hi; code++) {
+		if (hist[code] == 0)
+			continue;
+		// How many of this code's samples fall inside [lo, hi)
+		take = (rank + hist[code] < hi ? rank + hist[code] : hi) - (rank > lo ? rank : lo);
+		if (take > 0)
+			sum += take * code;
+		rank += hist[code];
+	}
+	return (float)sum / (hi - lo);
+}
+
+// Reduce the window to one value per channel
+void oversample_finish(struct oversample *os)
+{
+	uint32_t sum, sumsq;
+	double var, used;
+	int ch, n, k;
+
+	os->mask = 0;
+	for (ch = 0; ch < MCP3008_CHANNELS; ch++) {
+		if ((n = os->count[ch]) == 0)
+			continue;
+		os->mask |= 1 << ch;
+
+		oversample_sums(os->sample[ch], n, &sum, &sumsq);
+		var = n > 1 ? ((double)n * sumsq - (double)sum * sum) / ((double)n * (n - 1)) : 0;
+		os->variance[ch] = var;
+
+		switch (os->filter) {
+		case OVERSAMPLE_MEDIAN:
+			os->value[ch] = oversample_ranked(os->sample[ch], n, (n - 1) / 2, n / 2 + 1);
+			used = n * 2 / M_PI;            // efficiency of the median on gaussian noise
+			break;
+		case OVERSAMPLE_TRIMMED:
+			k = n * os->trim / 100;
+			os->value[ch] = oversample_ranked(os->sample[ch], n, k, n - k);
+			used = n - 2 * k;
+			break;
+		default:
+			os->value[ch] = (float)sum / n;
+			used = n;
+			break;
+		}
+
+		// Without noise to dither the quantizer every sample is the same
+		// code and averaging gains nothing
+		os->bits[ch] = 10 + (var >= 0.25 && used > 1 ? log2(used) / 2 : 0);
+	}
+}
+
+#endif
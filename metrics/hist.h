@@ -0,0 +1,107 @@
+/*
+Latency histograms
+
+HDR style: a duration in microseconds goes into one of HIST_SUB linear
+buckets within its power of two, so every bucket is within 1/HIST_SUB
+(about 6%) of the values in it from 1us to over an hour, in a fixed
+array and without keeping samples.  Recording is a clz, a shift and two
+adds, cheap enough to do for every stage of every cycle.
+
+Each histogram is recorded by one thread, the one running its stage: a
+sensor worker for that sensor's task and scans, the main thread for the
+rest.  The fields are atomics so the metrics scrape, on the main or a
+query thread, can read them while that goes on.  The recording thread
+updates them with relaxed loads and stores, which cost no more than plain
+ones, so there's no lock; a quantile may be a sample behind.
+*/
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define HIST_SUB_BITS   4
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS   32                              // up to 2^32 us, 71 minutes
+#define HIST_BUCKETS    ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	atomic_ulong count;
+	_Atomic double sum_us;
+	atomic_uint max_us;
+	atomic_uint bucket[HIST_BUCKETS];
+};
+
+static inline int hist_index(uint32_t us)
+{
+	int e;
+
+	if (us < HIST_SUB)
+		return us;
+	e = 31 - __builtin_clz(us);             // us >= HIST_SUB so e >= HIST_SUB_BITS
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB + (us >> (e - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+// Smallest value that lands in bucket i, and the first one past it
+static inline uint64_t hist_lower(int i)
+{
+	int g = i / HIST_SUB;
+
+	return g == 0 ? (uint64_t)i : (uint64_t)(HIST_SUB + i % HIST_SUB) << (g - 1);
+}
+
+static inline uint64_t hist_upper(int i)
+{
+	int g = i / HIST_SUB;
+
+	return hist_lower(i) + (g == 0 ? 1 : 1ULL << (g - 1));
+}
+
+// Only the recording thread writes, so a load and a store will do
+#define HIST_ADD(field, v) \
+	atomic_store_explicit(&(field), atomic_load_explicit(&(field), memory_order_relaxed) + (v), memory_order_relaxed)
+
+static inline void hist_record_us(struct hist *h, uint32_t us)
+{
+	HIST_ADD(h->bucket[hist_index(us)], 1);
+	HIST_ADD(h->count, 1);
+	HIST_ADD(h->sum_us, us);
+	if (us > atomic_load_explicit(&h->max_us, memory_order_relaxed))
+		atomic_store_explicit(&h->max_us, us, memory_order_relaxed);
+}
+
+static inline void hist_record_ms(struct hist *h, double ms)
+{
+	double us = ms * 1000;
+
+	hist_record_us(h, us <= 0 ? 0 : us >= UINT32_MAX ? UINT32_MAX : (uint32_t)us);
+}
+
+// The value at quantile q (0..1) in microseconds: the top of the bucket
+// holding it, but no more than the largest value seen
+double hist_quantile_us(const struct hist *h, double q)
+{
+	unsigned long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+	uint32_t max_us = atomic_load_explicit(&h->max_us, memory_order_relaxed);
+	unsigned long rank, seen = 0;
+	uint64_t top;
+	int i;
+
+	if (count == 0)
+		return 0;
+	rank = q * count;
+	if (rank >= count)
+		rank = count - 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += atomic_load_explicit(&h->bucket[i], memory_order_relaxed);
+		if (seen > rank)
+			break;
+	}
+	if (i == HIST_BUCKETS)
+		return max_us;
+	top = hist_upper(i) - 1;
+	return top < max_us ? top : max_us;
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+Metrics export
+
+The daemon hands over its stage histograms and a snapshot of its counters
+and these write them out in two forms:
+
+  Prometheus text, at /metrics on the query server's HTTP port (and for
+  a "metrics" line on its Unix socket).  Stages are a summary,
+  weather_stage_seconds{stage="..."}, with the quantiles below, _sum and
+  _count, plus weather_stage_max_seconds.
+
+  curl http://127.0.0.1:8080/metrics
+
+  JSON, published on weather-station/stats every --stats-interval
+  seconds: the same counters, and per stage the count, p50, p99 and max
+  in milliseconds.
+
+Counters with the same name must be next to each other, they share one
+HELP/TYPE header.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "hist.h"
+
+#define METRICS_PREFIX          "weather_"
+
+struct metric_stage {
+	const char *name;
+	const struct hist *h;
+};
+
+struct metric {
+	const char *name;                       // after METRICS_PREFIX, without _total
+	const char *help;
+	const char *label;                      // label name, or NULL
+	const char *label_value;
+	double value;
+	int gauge;                              // otherwise a counter
+};
+
+static const double metrics_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+#define METRICS_QUANTILES       (sizeof(metrics_quantiles) / sizeof(metrics_quantiles[0]))
+
+void metrics_prometheus(FILE *f, const struct metric_stage *stages, int nstages, const struct metric *m, int n)
+{
+	const char *suffix;
+	unsigned int q;
+	int i;
+
+	fprintf(f, "# HELP " METRICS_PREFIX "stage_seconds Time from the start of a stage to its end, waits included.\n");
+	fprintf(f, "# TYPE " METRICS_PREFIX "stage_seconds summary\n");
+	for (i = 0; i < nstages; i++) {
+		for (q = 0; q < METRICS_QUANTILES; q++)
+			fprintf(f, METRICS_PREFIX "stage_seconds{stage=\"%s\",quantile=\"%g\"} %g\n", stages[i].name,
+				metrics_quantiles[q], hist_quantile_us(stages[i].h, metrics_quantiles[q]) / 1e6);
+		fprintf(f, METRICS_PREFIX "stage_seconds_sum{stage=\"%s\"} %g\n", stages[i].name, stages[i].h->sum_us / 1e6);
+		fprintf(f, METRICS_PREFIX "stage_seconds_count{stage=\"%s\"} %lu\n", stages[i].name, stages[i].h->count);
+	}
+	fprintf(f, "# HELP " METRICS_PREFIX "stage_max_seconds Longest run of a stage.\n");
+	fprintf(f, "# TYPE " METRICS_PREFIX "stage_max_seconds gauge\n");
+	for (i = 0; i < nstages; i++)
+		fprintf(f, METRICS_PREFIX "stage_max_seconds{stage=\"%s\"} %g\n", stages[i].name, stages[i].h->max_us / 1e6);
+
+	for (i = 0; i < n; i++) {
+		suffix = m[i].gauge ? "" : "_total";
+		if (i == 0 || strcmp(m[i].name, m[i - 1].name) != 0) {
+			fprintf(f, "# HELP " METRICS_PREFIX "%s%s %s\n", m[i].name, suffix, m[i].help);
+			fprintf(f, "# TYPE " METRICS_PREFIX "%s%s %s\n", m[i].name, suffix, m[i].gauge ? "gauge" : "counter");
+		}
+		if (m[i].label)
+			fprintf(f, METRICS_PREFIX "%s%s{%s=\"%s\"} ", m[i].name, suffix, m[i].label, m[i].label_value);
+		else
+			fprintf(f, METRICS_PREFIX "%s%s ", m[i].name, suffix);
+		if (isnan(m[i].value))
+			fprintf(f, "NaN\n");
+		else
+			fprintf(f, "%.15g\n", m[i].value);
+	}
+}
+
+// {"ts":...,"stages":{"adc":{"n":..,"p50":..,"p99":..,"max":..},...},"counters":{"name_label":..,...}}
+void metrics_json(FILE *f, int64_t ts, const struct metric_stage *stages, int nstages, const struct metric *m, int n)
+{
+	int i;
+
+	fprintf(f, "{\"ts\":%lld,\"stages\":{", (long long)ts);
+	for (i = 0; i < nstages; i++)
+		fprintf(f, "%s\"%s\":{\"n\":%lu,\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f}", i ? "," : "", stages[i].name,
+			stages[i].h->count, hist_quantile_us(stages[i].h, 0.5) / 1000,
+			hist_quantile_us(stages[i].h, 0.99) / 1000, stages[i].h->max_us / 1000.0);
+	fprintf(f, "},\"counters\":{");
+	for (i = 0; i < n; i++) {
+		if (m[i].label)
+			fprintf(f, "%s\"%s_%s\":", i ? "," : "", m[i].name, m[i].label_value);
+		else
+			fprintf(f, "%s\"%s\":", i ? "," : "", m[i].name);
+		if (isnan(m[i].value))
+			fprintf(f, "null");
+		else
+			fprintf(f, "%.15g", m[i].value);
+	}
+	fprintf(f, "}}");
+}
+
+#endif
@@ -0,0 +1,128 @@
+/*
+Change based publishing
+
+With --deadband a channel is only published when its value has moved far
+enough from the last value sent, or when it has been quiet for the
+heartbeat interval so openHAB can tell a steady reading from a dead
+station.  A move counts when it is at least abs, or at least rel times
+the last value, whichever is set.  By default abs is one unit of the last
+decimal published.
+
+  --deadband on                 defaults for every channel
+  --deadband pressure=20        20 Pa
+  --deadband light=5%           5% of the last value sent
+
+A channel going to or from NAN always counts as a change.
+*/
+
+#ifndef DEADBAND_H
+#define DEADBAND_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "../readings.h"
+
+#define DEADBAND_HEARTBEAT      900             // seconds, default
+
+struct deadband {
+	float abs;
+	float rel;
+	float last;                             // last value sent
+	time_t last_sent;
+	unsigned long sent;
+	unsigned long suppressed;
+};
+
+struct deadband deadbands[CH_COUNT];
+int deadband_enabled;
+int deadband_heartbeat = DEADBAND_HEARTBEAT;
+
+void deadband_init(void)
+{
+	int c;
+
+	for (c = 0; c < CH_COUNT; c++) {
+		if (deadbands[c].abs == 0 && deadbands[c].rel == 0)
+			deadbands[c].abs = powf(10, -channels[c].decimals) * 0.999;
+		deadbands[c].last = NAN;
+		deadbands[c].last_sent = 0;
+	}
+}
+
+// "on", "name=abs" or "name=rel%".  Returns 0 if understood.
+int deadband_parse(const char *spec)
+{
+	const char *eq = strchr(spec, '=');
+	char *end;
+	float v;
+	int c;
+
+	deadband_enabled = 1;
+	if (strcmp(spec, "on") == 0)
+		return 0;
+	if (eq == NULL)
+		return -1;
+	for (c = 0; c < CH_COUNT; c++) {
+		if (strlen(channels[c].name) == (size_t)(eq - spec) && strncmp(spec, channels[c].name, eq - spec) == 0)
+			break;
+	}
+	v = strtof(eq + 1, &end);
+	if (c == CH_COUNT || end == eq + 1 || v < 0)
+		return -1;
+	if (*end == '%') {
+		deadbands[c].rel = v / 100;
+		deadbands[c].abs = 0;
+	} else {
+		deadbands[c].abs = v;
+		deadbands[c].rel = 0;
+	}
+	return 0;
+}
+
+// Should channel c go out with value v?
+int deadband_check(int c, float v, time_t now)
+{
+	struct deadband *db = &deadbands[c];
+	float moved;
+
+	if (!deadband_enabled || now - db->last_sent >= deadband_heartbeat)
+		return 1;
+	if (isnan(v) || isnan(db->last)) {
+		if (isnan(v) != isnan(db->last))
+			return 1;
+	} else {
+		moved = fabsf(v - db->last);
+		if ((db->abs > 0 && moved >= db->abs) || (db->rel > 0 && moved >= db->rel * fabsf(db->last)))
+			return 1;
+	}
+	return 0;
+}
+
+// Record that channel c went out with value v
+void deadband_sent(int c, float v, time_t now)
+{
+	deadbands[c].last = v;
+	deadbands[c].last_sent = now;
+	deadbands[c].sent++;
+}
+
+// Record that channel c was held back
+void deadband_skip(int c)
+{
+	deadbands[c].suppressed++;
+}
+
+void deadband_totals(unsigned long *sent, unsigned long *suppressed)
+{
+	int c;
+
+	*sent = *suppressed = 0;
+	for (c = 0; c < CH_COUNT; c++) {
+		*sent += deadbands[c].sent;
+		*suppressed += deadbands[c].suppressed;
+	}
+}
+
+#endif
@@ -0,0 +1,197 @@
+/*
+Store-and-forward outbox
+
+A publish cycle that doesn't get through (broker down, acks missing) puts
+its readings here with their acquisition time instead of losing them.
+Once the broker is back the backlog is sent oldest first, OUTBOX_BATCH
+readings to a message, at most drain_rate messages per call, and a batch
+only leaves the outbox when the broker has acknowledged it.  A batch that
+was delivered but whose ack got lost is sent again.
+
+Batches go to TOPIC_backlog as a JSON array of readings:
+
+  [{"ts":1767225600,"temperature":12.3,"dewpoint":null,...},...]
+
+The live topics keep showing current conditions; the backlog is for
+whatever records history.
+
+The queue is a ring of fixed size entries in a memory-mapped file in the
+state directory, like the rain totals, so it survives a restart.  It
+holds OUTBOX_SLOTS readings; when full the oldest is dropped, and readings
+older than max_age are dropped as well.
+*/
+
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "../readings.h"
+#include "payload.h"
+
+#define OUTBOX_MAGIC            0x58424F57      // "WOBX"
+#define OUTBOX_VERSION          2
+#define OUTBOX_SLOTS            16384           // 11 days of one reading a minute
+#define OUTBOX_BATCH            30              // readings per backlog message
+#define OUTBOX_PAYLOAD_MAX      16384
+#define OUTBOX_DRAIN_RATE       2               // messages per drain call, default
+#define OUTBOX_MAX_AGE          (7 * 86400)     // seconds, default
+
+struct outbox_entry {
+	uint32_t ts;
+	uint32_t valid;
+	float value[CH_COUNT];
+};
+
+struct outbox_state {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t columns;
+	uint64_t head;                          // oldest queued reading, slot is head % OUTBOX_SLOTS
+	uint64_t tail;                          // next free
+	uint64_t queued;                        // lifetime counters
+	uint64_t sent;
+	uint64_t dropped;                       // full or too old
+	struct outbox_entry entry[OUTBOX_SLOTS];
+};
+
+struct outbox {
+	struct outbox_state *s;
+	int mapped;
+	int max_age;
+	int drain_rate;
+	char payload[OUTBOX_PAYLOAD_MAX];
+};
+
+// Sends one batch.  Returns 0 once the broker has acknowledged it.
+typedef int (*outbox_send)(void *ctx, const char *payload);
+
+// Map the queue file, starting empty if it is missing or from another
+// version.  Falls back to memory only.  Returns 0 if the queue is persistent.
+int outbox_open(struct outbox *ob, const char *path, int max_age, int drain_rate)
+{
+	void *map = MAP_FAILED;
+	int fd;
+
+	ob->max_age = max_age;
+	ob->drain_rate = drain_rate;
+	ob->mapped = 0;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd >= 0) {
+		if (ftruncate(fd, sizeof(struct outbox_state)) == 0)
+			map = mmap(NULL, sizeof(struct outbox_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (map != MAP_FAILED) {
+		ob->s = map;
+		ob->mapped = 1;
+	} else {
+		ob->s = calloc(1, sizeof(struct outbox_state));
+	}
+
+	if (ob->s->magic != OUTBOX_MAGIC || ob->s->version != OUTBOX_VERSION ||
+	    ob->s->columns != CH_COUNT || ob->s->tail - ob->s->head > OUTBOX_SLOTS) {
+		memset(ob->s, 0, offsetof(struct outbox_state, entry));
+		ob->s->magic = OUTBOX_MAGIC;
+		ob->s->version = OUTBOX_VERSION;
+		ob->s->columns = CH_COUNT;
+	}
+	return ob->mapped ? 0 : -1;
+}
+
+static inline unsigned int outbox_count(const struct outbox *ob)
+{
+	return ob->s->tail - ob->s->head;
+}
+
+// Drop readings older than max_age
+void outbox_expire(struct outbox *ob, int64_t now)
+{
+	struct outbox_state *s = ob->s;
+
+	while (s->head != s->tail && s->entry[s->head % OUTBOX_SLOTS].ts + (int64_t)ob->max_age < now) {
+		s->head++;
+		s->dropped++;
+	}
+}
+
+void outbox_push(struct outbox *ob, int64_t ts, const float *values, uint32_t valid)
+{
+	struct outbox_state *s = ob->s;
+	struct outbox_entry *e = &s->entry[s->tail % OUTBOX_SLOTS];
+
+	if (s->tail - s->head == OUTBOX_SLOTS) {
+		s->head++;                      // full, lose the oldest
+		s->dropped++;
+	}
+	e->ts = ts;
+	e->valid = valid;
+	memcpy(e->value, values, sizeof(e->value));
+	s->tail++;
+	s->queued++;
+}
+
+// Format up to OUTBOX_BATCH readings from the head into ob->payload, each
+// as payload_json() writes a cycle.  Returns how many went in.
+static int outbox_format(struct outbox *ob)
+{
+	struct outbox_state *s = ob->s;
+	size_t len = 1;
+	int n, w;
+
+	ob->payload[0] = '[';
+	for (n = 0; n < OUTBOX_BATCH && s->head + n != s->tail; n++) {
+		const struct outbox_entry *e = &s->entry[(s->head + n) % OUTBOX_SLOTS];
+
+		// Room for the separator, the closing ']' and the NUL
+		if (len + 3 > sizeof(ob->payload))
+			break;
+		if (n)
+			ob->payload[len++] = ',';
+		w = payload_json(ob->payload + len, sizeof(ob->payload) - len - 2, e->ts, e->value, e->valid);
+		if (w < 0) {
+			len -= n ? 1 : 0;       // didn't fit, leave it for the next batch
+			break;
+		}
+		len += w;
+	}
+	ob->payload[len++] = ']';
+	ob->payload[len] = '\0';
+	return n;
+}
+
+// Send up to drain_rate batches, oldest first.  Stops at the first batch
+// the broker doesn't acknowledge.  Returns the number of readings sent.
+int outbox_drain(struct outbox *ob, int64_t now, outbox_send send, void *ctx)
+{
+	struct outbox_state *s = ob->s;
+	int sent = 0;
+	int i, n;
+
+	outbox_expire(ob, now);
+	for (i = 0; i < ob->drain_rate && s->head != s->tail; i++) {
+		if ((n = outbox_format(ob)) == 0 || send(ctx, ob->payload) != 0)
+			break;
+		s->head += n;
+		s->sent += n;
+		sent += n;
+	}
+	return sent;
+}
+
+// Schedule write back of the queue
+void outbox_sync(struct outbox *ob)
+{
+	if (ob->mapped)
+		msync(ob->s, sizeof(struct outbox_state), MS_ASYNC);
+}
+
+#endif
@@ -0,0 +1,178 @@
+/*
+Message payloads
+
+Per-topic payloads are a single number.  The batched modes put a whole
+cycle into one message on TOPIC_cycle:
+
+  json   {"ts":1767225600,"temperature":12.3,"dewpoint":7.1,...}
+         with "invalid":["dewpoint",...] at the end if any value failed
+         the filters
+  cbor   [1767225600, 12.3, 7.1, ..., 16383]  (RFC 8949) an array of the
+         time, one float32 per channel in readings.h order, null for a
+         channel with no reading, and last the valid mask with bit n set
+         for channel n
+
+Numbers are written with payload_fixed(), which rounds to the channel's
+decimals and prints the digits itself instead of going through printf.
+Everything is built in the caller's buffer; nothing is allocated.
+*/
+
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "../readings.h"
+
+enum payload_mode { PAYLOAD_TOPICS, PAYLOAD_JSON, PAYLOAD_CBOR };
+
+static const char *payload_modes[] = { "topics", "json", "cbor", NULL };
+
+#define PAYLOAD_MAX             1024            // one cycle, either encoding
+#define PAYLOAD_FIXED_LIMIT     1e15            // beyond this payload_fixed() uses %g
+
+static const double payload_scale[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
+// Write v rounded to decimals (0-6) places.  Returns the length, or -1
+// if it doesn't fit in len bytes including the terminating NUL.
+int payload_fixed(char *buf, size_t len, float v, int decimals)
+{
+	char digits[24];
+	uint64_t n, whole;
+	size_t out = 0;
+	int i = 0, d;
+
+	if (isnan(v) || isinf(v) || fabs(v) * payload_scale[decimals] >= PAYLOAD_FIXED_LIMIT) {
+		d = snprintf(buf, len, "%g", v);
+		return d >= 0 && (size_t)d < len ? d : -1;
+	}
+
+	n = llround(fabs((double)v) * payload_scale[decimals]);
+	if (v < 0 && n != 0)
+		digits[i++] = '-';
+
+	// Digits come out backwards: decimals first, then the whole part
+	whole = n;
+	for (d = 0; d < decimals; d++)
+		whole /= 10;
+	do {
+		digits[i++] = '0' + whole % 10;
+		whole /= 10;
+	} while (whole);
+
+	if (i + (decimals ? decimals + 1 : 0) >= (int)len)
+		return -1;
+	if (digits[0] == '-')
+		buf[out++] = '-';
+	for (d = i - 1; d >= (digits[0] == '-'); d--)
+		buf[out++] = digits[d];
+	if (decimals) {
+		buf[out++] = '.';
+		for (d = decimals - 1; d >= 0; d--) {
+			buf[out + d] = '0' + n % 10;
+			n /= 10;
+		}
+		out += decimals;
+	}
+	buf[out] = '\0';
+	return out;
+}
+
+// One cycle as JSON.  Returns the length or -1 if it doesn't fit.
+int payload_json(char *buf, size_t len, int64_t ts, const float *values, uint32_t valid)
+{
+	size_t out;
+	int c, n, first = 1;
+
+	n = snprintf(buf, len, "{\"ts\":%lld", (long long)ts);
+	if (n < 0 || (size_t)n >= len)
+		return -1;
+	out = n;
+	for (c = 0; c < CH_COUNT; c++) {
+		n = snprintf(buf + out, len - out, ",\"%s\":", channels[c].name);
+		if (n < 0 || (size_t)n >= len - out)
+			return -1;
+		out += n;
+		if (isnan(values[c]))
+			n = snprintf(buf + out, len - out, "null");
+		else
+			n = payload_fixed(buf + out, len - out, values[c], channels[c].decimals);
+		if (n < 0 || (size_t)n >= len - out)
+			return -1;
+		out += n;
+	}
+	for (c = 0; c < CH_COUNT; c++) {
+		if (valid & (1u << c))
+			continue;
+		n = snprintf(buf + out, len - out, "%s\"%s\"", first ? ",\"invalid\":[" : ",", channels[c].name);
+		if (n < 0 || (size_t)n >= len - out)
+			return -1;
+		out += n;
+		first = 0;
+	}
+	if (out + 2 + !first > len)
+		return -1;
+	if (!first)
+		buf[out++] = ']';
+	buf[out++] = '}';
+	buf[out] = '\0';
+	return out;
+}
+
+// CBOR head: major type and argument
+static size_t payload_cbor_head(uint8_t *p, int major, uint64_t v)
+{
+	int bytes, i;
+
+	if (v < 24) {
+		p[0] = major << 5 | v;
+		return 1;
+	}
+	bytes = v <= 0xFF ? 1 : v <= 0xFFFF ? 2 : v <= 0xFFFFFFFF ? 4 : 8;
+	p[0] = major << 5 | (bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27);
+	for (i = 0; i < bytes; i++)
+		p[1 + i] = v >> (8 * (bytes - 1 - i));
+	return 1 + bytes;
+}
+
+// One cycle as CBOR.  Returns the length or -1 if it doesn't fit.
+int payload_cbor(uint8_t *buf, size_t len, int64_t ts, const float *values, uint32_t valid)
+{
+	size_t out = 0;
+	uint32_t bits;
+	int c;
+
+	if (len < 2 + 9 + CH_COUNT * 5 + 5)
+		return -1;
+	out += payload_cbor_head(buf + out, 4, CH_COUNT + 2);  // array
+	out += payload_cbor_head(buf + out, 0, ts);             // unsigned int
+	for (c = 0; c < CH_COUNT; c++) {
+		if (isnan(values[c])) {
+			buf[out++] = 0xF6;                      // null
+			continue;
+		}
+		memcpy(&bits, &values[c], sizeof(bits));
+		buf[out++] = 0xFA;                              // float32, big endian
+		buf[out++] = bits >> 24;
+		buf[out++] = bits >> 16;
+		buf[out++] = bits >> 8;
+		buf[out++] = bits;
+	}
+	out += payload_cbor_head(buf + out, 0, valid & CH_ALL);
+	return out;
+}
+
+int payload_parse_mode(const char *name)
+{
+	int i;
+
+	for (i = 0; payload_modes[i]; i++) {
+		if (strcmp(name, payload_modes[i]) == 0)
+			return i;
+	}
+	return -1;
+}
+
+#endif
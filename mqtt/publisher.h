@@ -0,0 +1,277 @@
+/*
+Long lived MQTT publisher
+
+One paho client is created at startup and kept connected for the life of the
+daemon.  If the broker goes away the connection is retried with exponential
+backoff instead of quitting.  Publishes are pipelined: up to
+PUBLISHER_WINDOW QoS 1 messages may be unacknowledged at once, and the acks
+are collected by the paho delivery callback on its own thread.
+
+publisher_flush() reports what the current cycle, since
+publisher_begin_cycle(), left unacknowledged.  A broker acks QoS 1
+messages in the order it received them (MQTT 3.1.1, 4.6), so acks go to
+whatever earlier cycles still had in flight first; a late ack is not
+credited to this cycle.  If the connection drops, everything in flight is
+lost: with a clean session paho won't resend it, so it counts as
+unacknowledged, and the caller keeps those readings for the outbox.
+*/
+
+#ifndef PUBLISHER_H
+#define PUBLISHER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "MQTTClient.h"
+
+#define PUBLISHER_WINDOW        8               // max unacknowledged QoS 1 messages
+#define PUBLISHER_BACKOFF_MIN   1               // seconds between reconnect attempts
+#define PUBLISHER_BACKOFF_MAX   300
+
+struct publisher {
+	MQTTClient client;
+	MQTTClient_connectOptions conn_opts;
+	int qos;
+	int window;
+	int connected;
+	int inflight;                           // published but not yet acked
+	int earlier;                            // of those, from before this cycle
+	int cycle_sent;                         // this cycle's messages
+	int cycle_acked;
+	int backoff;
+	time_t next_attempt;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct timespec cycle_start;
+
+	// Statistics
+	unsigned long sent;
+	unsigned long acked;
+	unsigned long failed;
+	unsigned long lost;                     // in flight when the connection dropped
+	unsigned long reconnects;
+	double last_cycle_ms;                   // first publish to last ack
+};
+
+static double publisher_elapsed_ms(const struct timespec *from)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) * 1000.0 + (now.tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+// ======================================================================
+// paho callbacks, run on the client's receive thread
+
+static void publisher_delivered(void *context, MQTTClient_deliveryToken token)
+{
+	struct publisher *pub = context;
+
+	pthread_mutex_lock(&pub->lock);
+	if (pub->inflight > 0)
+		pub->inflight--;
+	if (pub->earlier > 0)
+		pub->earlier--;
+	else
+		pub->cycle_acked++;
+	pub->acked++;
+	pthread_cond_broadcast(&pub->cond);
+	pthread_mutex_unlock(&pub->lock);
+}
+
+static void publisher_connection_lost(void *context, char *cause)
+{
+	struct publisher *pub = context;
+
+	pthread_mutex_lock(&pub->lock);
+	pub->connected = 0;
+	pub->lost += pub->inflight;
+	pub->inflight = 0;                      // cleansession: pending acks will never arrive
+	pub->earlier = 0;
+	pub->next_attempt = 0;
+	pthread_cond_broadcast(&pub->cond);
+	pthread_mutex_unlock(&pub->lock);
+}
+
+static int publisher_arrived(void *context, char *topic, int topic_len, MQTTClient_message *message)
+{
+	// We never subscribe, but paho requires this callback
+	MQTTClient_freeMessage(&message);
+	MQTTClient_free(topic);
+	return 1;
+}
+
+// ======================================================================
+
+int publisher_init(struct publisher *pub, const char *address, const char *clientid, int qos)
+{
+	MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
+	int rc;
+
+	memset(pub, 0, sizeof(*pub));
+	pthread_mutex_init(&pub->lock, NULL);
+	pthread_cond_init(&pub->cond, NULL);
+	pub->qos = qos;
+	pub->window = PUBLISHER_WINDOW;
+	pub->backoff = PUBLISHER_BACKOFF_MIN;
+
+	conn_opts.keepAliveInterval = 20;
+	conn_opts.cleansession = 1;
+	pub->conn_opts = conn_opts;
+
+	rc = MQTTClient_create(&pub->client, address, clientid, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+	if (rc != MQTTCLIENT_SUCCESS)
+		return rc;
+
+	return MQTTClient_setCallbacks(pub->client, pub, publisher_connection_lost,
+		publisher_arrived, publisher_delivered);
+}
+
+// Connect if we are not already, honouring the reconnect backoff.
+// Returns 0 when connected.
+int publisher_connect(struct publisher *pub)
+{
+	time_t now = time(NULL);
+	int rc;
+
+	pthread_mutex_lock(&pub->lock);
+	if (pub->connected) {
+		pthread_mutex_unlock(&pub->lock);
+		return 0;
+	}
+	if (now < pub->next_attempt) {
+		pthread_mutex_unlock(&pub->lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&pub->lock);
+
+	rc = MQTTClient_connect(pub->client, &pub->conn_opts);
+
+	pthread_mutex_lock(&pub->lock);
+	if (rc == MQTTCLIENT_SUCCESS) {
+		pub->connected = 1;
+		pub->lost += pub->inflight;
+		pub->inflight = 0;
+		pub->earlier = 0;
+		pub->backoff = PUBLISHER_BACKOFF_MIN;
+		pub->reconnects++;
+	} else {
+		pub->next_attempt = now + pub->backoff;
+		pub->backoff *= 2;
+		if (pub->backoff > PUBLISHER_BACKOFF_MAX)
+			pub->backoff = PUBLISHER_BACKOFF_MAX;
+	}
+	pthread_mutex_unlock(&pub->lock);
+
+	return rc == MQTTCLIENT_SUCCESS ? 0 : -1;
+}
+
+// Mark the start of a publish cycle, for latency and for what
+// publisher_flush() reports
+void publisher_begin_cycle(struct publisher *pub)
+{
+	pthread_mutex_lock(&pub->lock);
+	pub->earlier = pub->inflight;
+	pub->cycle_sent = 0;
+	pub->cycle_acked = 0;
+	pthread_mutex_unlock(&pub->lock);
+	clock_gettime(CLOCK_MONOTONIC, &pub->cycle_start);
+}
+
+// Wait until fewer than limit messages are in flight.  Must hold pub->lock.
+static int publisher_wait_inflight(struct publisher *pub, int limit, unsigned long timeout_ms)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	while (pub->connected && pub->inflight >= limit) {
+		if (pthread_cond_timedwait(&pub->cond, &pub->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+	return pub->inflight < limit ? 0 : -1;
+}
+
+// Queue one message.  Blocks only while the in-flight window is full.
+int publisher_publish(struct publisher *pub, const char *topic, const void *payload, int len, unsigned long timeout_ms)
+{
+	MQTTClient_deliveryToken token;
+	int rc;
+
+	if (publisher_connect(pub) != 0) {
+		pub->failed++;
+		return -1;
+	}
+
+	pthread_mutex_lock(&pub->lock);
+	if (pub->qos > 0 && publisher_wait_inflight(pub, pub->window, timeout_ms) != 0) {
+		pub->failed++;
+		pthread_mutex_unlock(&pub->lock);
+		return -1;
+	}
+	if (pub->qos > 0) {
+		pub->inflight++;                // counted before the ack can race us
+		pub->cycle_sent++;
+	}
+	pthread_mutex_unlock(&pub->lock);
+
+	rc = MQTTClient_publish(pub->client, topic, len, (void *)payload, pub->qos, 0, &token);
+
+	pthread_mutex_lock(&pub->lock);
+	if (rc == MQTTCLIENT_SUCCESS) {
+		pub->sent++;
+	} else {
+		if (pub->qos > 0) {
+			if (pub->inflight > 0)
+				pub->inflight--;
+			pub->cycle_sent--;      // the caller counts it as failed
+		}
+		if (rc == MQTTCLIENT_DISCONNECTED)
+			pub->connected = 0;
+		pub->failed++;
+	}
+	pthread_mutex_unlock(&pub->lock);
+
+	return rc == MQTTCLIENT_SUCCESS ? 0 : -1;
+}
+
+// Queue a text message
+int publisher_send(struct publisher *pub, const char *topic, const char *payload, unsigned long timeout_ms)
+{
+	return publisher_publish(pub, topic, payload, strlen(payload), timeout_ms);
+}
+
+// Wait for every outstanding ack of this cycle.  Returns the number of
+// this cycle's messages never acknowledged: still in flight at the
+// timeout, or lost with the connection.
+int publisher_flush(struct publisher *pub, unsigned long timeout_ms)
+{
+	int remaining;
+
+	pthread_mutex_lock(&pub->lock);
+	publisher_wait_inflight(pub, 1, timeout_ms);
+	remaining = pub->cycle_sent - pub->cycle_acked;
+	pthread_mutex_unlock(&pub->lock);
+
+	pub->last_cycle_ms = publisher_elapsed_ms(&pub->cycle_start);
+	return remaining;
+}
+
+void publisher_close(struct publisher *pub)
+{
+	if (pub->connected)
+		MQTTClient_disconnect(pub->client, 10000);
+	MQTTClient_destroy(&pub->client);
+	pthread_cond_destroy(&pub->cond);
+	pthread_mutex_destroy(&pub->lock);
+}
+
+#endif
@@ -0,0 +1,77 @@
+/*
+Rain gauge and anemometer pulses
+
+The interrupt handlers only timestamp the edge (CLOCK_MONOTONIC) and push
+it into a lock-free ring.  Debouncing and counting happen in the main
+thread when the ring is drained, so nothing is shared with the ISR threads
+except the ring itself.
+
+An edge is a bounce if it comes within debounce_ns of the previous edge,
+as in the old handlers, but measured in wall time rather than clock()'s
+process CPU time.
+*/
+
+#ifndef PULSES_H
+#define PULSES_H
+
+#include <stdint.h>
+#include <time.h>
+#include "spsc_ring.h"
+#include "../scheduler/clock.h"
+
+#define PULSE_RING_ORDER 12                     // 4096 edges between drains
+
+SPSC_RING_DEFINE(pulse_ring, uint64_t, PULSE_RING_ORDER)
+
+struct pulse_source {
+	const char *name;
+	uint64_t debounce_ns;
+	struct pulse_ring ring;
+
+	// Consumer side only
+	void (*tap)(struct pulse_source *src, uint64_t ts);     // sees every edge, bounces too
+	uint64_t last_edge;
+	unsigned long edges;                    // everything seen by the ISR
+	unsigned long count;                    // debounced pulses
+	unsigned long bounces;
+};
+
+static inline uint64_t pulse_now_ns(void)
+{
+	struct timespec ts;
+	sched_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Called from the interrupt thread
+static inline void pulse_edge(struct pulse_source *src)
+{
+	pulse_ring_push(&src->ring, pulse_now_ns());
+}
+
+// Debounce and count everything queued since the last drain.  accept, if
+// given, is called with the timestamp of every pulse that is kept.
+// Returns the number of pulses kept.
+unsigned long pulse_drain(struct pulse_source *src, void (*accept)(void *ctx, uint64_t ts), void *ctx)
+{
+	unsigned long kept = 0;
+	uint64_t ts;
+
+	while (pulse_ring_pop(&src->ring, &ts)) {
+		if (src->tap)
+			src->tap(src, ts);
+		src->edges++;
+		if (src->edges > 1 && ts - src->last_edge <= src->debounce_ns) {
+			src->bounces++;
+		} else {
+			src->count++;
+			kept++;
+			if (accept)
+				accept(ctx, ts);
+		}
+		src->last_edge = ts;
+	}
+	return kept;
+}
+
+#endif
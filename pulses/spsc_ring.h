@@ -0,0 +1,56 @@
+/*
+Lock-free single producer / single consumer ring
+
+SPSC_RING_DEFINE(name, type, order) declares struct name holding 2^order
+elements of type, with name_push() for the one producer thread and
+name_pop() for the one consumer thread.  No locks and no system calls, so
+push is safe to call from the wiringPi interrupt threads.
+
+head is only written by the producer and tail only by the consumer; each
+publishes its slot with a release store that the other side reads with an
+acquire load.  They sit on separate cache lines so the two cores do not
+fight over one line.  A push to a full ring fails and is counted in
+dropped rather than overwriting data the consumer has not seen; dropped is
+atomic so the consumer's thread can report it.
+*/
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdatomic.h>
+
+#define SPSC_CACHE_LINE 64
+
+#define SPSC_RING_DEFINE(name, type, order)                                     \
+struct name {                                                                   \
+	_Alignas(SPSC_CACHE_LINE) atomic_uint head;     /* next slot to write */ \
+	atomic_ulong dropped;                           /* producer side */     \
+	_Alignas(SPSC_CACHE_LINE) atomic_uint tail;     /* next slot to read */ \
+	type slot[1u << (order)];                                               \
+};                                                                              \
+                                                                                \
+static inline int name##_push(struct name *r, type value)                      \
+{                                                                               \
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed); \
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire); \
+	if (head - tail >= (1u << (order))) {                                   \
+		atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed); \
+		return -1;                                                      \
+	}                                                                       \
+	r->slot[head & ((1u << (order)) - 1)] = value;                          \
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);        \
+	return 0;                                                               \
+}                                                                               \
+                                                                                \
+static inline int name##_pop(struct name *r, type *value)                      \
+{                                                                               \
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed); \
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire); \
+	if (tail == head)                                                       \
+		return 0;                                                       \
+	*value = r->slot[tail & ((1u << (order)) - 1)];                         \
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);        \
+	return 1;                                                               \
+}
+
+#endif
@@ -0,0 +1,616 @@
+/*
+History query server
+
+Answers range queries from the history store and its rollups, so charts
+don't need openHAB persistence.  It listens on a Unix socket in the state
+directory and, if --http-port is given, on that port on 127.0.0.1.  An
+acceptor thread hands connections to QUERY_THREADS workers through a small
+queue.  The sensor tasks never wait for a client: the only thing they
+share with the workers is the brief copy the store and rollups make of
+data not yet on disk.
+
+A request is key=value pairs separated by spaces or '&':
+
+  channel   name or topic from readings.h (required)
+  range     how far back from now, e.g. 90m, 36h, 7d (default 1d)
+  from, to  unix times, instead of range
+  step      raw, 1m, 10m, 1h, 1d or auto (default auto)
+  points    most buckets auto may return (default 1000)
+  agg       value, mean, min, max, sum, count or all (default value,
+            the channel's own rollup rule)
+
+  echo 'channel=pressure range=7d step=1h agg=mean' | socat - UNIX-CONNECT:/var/lib/weather-station/query.sock
+  curl 'http://127.0.0.1:8080/query?channel=pressure&range=7d&step=1h'
+
+Over HTTP each key and value is URL decoded, %XX and '+' for a space, after
+the split on '&' and '=', so channel=weather-station%2Fpressure works.
+
+The reply is CSV, time first, written through a fixed buffer as the
+history is read.  A bad request gets a single line starting with "error".
+
+GET /metrics, or a "metrics" line on the socket, gets the daemon's
+Prometheus text instead (see metrics/metrics.h), if it set a metrics
+callback.  Without a store (st NULL) metrics are still served and history
+queries get an error.
+*/
+
+#ifndef QUERY_SERVER_H
+#define QUERY_SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../store/store.h"
+#include "../store/rollup.h"
+
+#define QUERY_SOCKET_NAME       "query.sock"
+#define QUERY_THREADS           4
+#define QUERY_QUEUE             64              // accepted connections waiting for a worker
+#define QUERY_REQUEST_MAX       1024
+#define QUERY_OUT_MAX           8192
+#define QUERY_TIMEOUT_S         5               // per read/write, so a stuck client frees its worker
+#define QUERY_STEP_RAW          ROLLUP_TIERS
+#define QUERY_STEP_AUTO         -1
+
+enum query_agg { AGG_VALUE, AGG_MEAN, AGG_MIN, AGG_MAX, AGG_SUM, AGG_COUNT, AGG_ALL, AGG_KINDS };
+
+static const char *query_aggs[AGG_KINDS] = { "value", "mean", "min", "max", "sum", "count", "all" };
+
+struct query {
+	int channel;
+	int64_t from;
+	int64_t to;
+	int step;                               // tier, QUERY_STEP_RAW or QUERY_STEP_AUTO
+	int points;
+	int agg;
+};
+
+// Response buffer, one per worker.  Errors writing to the client stick so
+// the visitors can stop the scan.
+struct query_out {
+	int fd;
+	int error;
+	size_t len;
+	unsigned long rows;
+	char buf[QUERY_OUT_MAX];
+};
+
+struct query_conn {
+	int fd;
+	int http;
+};
+
+struct query_server {
+	struct store *st;
+	struct rollup *ru;
+	int unix_fd;
+	int http_fd;
+	pthread_t acceptor;
+	pthread_t workers[QUERY_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct query_conn queue[QUERY_QUEUE];
+	int head;
+	int count;
+
+	void (*metrics)(FILE *f, void *ctx);    // writes /metrics
+	void *metrics_ctx;
+
+	// Statistics, under lock
+	unsigned long requests;
+	unsigned long errors;
+	unsigned long rejected;                 // queue full
+	unsigned long rows;
+};
+
+// ======================================================================
+// Output
+
+static void query_flush(struct query_out *out)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (!out->error && done < out->len) {
+		n = write(out->fd, out->buf + done, out->len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			out->error = 1;
+		else
+			done += n;
+	}
+	out->len = 0;
+}
+
+static void query_printf(struct query_out *out, const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, format, ap);
+	va_end(ap);
+	if (n >= 0 && (size_t)n >= sizeof(out->buf) - out->len) {
+		query_flush(out);
+		va_start(ap, format);
+		n = vsnprintf(out->buf, sizeof(out->buf), format, ap);
+		va_end(ap);
+	}
+	if (n > 0)
+		out->len += (size_t)n < sizeof(out->buf) ? (size_t)n : sizeof(out->buf) - 1;
+}
+
+// ======================================================================
+// Request parsing
+
+// 90m, 36h, 7d, 2w, or plain seconds
+static int64_t query_duration(const char *s)
+{
+	char *end;
+	int64_t n = strtoll(s, &end, 10);
+
+	switch (*end) {
+	case 'w': return n * 7 * 86400;
+	case 'd': return n * 86400;
+	case 'h': return n * 3600;
+	case 'm': return n * 60;
+	case 's':
+	case '\0': return n;
+	default: return -1;
+	}
+}
+
+static int query_hex(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// Decode %XX and '+' in place.  Returns -1 for a bad escape or a NUL.
+static int query_unescape(char *s)
+{
+	char *out = s;
+	int hi, lo;
+
+	for (; *s; s++) {
+		if (*s == '+') {
+			*out++ = ' ';
+		} else if (*s == '%') {
+			if ((hi = query_hex(s[1])) < 0 || (lo = query_hex(s[2])) < 0 || (hi | lo) == 0)
+				return -1;
+			*out++ = hi << 4 | lo;
+			s += 2;
+		} else {
+			*out++ = *s;
+		}
+	}
+	*out = '\0';
+	return 0;
+}
+
+static int query_channel(const char *name)
+{
+	int c;
+
+	for (c = 0; c < CH_COUNT; c++) {
+		if (strcmp(name, channels[c].name) == 0 || strcmp(name, channels[c].topic) == 0)
+			return c;
+	}
+	return -1;
+}
+
+// Parse req in place, URL decoding each key and value if url is set.
+// Returns NULL or what was wrong with it.
+const char *query_parse(char *req, int url, struct query *q, int64_t now)
+{
+	char *save, *tok, *value;
+	int64_t range = 86400;
+	int i;
+
+	q->channel = -1;
+	q->from = -1;
+	q->to = now;
+	q->step = QUERY_STEP_AUTO;
+	q->points = ROLLUP_MAX_POINTS;
+	q->agg = AGG_VALUE;
+
+	for (tok = strtok_r(req, " &\r\n", &save); tok; tok = strtok_r(NULL, " &\r\n", &save)) {
+		if ((value = strchr(tok, '=')) == NULL)
+			return "expected key=value";
+		*value++ = '\0';
+		if (url && (query_unescape(tok) < 0 || query_unescape(value) < 0))
+			return "bad escape";
+
+		if (strcmp(tok, "channel") == 0) {
+			if ((q->channel = query_channel(value)) < 0)
+				return "unknown channel";
+		} else if (strcmp(tok, "range") == 0) {
+			if ((range = query_duration(value)) <= 0)
+				return "bad range";
+		} else if (strcmp(tok, "from") == 0) {
+			q->from = strtoll(value, NULL, 10);
+		} else if (strcmp(tok, "to") == 0) {
+			q->to = strtoll(value, NULL, 10);
+		} else if (strcmp(tok, "points") == 0) {
+			if ((q->points = atoi(value)) <= 0)
+				return "bad points";
+		} else if (strcmp(tok, "step") == 0) {
+			if (strcmp(value, "auto") == 0)
+				q->step = QUERY_STEP_AUTO;
+			else if (strcmp(value, "raw") == 0)
+				q->step = QUERY_STEP_RAW;
+			else {
+				for (i = 0; i < ROLLUP_TIERS && strcmp(value, rollup_names[i]) != 0; i++)
+					;
+				if (i == ROLLUP_TIERS)
+					return "bad step";
+				q->step = i;
+			}
+		} else if (strcmp(tok, "agg") == 0) {
+			for (i = 0; i < AGG_KINDS && strcmp(value, query_aggs[i]) != 0; i++)
+				;
+			if (i == AGG_KINDS)
+				return "bad agg";
+			q->agg = i;
+		} else {
+			return "unknown key";
+		}
+	}
+
+	if (q->channel < 0)
+		return "channel missing";
+	if (q->from < 0)
+		q->from = q->to - range;
+	if (q->from > q->to)
+		return "from after to";
+	return NULL;
+}
+
+// ======================================================================
+// Execution
+
+struct query_exec {
+	struct query *q;
+	struct query_out *out;
+};
+
+static int query_raw_row(void *ctx, int64_t ts, const float *values, int columns)
+{
+	struct query_exec *x = ctx;
+	int c = x->q->channel;
+
+	if (c < columns && !isnan(values[c])) {
+		query_printf(x->out, "%lld,%g\n", (long long)ts, values[c]);
+		x->out->rows++;
+	}
+	return x->out->error;
+}
+
+static int query_bucket_row(void *ctx, int64_t start, int secs, const struct rollup_cell *cells, int columns)
+{
+	struct query_exec *x = ctx;
+	const struct rollup_cell *cell = &cells[x->q->channel];
+	struct query_out *out = x->out;
+
+	if (cell->count == 0)
+		return out->error;
+	switch (x->q->agg) {
+	case AGG_MEAN:
+		query_printf(out, "%lld,%g\n", (long long)start, cell->sum / cell->count);
+		break;
+	case AGG_MIN:
+		query_printf(out, "%lld,%g\n", (long long)start, cell->min);
+		break;
+	case AGG_MAX:
+		query_printf(out, "%lld,%g\n", (long long)start, cell->max);
+		break;
+	case AGG_SUM:
+		query_printf(out, "%lld,%g\n", (long long)start, cell->sum);
+		break;
+	case AGG_COUNT:
+		query_printf(out, "%lld,%u\n", (long long)start, cell->count);
+		break;
+	case AGG_ALL:
+		query_printf(out, "%lld,%g,%g,%g,%g,%u\n", (long long)start,
+			     rollup_value(x->q->channel, cell), cell->min, cell->max, cell->sum, cell->count);
+		break;
+	default:
+		query_printf(out, "%lld,%g\n", (long long)start, rollup_value(x->q->channel, cell));
+		break;
+	}
+	out->rows++;
+	return out->error;
+}
+
+// Stream the answer to q into out
+void query_execute(struct query_server *qs, struct query *q, struct query_out *out)
+{
+	struct query_exec x = { q, out };
+	int t = q->step;
+
+	if (t == QUERY_STEP_AUTO)
+		t = rollup_pick(qs->ru, q->from, q->to, q->points);
+
+	if (t == QUERY_STEP_RAW) {
+		query_printf(out, "time,%s\n", channels[q->channel].name);
+		store_scan(qs->st, q->from, q->to, query_raw_row, &x);
+	} else {
+		if (q->agg == AGG_ALL)
+			query_printf(out, "time,%s,min,max,sum,count\n", channels[q->channel].name);
+		else
+			query_printf(out, "time,%s_%s_%s\n", channels[q->channel].name, rollup_names[t], query_aggs[q->agg]);
+		rollup_query_tier(qs->ru, t, q->from, q->to, query_bucket_row, &x);
+	}
+	query_flush(out);
+}
+
+// ======================================================================
+// Connections
+
+// Read until a full request line (or HTTP header block) has arrived
+static int query_read_request(int fd, int http, char *req, size_t max)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	while (len < max - 1) {
+		n = read(fd, req + len, max - 1 - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+		req[len] = '\0';
+		if (http ? strstr(req, "\r\n\r\n") != NULL : strchr(req, '\n') != NULL)
+			break;
+	}
+	req[len] = '\0';
+	return len > 0 ? 0 : -1;
+}
+
+// Write len bytes as they are, past the buffer
+static void query_write(struct query_out *out, const char *data, size_t len)
+{
+	query_flush(out);
+	while (!out->error && len > 0) {
+		size_t n = len < sizeof(out->buf) ? len : sizeof(out->buf);
+		memcpy(out->buf, data, n);
+		out->len = n;
+		query_flush(out);
+		data += n;
+		len -= n;
+	}
+}
+
+// The daemon's metrics, rendered to memory first so the callback can't
+// block on a slow client
+static void query_serve_metrics(struct query_server *qs, struct query_conn *conn, struct query_out *out)
+{
+	char *text = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&text, &len);
+
+	if (f == NULL)
+		return;
+	qs->metrics(f, qs->metrics_ctx);
+	fclose(f);
+	if (conn->http)
+		query_printf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+	query_write(out, text, len);
+	free(text);
+}
+
+static void query_serve(struct query_server *qs, struct query_conn *conn, struct query_out *out)
+{
+	char req[QUERY_REQUEST_MAX];
+	struct timeval tv = { QUERY_TIMEOUT_S, 0 };
+	struct query q;
+	const char *err = NULL;
+	char *args = req;
+
+	setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	out->fd = conn->fd;
+	out->error = 0;
+	out->len = 0;
+	out->rows = 0;
+
+	if (query_read_request(conn->fd, conn->http, req, sizeof(req)) < 0)
+		return;
+
+	if (qs->metrics && strncmp(req, conn->http ? "GET /metrics" : "metrics", conn->http ? 12 : 7) == 0) {
+		query_serve_metrics(qs, conn, out);
+		pthread_mutex_lock(&qs->lock);
+		qs->requests++;
+		if (out->error)
+			qs->errors++;
+		pthread_mutex_unlock(&qs->lock);
+		return;
+	}
+
+	if (conn->http) {
+		// GET /query?args HTTP/1.x
+		char *end;
+		if (strncmp(req, "GET /query", 10) != 0) {
+			query_printf(out, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n\r\nerror: try /query?channel=...\n");
+			query_flush(out);
+			return;
+		}
+		args = req + 10;
+		if (*args == '?')
+			args++;
+		if ((end = strchr(args, ' ')) != NULL)
+			*end = '\0';
+	}
+
+	err = query_parse(args, conn->http, &q, time(NULL));
+	if (err == NULL && qs->st == NULL)
+		err = "no history";
+	if (conn->http)
+		query_printf(out, "HTTP/1.0 %s\r\nContent-Type: text/csv\r\nConnection: close\r\n\r\n",
+			     err ? "400 Bad Request" : "200 OK");
+	if (err) {
+		query_printf(out, "error: %s\n", err);
+		query_flush(out);
+	} else {
+		query_execute(qs, &q, out);
+	}
+
+	pthread_mutex_lock(&qs->lock);
+	qs->requests++;
+	if (err || out->error)
+		qs->errors++;
+	qs->rows += out->rows;
+	pthread_mutex_unlock(&qs->lock);
+}
+
+static void *query_worker(void *arg)
+{
+	struct query_server *qs = arg;
+	struct query_out *out = malloc(sizeof(*out));   // once per worker, not per request
+	struct query_conn conn;
+
+	for (;;) {
+		pthread_mutex_lock(&qs->lock);
+		while (qs->count == 0)
+			pthread_cond_wait(&qs->cond, &qs->lock);
+		conn = qs->queue[qs->head];
+		qs->head = (qs->head + 1) % QUERY_QUEUE;
+		qs->count--;
+		pthread_mutex_unlock(&qs->lock);
+
+		if (out)
+			query_serve(qs, &conn, out);
+		close(conn.fd);
+	}
+	return NULL;
+}
+
+static void *query_acceptor(void *arg)
+{
+	struct query_server *qs = arg;
+	struct pollfd fds[2];
+	int nfds = 0;
+	int i, fd;
+
+	fds[nfds].fd = qs->unix_fd;
+	fds[nfds++].events = POLLIN;
+	if (qs->http_fd >= 0) {
+		fds[nfds].fd = qs->http_fd;
+		fds[nfds++].events = POLLIN;
+	}
+
+	for (;;) {
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return NULL;
+		}
+		for (i = 0; i < nfds; i++) {
+			if (!(fds[i].revents & POLLIN))
+				continue;
+			if ((fd = accept(fds[i].fd, NULL, NULL)) < 0)
+				continue;
+
+			pthread_mutex_lock(&qs->lock);
+			if (qs->count == QUERY_QUEUE) {
+				qs->rejected++;
+				pthread_mutex_unlock(&qs->lock);
+				close(fd);
+				continue;
+			}
+			qs->queue[(qs->head + qs->count) % QUERY_QUEUE].fd = fd;
+			qs->queue[(qs->head + qs->count) % QUERY_QUEUE].http = fds[i].fd == qs->http_fd;
+			qs->count++;
+			pthread_cond_signal(&qs->cond);
+			pthread_mutex_unlock(&qs->lock);
+		}
+	}
+}
+
+static int query_listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, path);
+	unlink(path);                           // left over from the last run
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, QUERY_QUEUE) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int query_listen_http(int port)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, QUERY_QUEUE) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Start listening on socket_path, and on 127.0.0.1:http_port if it isn't 0.
+// st and ru may be NULL, metrics too if there's no /metrics.
+int query_start(struct query_server *qs, struct store *st, struct rollup *ru, const char *socket_path, int http_port,
+		void (*metrics)(FILE *f, void *ctx), void *metrics_ctx)
+{
+	int i;
+
+	memset(qs, 0, sizeof(*qs));
+	qs->st = st;
+	qs->ru = ru;
+	qs->metrics = metrics;                  // before any thread can look at it
+	qs->metrics_ctx = metrics_ctx;
+	qs->http_fd = -1;
+	pthread_mutex_init(&qs->lock, NULL);
+	pthread_cond_init(&qs->cond, NULL);
+
+	if ((qs->unix_fd = query_listen_unix(socket_path)) < 0)
+		return -1;
+	if (http_port > 0 && (qs->http_fd = query_listen_http(http_port)) < 0)
+		log_warn("Unable to listen on 127.0.0.1:%d", http_port);
+
+	for (i = 0; i < QUERY_THREADS; i++) {
+		if (pthread_create(&qs->workers[i], NULL, query_worker, qs) != 0)
+			return -1;
+	}
+	return pthread_create(&qs->acceptor, NULL, query_acceptor, qs) == 0 ? 0 : -1;
+}
+
+#endif
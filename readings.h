@@ -0,0 +1,85 @@
+/*
+Published channels
+
+One entry per value the station sends to openHAB.  The sensor tasks fill
+in readings.value[], the publish task walks the table.  The order is also
+the column order of the history store, so new channels go at the end.
+*/
+
+#ifndef READINGS_H
+#define READINGS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define TOPIC_temperature       "weather-station/temperature"
+#define TOPIC_dewpoint		"weather-station/dewpoint"
+#define TOPIC_light		"weather-station/light"
+#define TOPIC_uvi          	"weather-station/uvi"
+#define TOPIC_rain          	"weather-station/rain"
+#define TOPIC_rain1h            "weather-station/rain1h"
+#define TOPIC_rain24h           "weather-station/rain24h"
+#define TOPIC_rainrate          "weather-station/rainrate"
+#define TOPIC_windspeed         "weather-station/windspeed"
+#define TOPIC_windspeed10m      "weather-station/windspeed10m"
+#define TOPIC_windgust          "weather-station/windgust"
+#define TOPIC_windlull          "weather-station/windlull"
+#define TOPIC_abs_hum          	"weather-station/abs_hum"
+#define TOPIC_pressure		"weather-station/pressure"
+#define TOPIC_backlog           "weather-station/backlog"       // batches of readings that missed their cycle
+#define TOPIC_cycle             "weather-station/cycle"         // whole cycle, --payload json or cbor
+#define TOPIC_stats             "weather-station/stats"         // counters and stage latencies, --stats-interval
+
+enum channel {
+	CH_TEMPERATURE,
+	CH_DEWPOINT,
+	CH_PRESSURE,
+	CH_LIGHT,
+	CH_UVI,
+	CH_ABS_HUM,
+	CH_WINDSPEED,                           // 2 minute mean
+	CH_WINDSPEED_10M,
+	CH_WINDGUST,                            // peak 3s gust since the last publish
+	CH_WINDLULL,
+	CH_RAIN,                                // since local midnight
+	CH_RAIN_1H,
+	CH_RAIN_24H,
+	CH_RAIN_RATE,                           // mm/h over the last 10 minutes
+	CH_COUNT
+};
+
+struct channel_info {
+	const char *name;
+	const char *topic;
+	int decimals;                           // places published, about the sensor's resolution
+};
+
+const struct channel_info channels[CH_COUNT] = {
+	[CH_TEMPERATURE] = { "temperature", TOPIC_temperature, 1 },
+	[CH_DEWPOINT]    = { "dewpoint",    TOPIC_dewpoint,    1 },
+	[CH_PRESSURE]    = { "pressure",    TOPIC_pressure,    0 },       // Pa
+	[CH_LIGHT]       = { "light",       TOPIC_light,       1 },
+	[CH_UVI]         = { "uvi",         TOPIC_uvi,         2 },
+	[CH_ABS_HUM]     = { "abs_hum",     TOPIC_abs_hum,     2 },
+	[CH_WINDSPEED]   = { "windspeed",   TOPIC_windspeed,   1 },
+	[CH_WINDSPEED_10M] = { "windspeed10m", TOPIC_windspeed10m, 1 },
+	[CH_WINDGUST]    = { "windgust",    TOPIC_windgust,    1 },
+	[CH_WINDLULL]    = { "windlull",    TOPIC_windlull,    1 },
+	[CH_RAIN]        = { "rain",        TOPIC_rain,        2 },
+	[CH_RAIN_1H]     = { "rain1h",      TOPIC_rain1h,      2 },
+	[CH_RAIN_24H]    = { "rain24h",     TOPIC_rain24h,     2 },
+	[CH_RAIN_RATE]   = { "rainrate",    TOPIC_rainrate,    2 },
+};
+
+#define CH_ALL                  ((1u << CH_COUNT) - 1)   // channel bit mask with every channel
+
+struct readings {
+	time_t ts;                              // sample time of the current cycle
+	float value[CH_COUNT];
+	uint32_t valid;                         // one bit per channel, cleared if the value is suspect
+	uint32_t stale;                         // channels whose sensor failed this cycle
+	float dht_temperature;                  // DHT22, kept from the last good read
+	float dht_humidity;
+};
+
+#endif
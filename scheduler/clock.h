@@ -0,0 +1,36 @@
+/*
+Daemon clock
+
+Everything that schedules or timestamps readings asks sched_gettime() or
+sched_time() rather than the system clocks, so the daemon can run on a
+virtual clock.  With sched_virtual set both CLOCK_REALTIME and
+CLOCK_MONOTONIC read sched_now_ns, and sched_run() moves it straight to
+the next timer instead of sleeping, so a day of samples takes as long as
+the work in it.  The simulated and replay hardware backends run this way.
+*/
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+int sched_virtual;
+int64_t sched_now_ns;                   // virtual time, ns since the epoch
+
+static inline void sched_gettime(clockid_t clock, struct timespec *ts)
+{
+	if (!sched_virtual) {
+		clock_gettime(clock, ts);
+		return;
+	}
+	ts->tv_sec = sched_now_ns / 1000000000;
+	ts->tv_nsec = sched_now_ns % 1000000000;
+}
+
+static inline time_t sched_time(void)
+{
+	return sched_virtual ? (time_t)(sched_now_ns / 1000000000) : time(NULL);
+}
+
+#endif
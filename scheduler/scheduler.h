@@ -0,0 +1,295 @@
+/*
+Event driven task scheduler
+
+Every task owns a timerfd armed on CLOCK_REALTIME at an absolute time, so
+runs stay aligned to wall clock boundaries (a 60s task fires at :00 of each
+minute plus its offset).  The main loop sleeps in epoll_wait until one of
+them expires, which keeps the CPU idle between samples.
+
+A task that has to wait for hardware (a conversion, a sensor's minimum
+retry interval) does not sleep.  It calls sched_defer() and returns, and is
+run again from a second one-shot timer when the wait is over; task->state
+tells it where it left off.  Other tasks run in the meantime.  A cycle ends
+when the task returns without deferring.
+
+A timer that expired more than once before we got to it, or fired while
+the previous cycle was still in progress, means runs were skipped; those
+are counted as missed.  A cycle that takes longer than the task's deadline
+is counted as an overrun.  Both counts, like the latency histogram, can be
+read from another thread while the task's own runs.  Tasks that become
+ready together run in the order they were added.
+
+On the virtual clock (see clock.h) there are no timers: sched_run() picks
+the task due soonest, sets the clock to that time and runs it, in the same
+order the timers would have fired, until sched_stop is set.
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "clock.h"
+#include "../metrics/hist.h"
+#include "../log/log.h"
+
+#define SCHED_MAX_TASKS 16
+
+struct sched_task {
+	const char *name;
+	void (*run)(struct sched_task *task);
+	int period;                             // seconds
+	int offset;                             // seconds after the period boundary
+	int deadline_ms;                        // a cycle longer than this is an overrun
+	void *data;
+
+	int state;                              // for the task's own use, 0 at the start of a cycle
+	int fd;                                 // periodic timer
+	int wake_fd;                            // one-shot timer for sched_defer()
+	int index;
+	int busy;                               // cycle in progress
+	int deferred;                           // set by sched_defer() during run
+	struct timespec started;
+	unsigned long runs;
+	atomic_ulong missed;                    // periods skipped entirely
+	atomic_ulong overruns;                  // cycles that exceeded deadline_ms
+	double last_ms;
+	double max_ms;
+	struct hist latency;                    // every completed cycle
+
+	int64_t due_ns;                         // virtual clock: next period
+	int64_t wake_ns;                        // and pending sched_defer(), -1 for none
+};
+
+struct sched {
+	int epfd;
+	int count;
+	struct sched_task *tasks[SCHED_MAX_TASKS];
+};
+
+int sched_stop;                         // virtual clock: makes sched_run() return
+
+static double sched_elapsed_ms(const struct timespec *from)
+{
+	struct timespec now;
+	sched_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) * 1000.0 + (now.tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+// Arm the task's timer for the next aligned boundary after now
+static int sched_arm(struct sched_task *task)
+{
+	struct itimerspec its;
+	struct timespec now;
+	time_t next;
+
+	sched_gettime(CLOCK_REALTIME, &now);
+	next = (now.tv_sec / task->period + 1) * task->period + task->offset;
+	if (next - task->period > now.tv_sec)
+		next -= task->period;           // offset boundary still ahead this period
+
+	if (sched_virtual) {
+		task->due_ns = next * 1000000000LL;
+		return 0;
+	}
+
+	its.it_value.tv_sec = next;
+	its.it_value.tv_nsec = 0;
+	its.it_interval.tv_sec = task->period;
+	its.it_interval.tv_nsec = 0;
+
+	// Cancel on clock changes so an NTP step at boot re-aligns the timer
+	return timerfd_settime(task->fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+// Run the task again after ms milliseconds instead of ending its cycle.
+// Called from within the task, or from another task to wake a waiting one
+// early (ms = 0 runs it on the next pass of the loop).
+int sched_defer(struct sched_task *task, long ms)
+{
+	struct itimerspec its = { { 0, 0 }, { ms / 1000, (ms % 1000) * 1000000L } };
+
+	task->deferred = 1;
+	if (sched_virtual) {
+		task->wake_ns = sched_now_ns + (ms > 0 ? ms * 1000000LL : 0);
+		return 0;
+	}
+	if (ms <= 0)
+		its.it_value.tv_nsec = 1;       // zero would disarm the timer
+	return timerfd_settime(task->wake_fd, 0, &its, NULL);
+}
+
+int sched_init(struct sched *s)
+{
+	s->count = 0;
+	s->epfd = epoll_create1(EPOLL_CLOEXEC);
+	return s->epfd < 0 ? -1 : 0;
+}
+
+int sched_add(struct sched *s, struct sched_task *task)
+{
+	struct epoll_event ev;
+
+	if (s->count >= SCHED_MAX_TASKS || task->period <= 0)
+		return -1;
+
+	if (sched_virtual) {
+		task->fd = task->wake_fd = -1;
+		task->wake_ns = -1;
+		sched_arm(task);
+		task->index = s->count;
+		s->tasks[s->count++] = task;
+		return 0;
+	}
+
+	task->fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	task->wake_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (task->fd < 0 || task->wake_fd < 0 || sched_arm(task) < 0)
+		goto fail;
+
+	task->index = s->count;
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t)task->index << 1;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, task->fd, &ev) < 0)
+		goto fail;
+	ev.data.u64 = ((uint64_t)task->index << 1) | 1;
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, task->wake_fd, &ev) < 0)
+		goto fail;
+
+	s->tasks[s->count++] = task;
+	return 0;
+
+fail:
+	if (task->fd >= 0)
+		close(task->fd);
+	if (task->wake_fd >= 0)
+		close(task->wake_fd);
+	return -1;
+}
+
+// Run a task for a timer that expired: its period, or the wake-up it asked
+// for with sched_defer()
+static void sched_fire(struct sched_task *task, int wake, uint64_t expirations)
+{
+	if (!wake) {
+		if (task->busy)
+			expirations++;          // this period's run is lost too
+		if (expirations > 1) {
+			atomic_fetch_add_explicit(&task->missed, expirations - 1, memory_order_relaxed);
+			log_warn("%s: missed %llu run(s)", task->name, (unsigned long long)(expirations - 1));
+		}
+		if (task->busy)
+			return;
+		task->busy = 1;
+		task->state = 0;
+		sched_gettime(CLOCK_MONOTONIC, &task->started);
+	} else if (!task->busy) {
+		return;
+	}
+
+	task->deferred = 0;
+	task->run(task);
+	if (task->deferred)
+		return;
+
+	// Cycle complete
+	task->busy = 0;
+	task->runs++;
+	task->last_ms = sched_elapsed_ms(&task->started);
+	hist_record_ms(&task->latency, task->last_ms);
+	if (task->last_ms > task->max_ms)
+		task->max_ms = task->last_ms;
+	if (task->deadline_ms > 0 && task->last_ms > task->deadline_ms) {
+		atomic_fetch_add_explicit(&task->overruns, 1, memory_order_relaxed);
+		log_warn("%s: took %.0f ms, deadline %d ms", task->name, task->last_ms, task->deadline_ms);
+	}
+}
+
+static void sched_execute(struct sched_task *task, int wake)
+{
+	uint64_t expirations;
+	ssize_t n;
+
+	n = read(wake ? task->wake_fd : task->fd, &expirations, sizeof(expirations));
+	if (n < 0 && errno == ECANCELED) {
+		sched_arm(task);                // wall clock was stepped
+		return;
+	}
+	if (n == sizeof(expirations))
+		sched_fire(task, wake, expirations);
+}
+
+// Lowest index first, and a period before a wake-up of the same task,
+// which is the order sched_run() sorts fired timers into
+static int sched_run_virtual(struct sched *s)
+{
+	struct sched_task *task, *next;
+	int64_t at, soonest = 0;
+	int i, wake, next_wake = 0;
+
+	while (!sched_stop) {
+		next = NULL;
+		for (i = 0; i < s->count; i++) {
+			task = s->tasks[i];
+			at = task->due_ns;
+			wake = task->wake_ns >= 0 && task->wake_ns < at;
+			if (wake)
+				at = task->wake_ns;
+			if (next == NULL || at < soonest) {
+				next = task;
+				soonest = at;
+				next_wake = wake;
+			}
+		}
+		if (next == NULL)
+			return -1;
+
+		if (soonest > sched_now_ns)
+			sched_now_ns = soonest;
+		if (next_wake)
+			next->wake_ns = -1;
+		else
+			next->due_ns += next->period * 1000000000LL;
+		sched_fire(next, next_wake, 1);
+	}
+	return 0;
+}
+
+// Run tasks forever.  Only returns if epoll fails, or on the virtual
+// clock when sched_stop is set.
+int sched_run(struct sched *s)
+{
+	struct epoll_event events[SCHED_MAX_TASKS * 2];
+	uint64_t ready[SCHED_MAX_TASKS * 2];
+	int n, i, j;
+
+	if (sched_virtual)
+		return sched_run_virtual(s);
+
+	for (;;) {
+		n = epoll_wait(s->epfd, events, SCHED_MAX_TASKS * 2, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		// Keep registration order among timers that fired together
+		for (i = 0; i < n; i++) {
+			uint64_t key = events[i].data.u64;
+			for (j = i; j > 0 && ready[j - 1] > key; j--)
+				ready[j] = ready[j - 1];
+			ready[j] = key;
+		}
+		for (i = 0; i < n; i++)
+			sched_execute(s->tasks[ready[i] >> 1], ready[i] & 1);
+	}
+}
+
+#endif
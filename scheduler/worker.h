@@ -0,0 +1,185 @@
+/*
+Sensor workers
+
+Each sensor's task runs on a thread of its own with its own scheduler, at
+its own period, so a DHT22 retry or a wedged I2C transfer only holds up
+that sensor.  What a worker reads goes to the aggregating thread (the
+main one, which publishes) as a timestamped struct sample through a
+lock-free single producer, single consumer ring, one per worker.
+
+The aggregator drains the rings with worker_receive() and runs
+worker_watchdog() every second.  A worker that hasn't delivered a good
+sample for WORKER_STALE_PERIODS of its periods plus its deadline is
+marked stale: its channels are flagged, publishing stops waiting for it,
+and the worker is asked to reset its device at the start of its next
+cycle.  It recovers with its next good sample.  If it is still in a cycle
+that started past its deadline without sending anything, its thread is
+stuck in the driver, which is reported as such.
+
+On the virtual clock the tasks are added to the main scheduler instead,
+so simulations and replays stay deterministic; the rings are used the
+same way.
+*/
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "scheduler.h"
+#include "../pulses/spsc_ring.h"
+#include "../log/log.h"
+
+#define WORKER_RING_ORDER       4               // 16 samples between drains
+#define WORKER_STALE_PERIODS    2
+#define WORKER_VALUES           2
+
+struct sample {
+	int64_t ts_ns;                          // CLOCK_REALTIME when the cycle finished
+	int ok;                                 // otherwise the read failed
+	float value[WORKER_VALUES];
+	float cycle_ms;                         // how long the sensor took
+};
+
+SPSC_RING_DEFINE(sample_ring, struct sample, WORKER_RING_ORDER)
+
+struct worker {
+	const char *name;
+	struct sched_task *task;
+	void (*run)(struct sched_task *task);   // the task's own run
+	void *arg;                              // and its data, see worker_arg()
+	void (*reset)(struct worker *w);        // put the device back to a known state, or NULL
+	struct sample_ring ring;
+	atomic_llong started_ns;                // when the task last started a cycle
+	atomic_int reset_pending;
+	struct sched sched;
+	pthread_t thread;
+	int threaded;
+
+	// Aggregator side
+	struct sample last;                     // latest good sample
+	int64_t good_ns;                        // when it came, or when the worker started
+	int64_t last_ns;                        // when anything, good or not, last came
+	int stale;
+	unsigned long samples;
+	unsigned long failures;
+	unsigned long stalls;                   // times marked stale
+	unsigned long recoveries;
+};
+
+// What the task's data was before worker_start() took it over
+static inline void *worker_arg(struct sched_task *task)
+{
+	return ((struct worker *)task->data)->arg;
+}
+
+static int64_t worker_now_ns(void)
+{
+	struct timespec ts;
+
+	sched_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Stands in for the task's run: notes the start of a cycle and does any
+// reset the watchdog asked for first
+static void worker_task(struct sched_task *task)
+{
+	struct worker *w = task->data;
+
+	if (task->state == 0) {
+		atomic_store_explicit(&w->started_ns, worker_now_ns(), memory_order_relaxed);
+		if (atomic_exchange(&w->reset_pending, 0) && w->reset)
+			w->reset(w);
+	}
+	w->run(task);
+}
+
+// Worker thread.  Called from the task when it has a reading.
+void worker_send(struct sched_task *task, int ok, float v0, float v1)
+{
+	struct worker *w = task->data;
+	struct sample s = { worker_now_ns(), ok, { v0, v1 }, sched_elapsed_ms(&task->started) };
+
+	sample_ring_push(&w->ring, s);          // counted in ring.dropped if the aggregator is that far behind
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	sched_run(&w->sched);
+	log_warn("%s worker stopped", w->name);
+	return NULL;
+}
+
+// Run task on its own thread, or on main's scheduler on the virtual clock
+int worker_start(struct worker *w, struct sched_task *task, struct sched *main)
+{
+	w->task = task;
+	w->run = task->run;
+	w->arg = task->data;
+	task->run = worker_task;
+	task->data = w;
+	w->good_ns = worker_now_ns();           // the watchdog's grace period starts now
+	atomic_store(&w->started_ns, w->good_ns);
+
+	if (sched_virtual)
+		return sched_add(main, task);
+	if (sched_init(&w->sched) != 0 || sched_add(&w->sched, task) != 0)
+		return -1;
+	if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
+		return -1;
+	w->threaded = 1;
+	return 0;
+}
+
+// Aggregator.  Takes everything the worker has sent; returns the number
+// of samples, with the latest good one in w->last.
+int worker_receive(struct worker *w)
+{
+	struct sample s;
+	int n = 0;
+
+	while (sample_ring_pop(&w->ring, &s)) {
+		n++;
+		w->samples++;
+		w->last_ns = s.ts_ns;
+		if (!s.ok) {
+			w->failures++;
+			continue;
+		}
+		w->last = s;
+		w->good_ns = s.ts_ns;
+		if (w->stale) {
+			w->stale = 0;
+			w->recoveries++;
+			log_info("%s recovered", w->name);
+		}
+	}
+	return n;
+}
+
+// Aggregator.  Returns 1 if the worker is stale.
+int worker_watchdog(struct worker *w)
+{
+	int64_t now = worker_now_ns();
+	int64_t limit = (int64_t)(WORKER_STALE_PERIODS * w->task->period * 1000LL + w->task->deadline_ms) * 1000000;
+	int64_t started = atomic_load_explicit(&w->started_ns, memory_order_relaxed);
+
+	if (w->stale || now - w->good_ns <= limit)
+		return w->stale;
+
+	w->stale = 1;
+	w->stalls++;
+	if (started > w->last_ns && now - started > w->task->deadline_ms * 1000000LL)
+		log_error("%s stuck in a cycle started %.0f s ago", w->name, (now - started) / 1e9);
+	else
+		log_warn("%s has had no good reading for %.0f s, resetting it", w->name, (now - w->good_ns) / 1e9);
+	atomic_store(&w->reset_pending, 1);
+	return 1;
+}
+
+#endif
@@ -0,0 +1,261 @@
+/*
+Gorilla style sample compression
+
+The encoding from Facebook's Gorilla paper (Pelkonen et al., VLDB 2015),
+applied to whole records: a timestamp followed by one float per column.
+
+Timestamps are stored as the change in the gap between samples, so a
+steady once a minute cadence costs one bit per sample:
+
+  0                     same gap as last time
+  10   + 7 bits         gap changed by -63..64 seconds
+  110  + 9 bits         -255..256
+  1110 + 12 bits        -2047..2048
+  1111 + 32 bits        anything else
+
+Each float is XORed with the previous value of its column.  A reading that
+didn't change costs one bit; otherwise only the bits between the leading
+and trailing zeros of the XOR are kept:
+
+  0                     same value
+  10   + bits           meaningful bits fit the previous window
+  11   + 5 bits leading zeros, 5 bits length-1, bits
+
+That only pays when neighbouring values share their low mantissa bits,
+as whole numbers do; see store.h for how readings are made into them.
+
+Samples are encoded in independent blocks so a reader can skip to the
+block containing a time without decoding what comes before it.
+*/
+
+#ifndef GORILLA_H
+#define GORILLA_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define GORILLA_MAX_COLUMNS     32
+#define GORILLA_NO_WINDOW       0xFF
+
+// Worst case encoded size of n samples of columns floats
+#define GORILLA_MAX_BYTES(columns, n)   (((36 + (columns) * 44) * (size_t)(n) + 7) / 8)
+
+struct bitwriter {
+	uint8_t *buf;
+	size_t cap;
+	size_t len;
+	uint64_t acc;
+	int n;                                  // bits in acc not yet written
+};
+
+struct bitreader {
+	const uint8_t *buf;
+	size_t len;
+	size_t pos;
+	uint64_t acc;
+	int n;                                  // bits in acc not yet consumed
+};
+
+struct gorilla_column {
+	uint32_t prev;
+	uint8_t lead;
+	uint8_t trail;
+};
+
+struct gorilla {
+	union {
+		struct bitwriter w;
+		struct bitreader r;
+	};
+	int columns;
+	uint32_t count;                         // samples encoded / left to decode
+	uint32_t prev_ts;
+	int32_t prev_delta;
+	struct gorilla_column col[GORILLA_MAX_COLUMNS];
+};
+
+// Append the low n (<= 32) bits of v
+static inline void bits_put(struct bitwriter *w, uint32_t v, int n)
+{
+	w->acc = (w->acc << n) | (v & ((1ULL << n) - 1));
+	w->n += n;
+	while (w->n >= 8) {
+		w->n -= 8;
+		if (w->len < w->cap)
+			w->buf[w->len] = w->acc >> w->n;
+		w->len++;
+	}
+}
+
+static inline uint32_t bits_get(struct bitreader *r, int n)
+{
+	while (r->n < n) {
+		r->acc = (r->acc << 8) | (r->pos < r->len ? r->buf[r->pos] : 0);
+		r->pos++;
+		r->n += 8;
+	}
+	r->n -= n;
+	return (r->acc >> r->n) & ((1ULL << n) - 1);
+}
+
+// Sign extend the low n bits of v
+static inline int32_t bits_signed(uint32_t v, int n)
+{
+	return v > (1U << (n - 1)) ? (int32_t)v - (1 << n) : (int32_t)v;
+}
+
+static void gorilla_reset(struct gorilla *g, int columns)
+{
+	int c;
+
+	g->columns = columns;
+	g->prev_ts = 0;
+	g->prev_delta = 0;
+	for (c = 0; c < columns; c++) {
+		g->col[c].prev = 0;
+		g->col[c].lead = GORILLA_NO_WINDOW;
+		g->col[c].trail = 0;
+	}
+}
+
+// ======================================================================
+// Encoder.  buf should hold GORILLA_MAX_BYTES(columns, samples) bytes.
+
+void gorilla_encode_begin(struct gorilla *g, uint8_t *buf, size_t cap, int columns)
+{
+	gorilla_reset(g, columns);
+	g->w.buf = buf;
+	g->w.cap = cap;
+	g->w.len = 0;
+	g->w.acc = 0;
+	g->w.n = 0;
+	g->count = 0;
+}
+
+void gorilla_encode(struct gorilla *g, uint32_t ts, const float *values)
+{
+	struct bitwriter *w = &g->w;
+	int c;
+
+	if (g->count == 0) {
+		bits_put(w, ts, 32);
+	} else {
+		int32_t delta = ts - g->prev_ts;
+		int32_t dod = delta - g->prev_delta;
+
+		if (dod == 0) {
+			bits_put(w, 0, 1);
+		} else if (dod >= -63 && dod <= 64) {
+			bits_put(w, 0x2, 2);
+			bits_put(w, dod, 7);
+		} else if (dod >= -255 && dod <= 256) {
+			bits_put(w, 0x6, 3);
+			bits_put(w, dod, 9);
+		} else if (dod >= -2047 && dod <= 2048) {
+			bits_put(w, 0xE, 4);
+			bits_put(w, dod, 12);
+		} else {
+			bits_put(w, 0xF, 4);
+			bits_put(w, dod, 32);
+		}
+		g->prev_delta = delta;
+	}
+	g->prev_ts = ts;
+
+	for (c = 0; c < g->columns; c++) {
+		struct gorilla_column *col = &g->col[c];
+		uint32_t v, x;
+		int lead, trail;
+
+		memcpy(&v, &values[c], sizeof(v));
+		x = v ^ col->prev;
+		col->prev = v;
+		if (x == 0) {
+			bits_put(w, 0, 1);
+			continue;
+		}
+		lead = __builtin_clz(x);
+		trail = __builtin_ctz(x);
+		if (col->lead != GORILLA_NO_WINDOW && lead >= col->lead && trail >= col->trail) {
+			bits_put(w, 0x2, 2);
+			bits_put(w, x >> col->trail, 32 - col->lead - col->trail);
+		} else {
+			bits_put(w, 0x3, 2);
+			bits_put(w, lead, 5);
+			bits_put(w, 31 - lead - trail, 5);
+			bits_put(w, x >> trail, 32 - lead - trail);
+			col->lead = lead;
+			col->trail = trail;
+		}
+	}
+	g->count++;
+}
+
+// Pad out the last byte.  Returns the encoded length, or 0 if buf was too small.
+size_t gorilla_encode_end(struct gorilla *g)
+{
+	if (g->w.n > 0)
+		bits_put(&g->w, 0, 8 - g->w.n);
+	return g->w.len <= g->w.cap ? g->w.len : 0;
+}
+
+// ======================================================================
+// Decoder
+
+void gorilla_decode_begin(struct gorilla *g, const uint8_t *buf, size_t len, int columns, uint32_t count)
+{
+	gorilla_reset(g, columns);
+	g->r.buf = buf;
+	g->r.len = len;
+	g->r.pos = 0;
+	g->r.acc = 0;
+	g->r.n = 0;
+	g->count = count;
+}
+
+// Next sample of the block.  Returns 0 once all count samples are out.
+int gorilla_decode(struct gorilla *g, uint32_t *ts, float *values)
+{
+	struct bitreader *r = &g->r;
+	int c;
+
+	if (g->count == 0)
+		return 0;
+
+	if (r->pos == 0) {                      // nothing read yet, first sample
+		g->prev_ts = bits_get(r, 32);
+	} else {
+		int32_t dod;
+
+		if (bits_get(r, 1) == 0)
+			dod = 0;
+		else if (bits_get(r, 1) == 0)
+			dod = bits_signed(bits_get(r, 7), 7);
+		else if (bits_get(r, 1) == 0)
+			dod = bits_signed(bits_get(r, 9), 9);
+		else if (bits_get(r, 1) == 0)
+			dod = bits_signed(bits_get(r, 12), 12);
+		else
+			dod = bits_get(r, 32);
+		g->prev_delta += dod;
+		g->prev_ts += g->prev_delta;
+	}
+	*ts = g->prev_ts;
+
+	for (c = 0; c < g->columns; c++) {
+		struct gorilla_column *col = &g->col[c];
+
+		if (bits_get(r, 1)) {
+			if (bits_get(r, 1)) {
+				col->lead = bits_get(r, 5);
+				col->trail = 31 - col->lead - bits_get(r, 5);
+			}
+			col->prev ^= bits_get(r, 32 - col->lead - col->trail) << col->trail;
+		}
+		memcpy(&values[c], &col->prev, sizeof(float));
+	}
+	g->count--;
+	return 1;
+}
+
+#endif
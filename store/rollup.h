@@ -0,0 +1,385 @@
+/*
+History rollups
+
+Every sample also updates min/max/sum/count buckets at 10 minute, hourly
+and daily resolution, one cell per channel.  When a sample lands in a new
+bucket the old one is appended to history/rollup-<tier>.dat, a header and
+fixed size records in time order.  The one minute tier is the raw history
+itself (one sample a minute), so it is served from the store rather than
+kept twice.
+
+Most channels roll up to their mean.  windgust rolls up to its maximum
+and the rolling rain totals (rain1h, rain24h) to theirs.  rain, the total
+since midnight, is turned into the amount that fell since the previous
+sample before it is bucketed, so its rollup is the sum: rain per bucket.
+
+The tier files are derived data.  On start each tier is caught up from
+the raw history after its last complete bucket, which also rebuilds a
+file that is missing, torn or written by a build with other channels.
+
+rollup_query() picks the finest tier that covers a range in at most
+max_points buckets.  Queries may come from other threads; they copy the
+open buckets under the lock and read the files without it.
+*/
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "store.h"
+
+#define ROLLUP_MAGIC            0x52485357      // "WSHR"
+#define ROLLUP_VERSION          1
+#define ROLLUP_MAX_POINTS       1000            // default query resolution
+
+enum { ROLLUP_1M, ROLLUP_10M, ROLLUP_1H, ROLLUP_1D, ROLLUP_TIERS };
+
+static const int rollup_secs[ROLLUP_TIERS] = { 60, 600, 3600, 86400 };
+static const char *rollup_names[ROLLUP_TIERS] = { "1m", "10m", "1h", "1d" };
+
+enum rollup_rule { ROLLUP_MEAN, ROLLUP_MAX, ROLLUP_SUM };
+
+static const enum rollup_rule rollup_rules[CH_COUNT] = {
+	[CH_WINDGUST] = ROLLUP_MAX,
+	[CH_RAIN] = ROLLUP_SUM,
+	[CH_RAIN_1H] = ROLLUP_MAX,
+	[CH_RAIN_24H] = ROLLUP_MAX,
+};
+
+struct rollup_cell {
+	float min;
+	float max;
+	float sum;
+	uint32_t count;                         // samples that weren't NAN
+};
+
+struct rollup_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t columns;
+	uint32_t secs;
+	uint32_t record_size;
+};
+
+struct rollup_record {
+	uint32_t start;
+	uint32_t reserved;
+	struct rollup_cell cell[CH_COUNT];
+};
+
+struct rollup_tier {
+	int secs;
+	int fd;                                 // -1 for the 1 minute tier
+	int64_t done;                           // buckets before this are on disk
+	int active;                             // open bucket has samples
+	struct rollup_record open;
+	unsigned long written;
+};
+
+struct rollup {
+	struct store *st;
+	struct rollup_tier tier[ROLLUP_TIERS];
+	float last[CH_COUNT];                   // previous sample of summed channels
+	pthread_mutex_t lock;                   // open buckets and done, for readers
+	unsigned long errors;
+};
+
+// Bucket visitor: columns cells for the bucket starting at start.  Return
+// non-zero to stop.
+typedef int (*rollup_visit)(void *ctx, int64_t start, int secs, const struct rollup_cell *cells, int columns);
+
+// Representative value of a cell for channel c
+float rollup_value(int c, const struct rollup_cell *cell)
+{
+	if (cell->count == 0)
+		return NAN;
+	switch (rollup_rules[c]) {
+	case ROLLUP_MAX:
+		return cell->max;
+	case ROLLUP_SUM:
+		return cell->sum;
+	default:
+		return cell->sum / cell->count;
+	}
+}
+
+static void rollup_cell_add(struct rollup_cell *cell, float v)
+{
+	if (isnan(v))
+		return;
+	if (cell->count == 0 || v < cell->min)
+		cell->min = v;
+	if (cell->count == 0 || v > cell->max)
+		cell->max = v;
+	cell->sum += v;
+	cell->count++;
+}
+
+// Turn the sample into the values that get bucketed: summed channels
+// become the increase since the last sample.  The daily total drops back
+// at midnight, when all of the new total is new rain.
+static void rollup_prepare(float *last, const float *values, int columns, float *out)
+{
+	int c;
+
+	for (c = 0; c < CH_COUNT; c++)
+		out[c] = c < columns ? values[c] : NAN;
+	for (c = 0; c < CH_COUNT; c++) {
+		float v = out[c];
+		if (rollup_rules[c] != ROLLUP_SUM || isnan(v))
+			continue;
+		out[c] = isnan(last[c]) ? 0 : v >= last[c] ? v - last[c] : v;
+		last[c] = v;
+	}
+}
+
+static void rollup_tier_path(const struct rollup *ru, int t, char *path, size_t len)
+{
+	snprintf(path, len, "%s/rollup-%s.dat", ru->st->dir, rollup_names[t]);
+}
+
+static int rollup_tier_open(struct rollup *ru, int t)
+{
+	struct rollup_tier *tier = &ru->tier[t];
+	struct rollup_header hdr;
+	struct stat sb;
+	char path[256];
+	uint32_t start;
+	off_t whole;
+
+	rollup_tier_path(ru, t, path, sizeof(path));
+	tier->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (tier->fd < 0)
+		return -1;
+
+	if (fstat(tier->fd, &sb) == 0 && sb.st_size >= (off_t)sizeof(hdr) &&
+	    pread(tier->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+	    hdr.magic == ROLLUP_MAGIC && hdr.version == ROLLUP_VERSION && hdr.columns == CH_COUNT &&
+	    hdr.secs == (uint32_t)tier->secs && hdr.record_size == sizeof(struct rollup_record)) {
+		whole = sizeof(hdr) + (sb.st_size - sizeof(hdr)) / hdr.record_size * hdr.record_size;
+		if (whole != sb.st_size && ftruncate(tier->fd, whole) < 0)
+			return -1;
+		if (whole > (off_t)sizeof(hdr) && pread(tier->fd, &start, sizeof(start), whole - hdr.record_size) == sizeof(start))
+			tier->done = (int64_t)start + tier->secs;
+		return 0;
+	}
+
+	// New, or not one we can append to: start over and rebuild from raw
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = ROLLUP_MAGIC;
+	hdr.version = ROLLUP_VERSION;
+	hdr.columns = CH_COUNT;
+	hdr.secs = tier->secs;
+	hdr.record_size = sizeof(struct rollup_record);
+	if (ftruncate(tier->fd, 0) < 0 || write(tier->fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		return -1;
+	return 0;
+}
+
+static void rollup_feed(struct rollup *ru, int64_t ts, const float *values, int columns)
+{
+	float v[CH_COUNT];
+	int t, c;
+
+	rollup_prepare(ru->last, values, columns, v);
+
+	for (t = ROLLUP_10M; t < ROLLUP_TIERS; t++) {
+		struct rollup_tier *tier = &ru->tier[t];
+		int64_t start = ts - ts % tier->secs;
+
+		if (tier->fd < 0 || ts < tier->done)
+			continue;
+		if (tier->active && start != tier->open.start) {
+			if (write(tier->fd, &tier->open, sizeof(tier->open)) != sizeof(tier->open))
+				ru->errors++;
+			tier->written++;
+			tier->done = (int64_t)tier->open.start + tier->secs;
+			tier->active = 0;
+			if (ts < tier->done)
+				continue;
+		}
+		if (!tier->active) {
+			memset(&tier->open, 0, sizeof(tier->open));
+			tier->open.start = start;
+			tier->active = 1;
+		}
+		for (c = 0; c < CH_COUNT; c++)
+			rollup_cell_add(&tier->open.cell[c], v[c]);
+	}
+}
+
+static int rollup_replay(void *ctx, int64_t ts, const float *values, int columns)
+{
+	rollup_feed(ctx, ts, values, columns);
+	return 0;
+}
+
+// Open the tier files next to st's segments and catch them up with it
+int rollup_open(struct rollup *ru, struct store *st)
+{
+	int64_t from = INT64_MAX;
+	int rc = 0;
+	int t, c;
+
+	memset(ru, 0, sizeof(*ru));
+	ru->st = st;
+	pthread_mutex_init(&ru->lock, NULL);
+	for (c = 0; c < CH_COUNT; c++)
+		ru->last[c] = NAN;
+	for (t = 0; t < ROLLUP_TIERS; t++) {
+		ru->tier[t].secs = rollup_secs[t];
+		ru->tier[t].fd = -1;
+		if (t == ROLLUP_1M)
+			continue;
+		if (rollup_tier_open(ru, t) < 0) {
+			if (ru->tier[t].fd >= 0)
+				close(ru->tier[t].fd);
+			ru->tier[t].fd = -1;
+			rc = -1;
+			continue;
+		}
+		if (ru->tier[t].done < from)
+			from = ru->tier[t].done;
+	}
+
+	if (from != INT64_MAX)
+		store_scan(st, from, UINT32_MAX, rollup_replay, ru);
+	return rc;
+}
+
+// Add one sample from the main loop
+void rollup_add(struct rollup *ru, int64_t ts, const float *values)
+{
+	if (ru->st == NULL)
+		return;                         // never opened
+	pthread_mutex_lock(&ru->lock);
+	rollup_feed(ru, ts, values, CH_COUNT);
+	pthread_mutex_unlock(&ru->lock);
+}
+
+// ======================================================================
+// Queries
+
+struct rollup_raw_query {
+	rollup_visit visit;
+	void *ctx;
+	float last[CH_COUNT];
+};
+
+// The 1 minute tier: every raw sample is a bucket of one
+static int rollup_raw_visit(void *ctx, int64_t ts, const float *values, int columns)
+{
+	struct rollup_raw_query *q = ctx;
+	struct rollup_cell cells[CH_COUNT];
+	float v[CH_COUNT];
+	int c;
+
+	rollup_prepare(q->last, values, columns, v);
+	memset(cells, 0, sizeof(cells));
+	for (c = 0; c < CH_COUNT; c++)
+		rollup_cell_add(&cells[c], v[c]);
+	return q->visit(q->ctx, ts, rollup_secs[ROLLUP_1M], cells, CH_COUNT);
+}
+
+static void rollup_scan_tier(struct rollup *ru, int t, int64_t from, int64_t to, rollup_visit visit, void *ctx)
+{
+	struct rollup_tier *tier = &ru->tier[t];
+	struct rollup_record open;
+	const struct rollup_record *rec;
+	struct stat sb;
+	size_t count, lo, hi;
+	int64_t first = from - from % tier->secs;
+	int64_t done;
+	int active;
+	void *map;
+
+	// Buckets closed after the copy are still in it, so read the file
+	// only up to done
+	pthread_mutex_lock(&ru->lock);
+	done = tier->done;
+	active = tier->active;
+	if (active)
+		open = tier->open;
+	pthread_mutex_unlock(&ru->lock);
+
+	if (fstat(tier->fd, &sb) < 0 || sb.st_size <= (off_t)sizeof(struct rollup_header))
+		goto open_bucket;
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, tier->fd, 0);
+	if (map == MAP_FAILED)
+		goto open_bucket;
+
+	rec = (const struct rollup_record *)((const uint8_t *)map + sizeof(struct rollup_header));
+	count = (sb.st_size - sizeof(struct rollup_header)) / sizeof(*rec);
+	lo = 0;
+	hi = count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (rec[mid].start < first)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < count && rec[lo].start <= to && rec[lo].start < done; lo++) {
+		if (visit(ctx, rec[lo].start, tier->secs, rec[lo].cell, CH_COUNT)) {
+			munmap(map, sb.st_size);
+			return;
+		}
+	}
+	munmap(map, sb.st_size);
+
+open_bucket:
+	// The bucket still filling up, as far as it has got
+	if (active && open.start >= first && open.start <= to)
+		visit(ctx, open.start, tier->secs, open.cell, CH_COUNT);
+}
+
+// Visit the buckets of tier t covering from..to
+void rollup_query_tier(struct rollup *ru, int t, int64_t from, int64_t to, rollup_visit visit, void *ctx)
+{
+	if (t == ROLLUP_1M) {
+		struct rollup_raw_query q = { visit, ctx };
+		int c;
+		for (c = 0; c < CH_COUNT; c++)
+			q.last[c] = NAN;
+		store_scan(ru->st, from, to, rollup_raw_visit, &q);
+	} else if (ru->tier[t].fd >= 0) {
+		rollup_scan_tier(ru, t, from, to, visit, ctx);
+	}
+}
+
+// Pick the finest tier that covers from..to in no more than max_points
+// buckets (0 for ROLLUP_MAX_POINTS)
+int rollup_pick(struct rollup *ru, int64_t from, int64_t to, int max_points)
+{
+	int t;
+
+	if (max_points <= 0)
+		max_points = ROLLUP_MAX_POINTS;
+	for (t = ROLLUP_1M; t < ROLLUP_TIERS - 1; t++) {
+		if ((to - from) / rollup_secs[t] < max_points && (t == ROLLUP_1M || ru->tier[t].fd >= 0))
+			break;
+	}
+	while (t > ROLLUP_1M && ru->tier[t].fd < 0)
+		t--;                            // tier unusable, fall back to a finer one
+	return t;
+}
+
+// Visit the buckets covering from..to at the resolution rollup_pick()
+// chooses.  Returns the bucket size used.
+int rollup_query(struct rollup *ru, int64_t from, int64_t to, int max_points, rollup_visit visit, void *ctx)
+{
+	int t = rollup_pick(ru, from, to, max_points);
+
+	rollup_query_tier(ru, t, from, to, visit, ctx);
+	return rollup_secs[t];
+}
+
+#endif
@@ -0,0 +1,585 @@
+/*
+Local history store
+
+Every published sample is also appended to a segment file, one per UTC
+month (history/YYYY-MM.seg).  A segment is a small header followed by
+fixed width records: a 32 bit timestamp and one float per channel.  The
+header records the column count.  A segment keeps the width it was created
+with until the month ends, so channels added by a newer build start being
+recorded in the next segment and read back as missing from older ones.
+Channels are only ever appended to the table for the same reason.
+
+Appends collect in memory and are written and fsync'd together every
+fsync_interval seconds, so the SD card sees one write every few minutes
+instead of one per sample.  Reads mmap the segments and binary search the
+start time; samples not yet flushed are read from the batch buffer.
+
+When a month is over its segment is compressed (gorilla.h) into
+history/YYYY-MM.gor, as is any earlier month left raw by a daemon that
+wasn't running when it ended: the same header followed by blocks of up to
+STORE_BLOCK_SAMPLES samples, each with the time range it covers and its
+length so a reader can step over blocks outside the query.  The raw
+segment is only removed once the compressed copy is on disk, and a raw
+segment is always preferred when both exist.
+
+Before packing each value is rounded to the places its channel publishes
+and stored times 10^decimals, so the floats it encodes are whole numbers.
+Their low mantissa bits are all zero, which is what the XOR encoding
+needs: a decimal like 21.3 has no exact float and its mantissa is a
+repeating pattern that changes in every bit from one reading to the next.
+The places used are kept in the packed file, so a later change to the
+channel table doesn't misread older months.  With bench/synth.h's year of
+once a minute samples that is 7.98 MB packed against 31.5 MB raw, about 15
+bytes a sample.
+
+A packed month is closed.  A sample stamped in one, from a clock set back
+at boot or by NTP, is dropped and counted in late rather than start a raw
+segment that would hide the packed history, and a packed file is never
+written over.
+*/
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../readings.h"
+#include "gorilla.h"
+#include "../log/log.h"
+
+#define STORE_MAGIC             0x53485357      // "WSHS"
+#define STORE_PACKED_MAGIC      0x5A485357      // "WSHZ"
+#define STORE_VERSION           1
+#define STORE_PACKED_VERSION    2               // 1 had no decimals, values stored as read
+#define STORE_AS_READ           0xFF            // decimals of a column packed unscaled
+#define STORE_BATCH             256             // samples held before a forced write
+#define STORE_FSYNC_INTERVAL    600             // seconds, default
+#define STORE_COLUMNS           CH_COUNT
+#define STORE_BLOCK_SAMPLES     1024            // ~17 hours at one sample a minute
+
+struct store_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t columns;
+	uint32_t record_size;
+	uint32_t reserved;
+	int64_t created;
+	int64_t reserved2;
+};
+
+struct store_block {
+	uint32_t first_ts;
+	uint32_t last_ts;
+	uint32_t count;
+	uint32_t bytes;                         // encoded length following this header
+};
+
+// Follows the header of a packed file from version 2
+struct store_decimals {
+	uint8_t column[GORILLA_MAX_COLUMNS];    // values are stored times 10^column[c]
+};
+
+struct store_sample {
+	uint32_t ts;
+	float value[STORE_COLUMNS];
+};
+
+struct store {
+	char dir[200];
+	int fd;                                 // current segment, opened for append
+	int month;                              // year * 12 + month of the open segment
+	int columns;                            // record width of the open segment
+	int fsync_interval;
+	time_t last_sync;
+	int pending;
+	struct store_sample batch[STORE_BATCH];
+	pthread_mutex_t lock;                   // batch and pending, for readers
+
+	unsigned long appended;
+	unsigned long writes;
+	unsigned long errors;
+	unsigned long late;                     // dropped, their month was already packed
+};
+
+// Calls back with each sample in range, oldest first.  values has
+// columns entries, which is fewer than CH_COUNT for segments written before
+// a channel was added.  Return non-zero from the callback to stop the scan.
+typedef int (*store_visit)(void *ctx, int64_t ts, const float *values, int columns);
+
+static int store_month_of(int64_t ts)
+{
+	time_t t = ts;
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	return (tm.tm_year + 1900) * 12 + tm.tm_mon;
+}
+
+static void store_segment_path(const struct store *st, int month, char *path, size_t len)
+{
+	snprintf(path, len, "%s/%04d-%02d.seg", st->dir, month / 12, month % 12 + 1);
+}
+
+static void store_packed_path(const struct store *st, int month, char *path, size_t len)
+{
+	snprintf(path, len, "%s/%04d-%02d.gor", st->dir, month / 12, month % 12 + 1);
+}
+
+static int64_t store_month_start(int month)
+{
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = month / 12 - 1900;
+	tm.tm_mon = month % 12;
+	tm.tm_mday = 1;
+	return timegm(&tm);
+}
+
+int store_open(struct store *st, const char *dir, int fsync_interval)
+{
+	memset(st, 0, sizeof(*st));
+	snprintf(st->dir, sizeof(st->dir), "%s", dir);
+	st->fd = -1;
+	st->fsync_interval = fsync_interval;
+	st->last_sync = time(NULL);
+	pthread_mutex_init(&st->lock, NULL);
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+// Compress a closed month's raw segment and remove it.  Returns 0 if there
+// was nothing to do or the month is now packed.
+int store_compact(struct store *st, int month)
+{
+	static uint8_t out[GORILLA_MAX_BYTES(GORILLA_MAX_COLUMNS, STORE_BLOCK_SAMPLES)];
+	char path[256], packed[256], tmp[300];
+	struct store_header hdr;
+	struct store_block blk;
+	struct store_decimals dec;
+	struct gorilla g;
+	struct stat sb;
+	const uint8_t *base;
+	float scale[GORILLA_MAX_COLUMNS], v[GORILLA_MAX_COLUMNS];
+	size_t count, i, n;
+	void *map;
+	FILE *fp;
+	int fd, c;
+
+	store_segment_path(st, month, path, sizeof(path));
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(hdr)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	memcpy(&hdr, map, sizeof(hdr));
+	if (hdr.magic != STORE_MAGIC || hdr.columns > GORILLA_MAX_COLUMNS ||
+	    hdr.record_size != sizeof(uint32_t) + hdr.columns * sizeof(float)) {
+		munmap(map, sb.st_size);
+		return -1;
+	}
+	base = (const uint8_t *)map + sizeof(hdr);
+	count = (sb.st_size - sizeof(hdr)) / hdr.record_size;
+
+	store_packed_path(st, month, packed, sizeof(packed));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", packed);
+	if (access(packed, F_OK) == 0 || (fp = fopen(tmp, "w")) == NULL) {     // never over a packed one
+		munmap(map, sb.st_size);
+		return -1;
+	}
+	hdr.magic = STORE_PACKED_MAGIC;
+	hdr.version = STORE_PACKED_VERSION;
+	hdr.record_size = 0;
+	memset(&dec, STORE_AS_READ, sizeof(dec));
+	for (c = 0; c < hdr.columns; c++) {
+		if (c < CH_COUNT)
+			dec.column[c] = channels[c].decimals;
+		scale[c] = dec.column[c] == STORE_AS_READ ? 1 : powf(10, dec.column[c]);
+	}
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(&dec, sizeof(dec), 1, fp);
+
+	for (i = 0; i < count; i += n) {
+		n = count - i < STORE_BLOCK_SAMPLES ? count - i : STORE_BLOCK_SAMPLES;
+		gorilla_encode_begin(&g, out, sizeof(out), hdr.columns);
+		for (size_t j = 0; j < n; j++) {
+			const uint8_t *rec = base + (i + j) * (sizeof(uint32_t) + hdr.columns * sizeof(float));
+			memcpy(v, rec + sizeof(uint32_t), hdr.columns * sizeof(float));
+			for (c = 0; c < hdr.columns; c++)
+				if (dec.column[c] != STORE_AS_READ)
+					v[c] = roundf(v[c] * scale[c]);
+			gorilla_encode(&g, *(const uint32_t *)rec, v);
+		}
+		blk.first_ts = *(const uint32_t *)(base + i * (sizeof(uint32_t) + hdr.columns * sizeof(float)));
+		blk.last_ts = g.prev_ts;
+		blk.count = n;
+		blk.bytes = gorilla_encode_end(&g);
+		fwrite(&blk, sizeof(blk), 1, fp);
+		fwrite(out, 1, blk.bytes, fp);
+	}
+	munmap(map, sb.st_size);
+
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0 || ferror(fp)) {
+		fclose(fp);
+		unlink(tmp);
+		return -1;
+	}
+	fclose(fp);
+	if (rename(tmp, packed) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+	unlink(path);
+	return 0;
+}
+
+// Pack every raw segment of a month before month: the one just over, and
+// any left behind while the daemon was down or a pack failed
+static void store_compact_before(struct store *st, int month)
+{
+	struct dirent *de;
+	DIR *dir;
+	int year, mon, end;
+
+	if ((dir = opendir(st->dir)) == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		end = 0;
+		if (sscanf(de->d_name, "%4d-%2d.seg%n", &year, &mon, &end) != 2 || end == 0 ||
+		    de->d_name[end] != '\0' || mon < 1 || mon > 12 || year * 12 + mon - 1 >= month)
+			continue;
+		if (store_compact(st, year * 12 + mon - 1) < 0)
+			log_warn("Unable to compress history for %04d-%02d", year, mon);
+	}
+	closedir(dir);
+}
+
+// Open (or create) the segment for month for appending
+static int store_open_segment(struct store *st, int month)
+{
+	struct store_header hdr;
+	char path[256];
+	struct stat sb;
+
+	if (st->fd >= 0 && st->month == month)
+		return 0;
+	if (st->fd >= 0) {
+		fsync(st->fd);
+		close(st->fd);
+		st->fd = -1;
+	}
+
+	store_segment_path(st, month, path, sizeof(path));
+	st->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (st->fd < 0)
+		return -1;
+	if (fstat(st->fd, &sb) == 0 && sb.st_size >= (off_t)sizeof(hdr)) {
+		if (pread(st->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != STORE_MAGIC ||
+		    hdr.record_size != sizeof(uint32_t) + hdr.columns * sizeof(float)) {
+			close(st->fd);
+			st->fd = -1;
+			return -1;              // not ours, leave it for a human
+		}
+		// Drop a record torn by a crash part way through a write
+		off_t whole = sizeof(hdr) + (sb.st_size - sizeof(hdr)) / hdr.record_size * hdr.record_size;
+		if (whole != sb.st_size && ftruncate(st->fd, whole) < 0) {
+			close(st->fd);
+			st->fd = -1;
+			return -1;
+		}
+	} else {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = STORE_MAGIC;
+		hdr.version = STORE_VERSION;
+		hdr.columns = STORE_COLUMNS;
+		hdr.record_size = sizeof(struct store_sample);
+		hdr.created = time(NULL);
+		if (ftruncate(st->fd, 0) < 0 || write(st->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+			close(st->fd);
+			st->fd = -1;
+			return -1;
+		}
+	}
+	st->columns = hdr.columns;
+	st->month = month;
+
+	// First write of a new month (or since a restart): pack the ones before
+	store_compact_before(st, month);
+	return 0;
+}
+
+// Whether month has been packed and has no raw segment to append to
+static int store_month_packed(const struct store *st, int month)
+{
+	char path[256];
+
+	store_segment_path(st, month, path, sizeof(path));
+	if (access(path, F_OK) == 0)
+		return 0;
+	store_packed_path(st, month, path, sizeof(path));
+	return access(path, F_OK) == 0;
+}
+
+// Append n samples of one month in the segment's record width
+static int store_write_run(struct store *st, int month, const struct store_sample *samples, int n)
+{
+	static uint8_t out[STORE_BATCH * sizeof(struct store_sample)];
+	size_t record_size, len;
+	int i, c;
+
+	if ((st->fd < 0 || st->month != month) && store_month_packed(st, month)) {
+		st->late += n;
+		return 0;
+	}
+	if (store_open_segment(st, month) < 0)
+		return -1;
+
+	record_size = sizeof(uint32_t) + st->columns * sizeof(float);
+	if (st->columns == STORE_COLUMNS) {
+		len = n * sizeof(struct store_sample);
+		return write(st->fd, samples, len) == (ssize_t)len ? 0 : -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		uint8_t *rec = out + i * record_size;
+		float *v = (float *)(rec + sizeof(uint32_t));
+		memcpy(rec, &samples[i].ts, sizeof(uint32_t));
+		for (c = 0; c < st->columns; c++)
+			v[c] = c < STORE_COLUMNS ? samples[i].value[c] : NAN;
+	}
+	len = n * record_size;
+	return write(st->fd, out, len) == (ssize_t)len ? 0 : -1;
+}
+
+// Write out the batch and fsync.  Samples stay in the batch on error.
+// Called with the lock held.
+static int store_write_batch(struct store *st)
+{
+	int done = 0;
+	int n;
+
+	while (done < st->pending) {
+		int month = store_month_of(st->batch[done].ts);
+		for (n = 1; done + n < st->pending && store_month_of(st->batch[done + n].ts) == month; n++)
+			;
+		if (store_write_run(st, month, &st->batch[done], n) < 0) {
+			st->errors++;
+			memmove(st->batch, &st->batch[done], (st->pending - done) * sizeof(struct store_sample));
+			st->pending -= done;
+			return -1;
+		}
+		st->writes++;
+		done += n;
+	}
+	st->pending = 0;
+	if (st->fd >= 0)
+		fsync(st->fd);
+	st->last_sync = time(NULL);
+	return 0;
+}
+
+int store_flush(struct store *st)
+{
+	int rc;
+
+	pthread_mutex_lock(&st->lock);
+	rc = store_write_batch(st);
+	pthread_mutex_unlock(&st->lock);
+	return rc;
+}
+
+// Queue one sample; flushes when the interval is up or the batch is full
+int store_append(struct store *st, int64_t ts, const float *values)
+{
+	struct store_sample *s;
+	int rc = 0;
+
+	pthread_mutex_lock(&st->lock);
+	if (st->pending == STORE_BATCH && store_write_batch(st) < 0) {
+		pthread_mutex_unlock(&st->lock);
+		return -1;
+	}
+
+	s = &st->batch[st->pending++];
+	s->ts = ts;
+	memcpy(s->value, values, sizeof(s->value));
+	st->appended++;
+
+	if (time(NULL) - st->last_sync >= st->fsync_interval)
+		rc = store_write_batch(st);
+	pthread_mutex_unlock(&st->lock);
+	return rc;
+}
+
+// Scan one mmap'd segment from the first sample at or after from.  Returns
+// -1 if there is no such segment, otherwise whether the visitor stopped.
+static int store_scan_segment(const char *path, int64_t from, int64_t to, store_visit visit, void *ctx)
+{
+	struct store_header *hdr;
+	struct stat sb;
+	const uint8_t *base, *rec;
+	size_t count, lo, hi;
+	int stop = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return 0;
+	}
+	void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	hdr = map;
+	if (hdr->magic != STORE_MAGIC || hdr->record_size < sizeof(uint32_t) + hdr->columns * sizeof(float)) {
+		munmap(map, sb.st_size);
+		return 0;
+	}
+	base = (const uint8_t *)map + sizeof(*hdr);
+	count = (sb.st_size - sizeof(*hdr)) / hdr->record_size;
+
+	// First record with ts >= from
+	lo = 0;
+	hi = count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (*(const uint32_t *)(base + mid * hdr->record_size) < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < count && !stop; lo++) {
+		rec = base + lo * hdr->record_size;
+		uint32_t ts = *(const uint32_t *)rec;
+		if (ts > to)
+			break;
+		stop = visit(ctx, ts, (const float *)(rec + sizeof(uint32_t)), hdr->columns);
+	}
+
+	munmap(map, sb.st_size);
+	return stop;
+}
+
+// Scan a compressed segment, decoding only the blocks that overlap the range
+static int store_scan_packed(const char *path, int64_t from, int64_t to, store_visit visit, void *ctx)
+{
+	const struct store_header *hdr;
+	const struct store_decimals *dec = NULL;
+	const struct store_block *blk;
+	float values[GORILLA_MAX_COLUMNS], scale[GORILLA_MAX_COLUMNS];
+	struct gorilla g;
+	struct stat sb;
+	const uint8_t *p, *end;
+	uint32_t ts;
+	int stop = 0;
+	int fd, c;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return 0;
+	}
+	void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	hdr = map;
+	p = (const uint8_t *)map + sizeof(*hdr);
+	end = (const uint8_t *)map + sb.st_size;
+	if (hdr->magic != STORE_PACKED_MAGIC || hdr->columns > GORILLA_MAX_COLUMNS ||
+	    (hdr->version >= 2 && p + sizeof(*dec) > end))
+		p = end;
+	else if (hdr->version >= 2) {
+		dec = (const struct store_decimals *)p;
+		p += sizeof(*dec);
+	}
+	for (c = 0; c < GORILLA_MAX_COLUMNS; c++)
+		scale[c] = dec == NULL || dec->column[c] == STORE_AS_READ ? 1 : powf(10, dec->column[c]);
+
+	while (!stop && p + sizeof(*blk) <= end) {
+		blk = (const struct store_block *)p;
+		p += sizeof(*blk);
+		if (blk->bytes > (size_t)(end - p) || blk->first_ts > to)
+			break;
+		if (blk->last_ts >= from) {
+			gorilla_decode_begin(&g, p, blk->bytes, hdr->columns, blk->count);
+			while (!stop && gorilla_decode(&g, &ts, values)) {
+				if (ts > to)
+					break;
+				if (ts < from)
+					continue;
+				for (c = 0; c < hdr->columns; c++)
+					values[c] /= scale[c];
+				stop = visit(ctx, ts, values, hdr->columns);
+			}
+		}
+		p += blk->bytes;
+	}
+
+	munmap(map, sb.st_size);
+	return stop;
+}
+
+// Visit every stored sample with from <= ts <= to, oldest first.  Safe to
+// call from any thread.
+void store_scan(struct store *st, int64_t from, int64_t to, store_visit visit, void *ctx)
+{
+	struct store_sample batch[STORE_BATCH];
+	char path[256];
+	int64_t disk_to = to;
+	int64_t start = from;
+	int pending;
+	int month;
+	int rc;
+	int i;
+
+	// Anything written to disk after the copy is also in it, so the disk
+	// part of the scan stops where the copy starts
+	pthread_mutex_lock(&st->lock);
+	pending = st->pending;
+	memcpy(batch, st->batch, pending * sizeof(struct store_sample));
+	pthread_mutex_unlock(&st->lock);
+	if (pending && batch[0].ts <= disk_to)
+		disk_to = (int64_t)batch[0].ts - 1;
+
+	for (month = store_month_of(start); start <= disk_to && month <= store_month_of(disk_to); month++) {
+		store_segment_path(st, month, path, sizeof(path));
+		rc = store_scan_segment(path, start, disk_to, visit, ctx);
+		if (rc < 0) {
+			store_packed_path(st, month, path, sizeof(path));
+			rc = store_scan_packed(path, start, disk_to, visit, ctx);
+		}
+		if (rc > 0)
+			return;
+		start = store_month_start(month + 1);
+	}
+
+	for (i = 0; i < pending; i++) {
+		if (batch[i].ts < from || batch[i].ts > to)
+			continue;
+		if (visit(ctx, batch[i].ts, batch[i].value, STORE_COLUMNS))
+			return;
+	}
+}
+
+#endif
@@ -16,399 +16,1255 @@ http://wiringpi.com/
 
 */
 
+#ifndef HAL_NO_WIRINGPI
 #include <wiringPi.h>
-#include <wiringPiSPI.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <getopt.h>
-#include "BMP085/smbus.c"
-#include "BMP085/smbus.h"
 #include "BMP085/getBMP085.c"
 #include "mcp3008/mcp3008.h"
+#include "mcp3008/mcp3008_spi.h"
+#include "mcp3008/oversample.h"
+#include "dht22/dht22.h"
 #include "MQTTClient.h"
+#include "mqtt/publisher.h"
+#include "mqtt/outbox.h"
+#include "mqtt/payload.h"
+#include "mqtt/deadband.h"
+#include "scheduler/scheduler.h"
+#include "scheduler/worker.h"
+#include "pulses/pulses.h"
+#include "weather/wind.h"
+#include "weather/rain.h"
+#include "weather/filter.h"
+#include "weather/derived.h"
+#include "hal/hal.h"
+#include "store/store.h"
+#include "store/rollup.h"
+#include "query/server.h"
+#include "metrics/metrics.h"
+#include "log/log.h"
+#include <sys/stat.h>
+#include "readings.h"
 #include <time.h>
 
 #define RAIN_PIN 15
 #define WIND_PIN 16
 #define RAIN_CALIBRATION 0.2794              // 0.2794 mm per tip
-#define WIND_CALIBRATION 2.4
+#define RAIN_DEBOUNCE_NS 200000000ULL          // 200ms
+#define WIND_DEBOUNCE_NS 5000000ULL            // 5ms
+#define ADC_UVI_CHANNEL 0
+#define ADC_LIGHT_CHANNEL 3
+#define ADC_CHANNELS ((1 << ADC_UVI_CHANNEL) | (1 << ADC_LIGHT_CHANNEL))
 
-#define ADDRESS     "tcp://openhab2.home:1883"
+#define ADDRESS     "tcp://openhab2.home:1883"      // default broker
 #define CLIENTID    "weatherstation"
 #define QOS         1
 #define TIMEOUT     10000L
-#define TOPIC_temperature       "weather-station/temperature"
-#define TOPIC_dewpoint		"weather-station/dewpoint"
-#define TOPIC_light		"weather-station/light"
-#define TOPIC_uvi          	"weather-station/uvi"
-#define TOPIC_rain          	"weather-station/rain"
-#define TOPIC_windspeed         "weather-station/windspeed"
-#define TOPIC_abs_hum          	"weather-station/abs_hum"
-#define TOPIC_pressure		"weather-station/pressure"
-
-float rainCounter;      		// counter for rain guage clicks
-float windCounter;
-clock_t last_rain_interrupt_time = 0;
-clock_t last_wind_interrupt_time = 0;
-
-static const char * optString = "v";
+
+#define STATE_DIR   "/var/lib/weather-station"
+#define RAIN_STATE_FILE "rain.state"
+#define HISTORY_DIR "history"
+#define OUTBOX_FILE "outbox"
+#define OUTBOX_ACK_TIMEOUT 2000L                // ms to wait for a backlog batch's ack
+
+#define SAMPLE_PERIOD   60                      // seconds, aligned to the minute
+#define PULSE_PERIOD    1                       // drain the ISR rings this often
+#define STATS_INTERVAL  300                     // seconds between stats messages
+#define METRICS_MAX     192
+#define BMP085_SPREAD_PA 200                    // redundant BMP085s further apart than this disagree
+#define BMP085_SPREAD_CYCLES 3                  // for this many cycles running before it is logged
+
+struct pulse_source rain = { .name = "rain", .debounce_ns = RAIN_DEBOUNCE_NS };	// rain guage clicks
+struct pulse_source wind = { .name = "wind", .debounce_ns = WIND_DEBOUNCE_NS };
+struct wind_stats wind_stats;		//gust and mean windows over the wind pulses
+struct rain rain_totals;		//rolling rain totals, persisted in the state dir
+const char *state_dir = STATE_DIR;
+struct store history;			//every published sample, in the state dir
+struct rollup rollups;			//10m/1h/1d summaries of history
+int fsync_interval = STORE_FSYNC_INTERVAL;
+struct query_server query;		//answers history queries on its own threads
+const char *query_socket;		//default <state dir>/query.sock
+int http_port;				//0 = no HTTP
+
+static const char * optString = "vg:ac:s:f:q:p:m:r:P:d:H:o:R:F:L:b:w:k:B:S:l:V:z:I:i:";
 char mystring[50]; 			//size of the number
+struct publisher pub;			//MQTT connection, kept open between cycles
+struct outbox outbox;			//readings that didn't get through, sent when the broker is back
+int outbox_max_age = OUTBOX_MAX_AGE;
+int drain_rate = OUTBOX_DRAIN_RATE;
+int payload_mode = PAYLOAD_TOPICS;	//one message per channel, or the whole cycle in one
+uint8_t cycle_payload[PAYLOAD_MAX];
+const char *broker = ADDRESS;
+const char *record_file;		//raw samples for --hal replay
+struct oversample adc_window;		//n scans reduced to one value per channel
+struct {				//the last window's spread, copied out of the ADC worker for the metrics scrape
+	atomic_uint mask;
+	_Atomic float bits[MCP3008_CHANNELS];
+	_Atomic float variance[MCP3008_CHANNELS];
+} adc_quality;
+struct readings readings;		//latest value of every channel
+
+// A BMP085 as its task sees it.  The first is the primary; any more given
+// with --bmp085 run on workers of their own, back it up when it has no
+// reading and cross-check its pressure.
+struct bmp085_sensor {
+	struct bmp085 dev;		//i2c session, reopened after errors
+	unsigned int ut;		//raw temperature while the pressure converts
+	atomic_ulong errors;		//failed opens and conversions, read by the metrics scrape
+	char bus[64];
+	char name[24];
+};
+struct bmp085_sensor bmp085[HAL_BMP085_MAX] = {
+	{ .dev = { .bus = BMP085_I2C_BUS, .address = BMP085_I2C_ADDRESS, .oss = BMP085_OVERSAMPLING_SETTING, .fd = -1 },
+	  .name = "bmp085" },
+};
+int bmp085_count = 1;
+float bmp085_spread;			//Pa between the highest and lowest pressure this cycle
+unsigned long bmp085_disagreements;	//cycles with the spread over BMP085_SPREAD_PA
+unsigned long bmp085_failovers;		//cycles published from a backup
+atomic_ulong adc_errors;		//failed mcp3008 scans
+struct hist hist_acquisition;		//publish tick to the last sensor's sample
+struct hist hist_adc_scan;		//one mcp3008 scan
+struct hist hist_store;			//history append
+struct hist hist_mqtt_acks;		//first publish of a cycle to its last ack
+int stats_interval = STATS_INTERVAL;	//0 = no stats topic
+char stats_payload[8192];
+const char *log_file = LOG_FILE;
+long log_size = LOG_SIZE;
 static const struct option longOpts[] = {
 	{ "version", no_argument, NULL, 'v' },
+	{ "gpio", required_argument, NULL, 'g' },
+	{ "adc-spi", no_argument, NULL, 'a' },
+	{ "adc-channels", required_argument, NULL, 'c' },
+	{ "state-dir", required_argument, NULL, 's' },
+	{ "fsync-interval", required_argument, NULL, 'f' },
+	{ "query-socket", required_argument, NULL, 'q' },
+	{ "http-port", required_argument, NULL, 'p' },
+	{ "outbox-max-age", required_argument, NULL, 'm' },
+	{ "drain-rate", required_argument, NULL, 'r' },
+	{ "payload", required_argument, NULL, 'P' },
+	{ "deadband", required_argument, NULL, 'd' },
+	{ "heartbeat", required_argument, NULL, 'H' },
+	{ "adc-oversample", required_argument, NULL, 'o' },
+	{ "adc-rate", required_argument, NULL, 'R' },
+	{ "adc-filter", required_argument, NULL, 'F' },
+	{ "filter", required_argument, NULL, 'L' },
+	{ "bounds", required_argument, NULL, 'b' },
+	{ "hal", required_argument, NULL, 'w' },
+	{ "record", required_argument, NULL, 'k' },
+	{ "broker", required_argument, NULL, 'B' },
+	{ "stats-interval", required_argument, NULL, 'S' },
+	{ "log", required_argument, NULL, 'l' },
+	{ "log-level", required_argument, NULL, 'V' },
+	{ "log-size", required_argument, NULL, 'z' },
+	{ "sensor-period", required_argument, NULL, 'I' },
+	{ "bmp085", required_argument, NULL, 'i' },
 	{ NULL, no_argument,NULL,0}
 };
 
 
 // ======================================================================
-// rainInterrupt:  called for rain gauge counter
+// rainInterrupt:  called for rain gauge counter.  Runs on a wiringPi
+// thread, so it only queues the edge time for the main loop.
 
 void rainInterrupt(void) {
-        clock_t rain_interrupt_time;
-        rain_interrupt_time = clock();
-
-        if (((((float)rain_interrupt_time - (float)last_rain_interrupt_time) / 1000000.0F ) * 1000) >  200)  {
-                rainCounter++;
-        }
-        last_rain_interrupt_time = rain_interrupt_time;
+	pulse_edge(&rain);
 }
 
 // ======================================================================
 // windInterrupt
 
 void windInterrupt(void) {
-	clock_t wind_interrupt_time;
-        wind_interrupt_time = clock();
-
-        if (((((float)wind_interrupt_time - (float)last_wind_interrupt_time) / 1000000.0F ) * 1000) >  5)  {
-                windCounter++;
-        }
-        last_wind_interrupt_time = wind_interrupt_time;
-
+	pulse_edge(&wind);
 }
 
 //=======================================================================
-int read_mcp3008(int channel)
+// "adc=10,dht22=30": seconds between reads per sensor.  Returns 0 if
+// every name is a sensor task and every period divides SAMPLE_PERIOD or
+// is a multiple of it.
+int parse_sensor_periods(const char *list, struct sched_task *sensors, int n)
 {
-	// Channel, Clock, Output, Input, CS 
-  int value = mcp3008_value(channel, 11, 9, 10, 8);
-  return value;
+	char name[16];
+	int period, used, i;
+
+	while (*list) {
+		if (sscanf(list, "%15[^=]=%d%n", name, &period, &used) != 2 || period < 1 ||
+		    (SAMPLE_PERIOD % period != 0 && period % SAMPLE_PERIOD != 0))
+			return -1;
+		for (i = 0; i < n && strcmp(sensors[i].name, name) != 0; i++)
+			;
+		if (i == n)
+			return -1;
+		sensors[i].period = period;
+		list += used;
+		if (*list == ',')
+			list++;
+		else if (*list)
+			return -1;
+	}
+	return 0;
 }
 
-// ======================================================================
-
-#ifdef DEBUG
-int debug(char *debug_info)
+//=======================================================================
+// "/dev/i2c-1", "/dev/i2c-1:76" or "/dev/i2c-1:76:1": bus, address in
+// hex and oversampling setting.  The first --bmp085 replaces the default
+// sensor, the rest add to it.  Returns 0 if it is one.
+int parse_bmp085(const char *spec)
 {
-	FILE *fp;
-        fp=fopen("/tmp/debug.log", "a");
-        fprintf(fp, debug_info);
-	fprintf(fp, "\n");
-	fclose(fp);
+	struct bmp085_sensor *s;
+	static int given;
+	size_t len = strcspn(spec, ":");
+	long address = BMP085_I2C_ADDRESS, oss = BMP085_OVERSAMPLING_SETTING;
+	char *end;
+	int i;
+
+	if (given == HAL_BMP085_MAX || len == 0 || len >= sizeof(s->bus))
+		return -1;
+	if (spec[len] == ':') {
+		address = strtol(spec + len + 1, &end, 16);
+		if (*end == ':')
+			oss = strtol(end + 1, &end, 10);
+		if (*end || address < 0x03 || address > 0x77 || oss < 0 || oss > 3)
+			return -1;
+	}
+	for (i = 0; i < given; i++)
+		if (strlen(bmp085[i].bus) == len && strncmp(bmp085[i].bus, spec, len) == 0 &&
+		    bmp085[i].dev.address == address)
+			return -1;
+
+	s = &bmp085[given];
+	memcpy(s->bus, spec, len);
+	s->bus[len] = 0;
+	bmp085_Init(&s->dev, s->bus, address, oss);
+	if (given > 0)
+		snprintf(s->name, sizeof(s->name), "bmp085_%d", given + 1);
+	bmp085_count = ++given;
 	return 0;
 }
-#endif
 
 //=======================================================================
-float calculate_dew_point(float temp, float rel_humidity)
+// Parse a comma separated channel list such as "0,3,5" into a bit mask
+int parse_channels(const char *list)
 {
-  float a = 17.27;
-  float b = 237.7;
-  float dp;
-  float gamma = ((a * temp)/(b+temp)) + log(rel_humidity/100.0);
-  if(a == gamma)
-    dp = 0;
-  else
-    dp= (b*gamma)/(a-gamma);
-  return dp;
+	int mask = 0;
+	char *end;
+
+	while (*list) {
+		long ch = strtol(list, &end, 10);
+		if (end == list || ch < 0 || ch >= MCP3008_CHANNELS)
+			return -1;
+		mask |= 1 << ch;
+		list = *end == ',' ? end + 1 : end;
+		if (*end && *end != ',')
+			return -1;
+	}
+	return mask;
 }
 
 //=======================================================================
-float absolute_humidity(float temp, float rh)
+// Format a reading into mystring and hand it to the publisher.
+// The publish is pipelined, acks are collected by publisher_flush().
+int publish_reading(const char *topic, float value, int decimals)
 {
-  float abs_hum = ((6.112 * exp((17.67 * temp)/(temp + 243.5)) * 2.164 * rh) / (273.15 + temp));
-  return abs_hum;
+	int rc;
+
+	payload_fixed(mystring, sizeof(mystring), value, decimals);
+	rc = publisher_send(&pub, topic, mystring, TIMEOUT);
+	log_debug("%s %s", topic, mystring);
+	return rc;
 }
+
 //=======================================================================
-int main(int argc, char **argv)
+// The whole cycle as one message on TOPIC_cycle
+int publish_cycle(void)
 {
+	int len;
+
+	if (payload_mode == PAYLOAD_JSON)
+		len = payload_json((char *)cycle_payload, sizeof(cycle_payload), readings.ts, readings.value, readings.valid);
+	else
+		len = payload_cbor(cycle_payload, sizeof(cycle_payload), readings.ts, readings.value, readings.valid);
+	if (len < 0)
+		return -1;
+	return publisher_publish(&pub, TOPIC_cycle, cycle_payload, len, TIMEOUT);
+}
 
-        FILE *ptr_file;			//File pointer for dht22.txt file
-        char dht22_buf[20];
-	float t;			//DHT22 temp
-	float h;			//DHT22 rel humidity
-	int result;			//wiringPi result
-	float rainFall;
-	float windSpeed;
+//=======================================================================
+// Scheduled tasks.  Each sensor runs on its own worker thread and timer
+// (scheduler/worker.h) and sends what it reads to the main thread, where
+// the pulse, publish, outbox and stats tasks run.  The first tasks are the
+// sensors, in the same order as the workers.
+//
+// The BMP085 and DHT22 tasks never sleep while the hardware is busy.  They
+// start a conversion and sched_defer() until it is ready, so on the
+// virtual clock, where every task shares the main thread, the others are
+// serviced in the meantime.
+
+enum { TASK_ADC, TASK_BMP085, TASK_DHT22, TASK_PULSES, TASK_COUNTERS, TASK_PUBLISH, TASK_OUTBOX, TASK_STATS, TASK_COUNT };
+struct sched_task tasks[TASK_COUNT];
+
+#define ACQ_TIMEOUT_MS  (DHT22_DEADLINE_MS + 1000)      // publish without stragglers after this
+#define ACQ_POLL_MS     20                              // while waiting for them
+
+void bmp085_reset(struct worker *w);
+void metrics_update(void);
+
+// The BMP085s after the first come after the other sensors, each with a
+// copy of the first one's task
+enum { SENSOR_ADC, SENSOR_BMP085, SENSOR_DHT22, SENSOR_COUNT, SENSOR_MAX = SENSOR_COUNT + HAL_BMP085_MAX - 1 };
+#define BMP085_SENSOR(j) ((j) == 0 ? SENSOR_BMP085 : SENSOR_COUNT + (j) - 1)
+struct worker workers[SENSOR_MAX] = {
+	[SENSOR_ADC]    = { .name = "adc" },
+	[SENSOR_BMP085] = { .name = "bmp085", .reset = bmp085_reset },
+	[SENSOR_DHT22]  = { .name = "dht22" },
+};
+struct sched_task bmp085_tasks[HAL_BMP085_MAX - 1];
+int sensor_count = SENSOR_COUNT;
+static const uint32_t sensor_channels[SENSOR_MAX] = {
+	[SENSOR_ADC]    = (1u << CH_UVI) | (1u << CH_LIGHT),
+	[SENSOR_BMP085] = (1u << CH_TEMPERATURE) | (1u << CH_PRESSURE),
+	[SENSOR_DHT22]  = (1u << CH_DEWPOINT) | (1u << CH_ABS_HUM),
+};
+double acq_last_ms;			//publish tick to the last sensor's sample
 
+// Scan at adc_window.rate until every channel has its n samples, then
+// reduce them.  A failed scan is skipped; the window closes early rather
+// than run past its deadline.
+enum { ADC_IDLE, ADC_SAMPLING };
 
-        #ifdef DEBUG
-	debug("=================");
-	debug("Program Startup");
-	debug("=================");
-	#endif
+void task_adc(struct sched_task *task)
+{
+	struct mcp3008_scan scan = { { 0 } };
+	struct timespec t0;
+	int full = 0;
+	int rc;
+
+	if (task->state == ADC_IDLE) {
+		log_debug("Reading mcp3008");
+		oversample_begin(&adc_window);
+		task->state = ADC_SAMPLING;
+	}
 
-	int opt = 0;
-        int longIndex = 0;
+	sched_gettime(CLOCK_MONOTONIC, &t0);
+	rc = hal_adc_scan(&scan);
+	hist_record_ms(&hist_adc_scan, sched_elapsed_ms(&t0));
+	if (rc != 0) {
+		adc_errors++;
+		log_warn("mcp3008 scan failed");
+	} else
+		full = oversample_add(&adc_window, &scan);
+	if (!full && sched_elapsed_ms(&task->started) + oversample_interval_ms(&adc_window) < task->deadline_ms) {
+		sched_defer(task, oversample_interval_ms(&adc_window));
+		return;
+	}
 
-        opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
-        while( opt != -1 ) {
-                switch (opt) {
-                        case 'v':
-                                printf("Version 1.3\n");
-                                exit(0);
-                        default:
-                                exit(0);
-                }
-                opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
-        }
+	oversample_finish(&adc_window);
+	for (int ch = 0; ch < MCP3008_CHANNELS; ch++) {
+		atomic_store_explicit(&adc_quality.bits[ch], adc_window.bits[ch], memory_order_relaxed);
+		atomic_store_explicit(&adc_quality.variance[ch], adc_window.variance[ch], memory_order_relaxed);
+	}
+	atomic_store_explicit(&adc_quality.mask, adc_window.mask, memory_order_release);
+	if (log_enabled(LOG_DEBUG)) {
+		if (hal.adc_use_spi)
+			log_debug("mcp3008 spi %.0f scans/s", mcp3008_spi_rate(&hal.adc_spi));
+		for (int ch = 0; ch < MCP3008_CHANNELS; ch++)
+			if (adc_window.mask & (1 << ch))
+				log_debug("adc%d %.2f var %.2f %.1f nominal bits", ch,
+					  adc_window.value[ch], adc_window.variance[ch], adc_window.bits[ch]);
+		log_debug("done mcp3008");
+	}
+	// The previous readings are kept if nothing came in
+	if (!(adc_window.mask & (1 << ADC_UVI_CHANNEL)) || !(adc_window.mask & (1 << ADC_LIGHT_CHANNEL))) {
+		worker_send(task, 0, 0, 0);
+		return;
+	}
 
-        float start_time, end_time;
-
-        #ifdef DEBUG
-		time_t curtime;
-                time(&curtime);
-                debug(ctime(&curtime));
-        #endif
-
-	result = wiringPiSetup ();
-        if (result == -1)
-        {
-                #ifdef DEBUG
-			debug("Error on wiringPiSetup.  weatherstation quitting");
-		#endif
-                return 0;
-        }
+	float vout = adc_window.value[ADC_UVI_CHANNEL]/1023.0 * 3.3;	//UVI
+	float sensorVoltage = vout / 471.0;
+	float millivolts = sensorVoltage * 1000.0;
+	float uvi = millivolts * (5.25/20.0);
 
-	//Setup MQTT
-	MQTTClient client;
-    	MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
-    	MQTTClient_message pubmsg = MQTTClient_message_initializer;
-    	MQTTClient_deliveryToken token;
-    	int rc;
-    	MQTTClient_create(&client, ADDRESS, CLIENTID,
-        	MQTTCLIENT_PERSISTENCE_NONE, NULL);
-    	conn_opts.keepAliveInterval = 20;
-    	conn_opts.cleansession = 1;
-    	if ((rc = MQTTClient_connect(client, &conn_opts)) != MQTTCLIENT_SUCCESS)
-    	{
-            printf("Failed to connect, return code %d\n", rc);
-            exit(EXIT_FAILURE);
-    	}
-
-	#ifdef DEBUG
-               debug("Setup MQTT Complete");
-        #endif
-
-	//Setup interrupt
-	if ( wiringPiISR (RAIN_PIN, INT_EDGE_BOTH, &rainInterrupt) < 0 ) {
-                printf("Unable to setup ISR");
-        }
+	vout = adc_window.value[ADC_LIGHT_CHANNEL]/1023.0 * 3.3;	//temt6000
+	float microAmps = vout * 100.0;			// microamps = Vout/10k (resistor on temt6000) * 1000000
+	worker_send(task, 1, uvi, microAmps * 2);	//Acording to datasheet graph
+}
+
+// start signal -> capture, and on a bad frame wait out the sensor's
+// minimum interval and start again until DHT22_DEADLINE_MS
+enum { DHT22_IDLE, DHT22_STARTED, DHT22_RETRY };
 
-	if ( wiringPiISR (WIND_PIN, INT_EDGE_FALLING, &windInterrupt) < 0 ) {
-                printf("Unable to setup ISR");
+void task_dht22(struct sched_task *task)
+{
+	static float temperature, humidity;
+	int rc;
+
+	switch (task->state) {
+	case DHT22_IDLE:
+		log_debug("Reading dht22");
+		dht22_stats.reads++;
+		/* fall through */
+	case DHT22_RETRY:
+		hal_dht22_start();
+		task->state = DHT22_STARTED;
+		sched_defer(task, DHT22_START_MS);
+		return;
+
+	case DHT22_STARTED:
+		// On failure the previous reading is kept
+		rc = hal_dht22_collect(&temperature, &humidity);
+		if (rc != DHT22_OK && sched_elapsed_ms(&task->started) + DHT22_MIN_INTERVAL_MS <= DHT22_DEADLINE_MS) {
+			dht22_stats.retries++;
+			task->state = DHT22_RETRY;
+			sched_defer(task, DHT22_MIN_INTERVAL_MS);
+			return;
+		}
+		dht22_stats.last_error = rc;
+		if (rc != DHT22_OK) {
+			dht22_stats.failures++;
+			log_warn("dht22 read failed: %d", rc);
+		}
+		log_debug("done dht22");
+		worker_send(task, rc == DHT22_OK, temperature, humidity);
+		return;
 	}
+}
 
+// start UT -> read UT and start UP -> read UP, waiting on timers in between.
+// One task per sensor, with its struct bmp085_sensor as data.
+enum { BMP085_IDLE, BMP085_WAIT_UT, BMP085_WAIT_UP };
 
-	float dewpoint;
-	float abs_humidity;
-	float pressure;
+void task_bmp085(struct sched_task *task)
+{
+	struct bmp085_sensor *s = worker_arg(task);
+	struct bmp085 *dev = &s->dev;
+	unsigned int up;
+
+	switch (task->state) {
+	case BMP085_IDLE:
+		log_debug("Reading %s", s->name);
+		if (dev->fd < 0 && hal_bmp085_open(dev) < 0) {
+			log_warn("Unable to open %s at %s:%02x", s->name, dev->bus, dev->address);
+			s->errors++;
+			worker_send(task, 0, 0, 0);
+			return;
+		}
+		if (hal_bmp085_start_ut(dev) < 0)
+			break;
+		task->state = BMP085_WAIT_UT;
+		sched_defer(task, 5);                   // at least 4.5ms
+		return;
+
+	case BMP085_WAIT_UT:
+		if (hal_bmp085_read_ut_start_up(dev, &s->ut) < 0)
+			break;
+		task->state = BMP085_WAIT_UP;
+		sched_defer(task, BMP085_UP_DELAY_MS(dev->oss));
+		return;
+
+	case BMP085_WAIT_UP:
+		if (hal_bmp085_read_up(dev, &up) < 0)
+			break;
+
+		log_debug("done %s", s->name);
+		worker_send(task, 1, bmp085_GetTemperature(&dev->cal, s->ut) / 10.0,
+			    bmp085_GetPressure(&dev->cal, dev->oss, s->ut, up));
+		return;
+	}
 
-	start_time = time(NULL);
+	log_warn("%s read failed", s->name);
+	s->errors++;
+	bmp085_reset(task->data);                       // reopen and recalibrate next time
+	worker_send(task, 0, 0, 0);
+}
+
+// Also the watchdog's way to recover it, on the worker's thread
+void bmp085_reset(struct worker *w)
+{
+	struct bmp085_sensor *s = w->arg;
+
+	if (s->dev.fd >= 0)
+		hal_bmp085_close(&s->dev);
+}
+
+void wind_pulse_accept(void *ctx, uint64_t ts)
+{
+	wind_pulse(ctx, ts);
+}
 
-	for(; /* some condition that takes forever to meet */;) {
-     			// do stuff that apparently takes forever.
+// Tips are kept in wall clock time so the totals survive a reboot
+void rain_pulse_accept(void *ctx, uint64_t ts)
+{
+	rain_tip(ctx, sched_time() - (int64_t)((pulse_now_ns() - ts) / 1000000000ULL));
+}
 
-		end_time = time(NULL);
-       		double diff_time = difftime(end_time, start_time);
+// Debounce the edges the interrupts queued.  Runs every second so the
+// rings never fill, even in a gale.
+void task_pulses(struct sched_task *task)
+{
+	static unsigned long reported;
+	unsigned long dropped;
 
+	hal_pulses();
+	pulse_drain(&rain, rain_pulse_accept, &rain_totals);
+	pulse_drain(&wind, wind_pulse_accept, &wind_stats);
+	wind_advance(&wind_stats, pulse_now_ns() / 1000000000ULL);     // close calm seconds too
 
-    		if (diff_time >= 60) {				// Upload data to internal server 5 mins
-                	//printf("5 mins passed - send data...\n");
+	for (int i = 0; i < sensor_count; i++) {
+		worker_receive(&workers[i]);
+		worker_watchdog(&workers[i]);
+	}
 
-			start_time = time(NULL);
-			#ifdef DEBUG
-				time(&curtime);
-				debug(ctime(&curtime));
-				debug("Reading mcp3008 -chan 0");
-			#endif
+	dropped = rain.ring.dropped + wind.ring.dropped;
+	if (dropped != reported) {
+		log_warn("pulse ring overflow: rain %lu wind %lu", rain.ring.dropped, wind.ring.dropped);
+		reported = dropped;
+	}
+	metrics_update();
+}
 
-			int myval = read_mcp3008(0);			//Read UVI
-			#ifdef DEBUG
-				debug("done chan 0");
-			#endif
+void task_counters(struct sched_task *task)
+{
+	struct wind_report wr;
+	struct rain_report rr;
+
+	task_pulses(task);
+
+	rain_report(&rain_totals, sched_time(), &rr);
+	rain_sync(&rain_totals);
+	readings.value[CH_RAIN] = rr.day;
+	readings.value[CH_RAIN_1H] = rr.hour;
+	readings.value[CH_RAIN_24H] = rr.day24;
+	readings.value[CH_RAIN_RATE] = rr.rate;
+
+	wind_report(&wind_stats, &wr);
+	readings.value[CH_WINDSPEED] = wr.mean_short;
+	readings.value[CH_WINDSPEED_10M] = wr.mean_long;
+	readings.value[CH_WINDGUST] = wr.peak;
+	readings.value[CH_WINDLULL] = wr.lull;
+}
 
-			float vout = myval/1023.0 * 3.3;
-			float sensorVoltage = vout / 471.0;
-			float millivolts = sensorVoltage * 1000.0;
-			float uvi = millivolts * (5.25/20.0);
+// Take what the workers have sent.  Returns the sensors due on this tick
+// that haven't reported since, leaving out stale ones.
+unsigned int sensors_pending(time_t tick)
+{
+	struct sched_task *task;
+	unsigned int pending = 0;
+	int i;
+
+	for (i = 0; i < sensor_count; i++) {
+		task = workers[i].task;
+		worker_receive(&workers[i]);
+		if (!workers[i].stale && (tick - task->offset) % task->period == 0 &&
+		    workers[i].last_ns < (int64_t)tick * 1000000000)
+			pending |= 1u << i;
+	}
+	return pending;
+}
 
-			#ifdef DEBUG
-				debug("Reading mcp3008 - chan 3");
-			#endif
+// Whether sensor i has a good sample from this tick, or from the last one
+// it was due on
+static int sensor_fresh(int i, unsigned int pending)
+{
+	struct worker *w = &workers[i];
 
-			myval = read_mcp3008(3);				//Read temt6000
+	return !w->stale && !(pending & (1u << i)) && w->last_ns == w->good_ns;
+}
 
-			#ifdef DEBUG
-				debug("done chan 3");
-			#endif
+// Compare the pressures of the BMP085s with a fresh sample, once every
+// one that isn't stale has one, and pick the one to publish: the primary,
+// or else the first backup that has one.  Returns NULL if none does.
+static struct worker *bmp085_check(unsigned int pending)
+{
+	static int disagreeing, failed_over;
+	struct worker *w, *use = NULL;
+	float lo = INFINITY, hi = -INFINITY;
+	char list[128];
+	int len = 0, n = 0, live = 0;
+	int i, j;
+
+	for (j = 0; j < bmp085_count; j++) {
+		i = BMP085_SENSOR(j);
+		w = &workers[i];
+		live += !w->stale;
+		if (!sensor_fresh(i, pending))
+			continue;
+		n++;
+		if (use == NULL)
+			use = w;
+		lo = fminf(lo, w->last.value[1]);
+		hi = fmaxf(hi, w->last.value[1]);
+		if (len < (int)sizeof(list))
+			len += snprintf(list + len, sizeof(list) - len, " %s %.0f", w->name, w->last.value[1]);
+	}
+	if (n >= 2 && n == live) {
+		bmp085_spread = hi - lo;
+		if (bmp085_spread > BMP085_SPREAD_PA) {
+			bmp085_disagreements++;
+			if (++disagreeing == BMP085_SPREAD_CYCLES)     // not for a single spike
+				log_warn("bmp085 pressures %.0f Pa apart:%s", bmp085_spread, list);
+		} else if (disagreeing < BMP085_SPREAD_CYCLES) {
+			disagreeing = 0;
+		} else if (bmp085_spread < BMP085_SPREAD_PA * 3 / 4) {
+			log_info("bmp085 pressures agree again");
+			disagreeing = 0;
+		}
+	}
 
-			vout = myval/1023.0 * 3.3;
-			float microAmps = vout * 100.0;			// microamps = Vout/10k (resistor on temt6000) * 1000000
-			float Light = microAmps * 2;				//Acording to datasheet graph
-
-			#ifdef DEBUG
-				debug("Reading dht22");
-			#endif
-
-			// readDHT22();				// Read DHT22 Sensor
-
-			//Call Adafruits python script to read dht22 sensor on pin 4
-			//Saves result to test file
-			system("/usr/bin/python /home/pi/RaspberryPi-WeatherStation/AdafruitDHT.py 22 4 > /tmp/dht22.txt");
-
-			//Open file and get values
-			ptr_file =fopen("/tmp/dht22.txt","r");
-			while (fgets(dht22_buf,20, ptr_file)!=NULL)
-	                       sscanf(dht22_buf, "%f,%f", &t, &h);
-			fclose(ptr_file);
-
-			#ifdef DEBUG
-				debug("done dht22");
-				debug("Reading bmp085");
-			#endif
-			bmp085_Calibration();
-
-			#ifdef DEBUG
-				debug("done bmp085");
-        		#endif
-
-
-			rainFall = rainCounter*RAIN_CALIBRATION;
-			windSpeed = windCounter/4*WIND_CALIBRATION;   //4 pulses per rotation
-
-			float temperature = bmp085_GetTemperature(bmp085_ReadUT());
-			temperature = temperature / 10.0;
-
-			#ifdef DEBUG
-				debug("got temp");
-        		#endif
-
-			pressure = bmp085_GetPressure(bmp085_ReadUP());
-
-			#ifdef DEBUG
-				debug("got pressure");
-			#endif
-
-			dewpoint = calculate_dew_point(t, h);
-
-			#ifdef DEBUG
-				debug("calc  dewpoint");
-			#endif
-
-			abs_humidity = absolute_humidity(t, h);
-
-			#ifdef DEBUG
-				debug("send data to openhab");
-			#endif
-
-		        MQTTClient_create(&client, ADDRESS, CLIENTID,
-       	 		        MQTTCLIENT_PERSISTENCE_NONE, NULL);
-		        if ((rc = MQTTClient_connect(client, &conn_opts)) != MQTTCLIENT_SUCCESS)
-        		{
-   	        	 printf("Failed to connect, return code %d\n", rc);
- 	       		    exit(EXIT_FAILURE);
-  		         }
-
-			sprintf(mystring, "%g", temperature);
-			pubmsg.payload = mystring; 
-    			pubmsg.payloadlen = strlen(mystring);
-    			pubmsg.retained = 0;
-    			MQTTClient_publishMessage(client, TOPIC_temperature, &pubmsg, &token);
-    			rc = MQTTClient_waitForCompletion(client, token, TIMEOUT);
-			#ifdef DEBUG
-	    			debug("Message with delivery:temperature");
-				debug(mystring);
-			#endif
-
-			sprintf(mystring, "%0.2g", dewpoint);
-			pubmsg.payload = mystring; 
-                        pubmsg.payloadlen = strlen(mystring);
-			MQTTClient_publishMessage(client, TOPIC_dewpoint, &pubmsg, &token);
-                        rc = MQTTClient_waitForCompletion(client, token, TIMEOUT);
-			#ifdef DEBUG
-				debug("Message with delivery:dewpoint");
-				debug(mystring);
-			#endif
-
-			sprintf(mystring, "%g", pressure);
-			pubmsg.payload = mystring; 
-                        pubmsg.payloadlen = strlen(mystring);
-                        MQTTClient_publishMessage(client, TOPIC_pressure, &pubmsg, &token);
-                        rc = MQTTClient_waitForCompletion(client, token, TIMEOUT);
-                        #ifdef DEBUG
-				debug("Message with delivery:pressure");
-				debug(mystring);
-			#endif
-
- 			sprintf(mystring, "%0.2g", Light);
-                        pubmsg.payload = mystring; 
-                        pubmsg.payloadlen = strlen(mystring);
-                        MQTTClient_publishMessage(client, TOPIC_light, &pubmsg, &token);
-                        rc = MQTTClient_waitForCompletion(client, token, TIMEOUT);
-                        #ifdef DEBUG
-				debug("Message with delivery:light");
-				debug(mystring);
-			#endif
-
-			sprintf(mystring, "%0.2g", uvi);
-                        pubmsg.payload = mystring; 
-                        pubmsg.payloadlen = strlen(mystring);
-                        MQTTClient_publishMessage(client, TOPIC_uvi, &pubmsg, &token);
-                        rc = MQTTClient_waitForCompletion(client, token, TIMEOUT);
-                        #ifdef DEBUG
-				debug("Message with delivery:uvi");
-				debug(mystring);
-			#endif
-
-			sprintf(mystring, "%0.3g", abs_humidity);
-                        pubmsg.payload = mystring; 
-                        pubmsg.payloadlen = strlen(mystring);
-                        MQTTClient_publishMessage(client, TOPIC_abs_hum, &pubmsg, &token);
-                        rc = MQTTClient_waitForCompletion(client, token, TIMEOUT);
-                        #ifdef DEBUG
-				debug("Message with delivery:abs_hum");
-				debug(mystring);
-			#endif
-
-                        sprintf(mystring, "%g", windSpeed);
-                        pubmsg.payload = mystring; 
-                        pubmsg.payloadlen = strlen(mystring);
-                        MQTTClient_publishMessage(client, TOPIC_windspeed, &pubmsg, &token);
-                        rc = MQTTClient_waitForCompletion(client, token, TIMEOUT);
-                        #ifdef DEBUG
-				debug("Message with delivery:windspeed");
-				debug(mystring);
-			#endif
-
-
-                        sprintf(mystring, "%g", rainFall);
-                        pubmsg.payload = mystring; 
-                        pubmsg.payloadlen = strlen(mystring);
-                        MQTTClient_publishMessage(client, TOPIC_rain, &pubmsg, &token);
-                        rc = MQTTClient_waitForCompletion(client, token, TIMEOUT);
-                        #ifdef DEBUG
-				debug("Message with delivery:rain");
-				debug(mystring);
-			#endif
-
-
-    			MQTTClient_disconnect(client, 10000);
-			MQTTClient_destroy(&client);
+	if (use && use != &workers[SENSOR_BMP085]) {
+		bmp085_failovers++;
+		if (!failed_over)
+			log_warn("bmp085 has no reading, publishing %s's", use->name);
+		failed_over = 1;
+	} else if (failed_over && use) {
+		log_info("bmp085 is back");
+		failed_over = 0;
+	}
+	return use;
+}
+
+// The latest good sample from every sensor into readings.  A sensor that
+// is stale, failed its last read or hasn't reported on this tick has its
+// channels flagged and keeps its previous values, unless it's the BMP085
+// and a backup has a reading.
+void sensors_apply(unsigned int pending)
+{
+	struct worker *w;
+	int i;
+
+	for (i = 0; i < SENSOR_COUNT; i++) {
+		w = &workers[i];
+		if (i == SENSOR_BMP085 && bmp085_count > 1 && (w = bmp085_check(pending)) == NULL)
+			w = &workers[i];
+		if (w->last.ts_ns) {
+			switch (i) {
+			case SENSOR_ADC:
+				readings.value[CH_UVI] = w->last.value[0];
+				readings.value[CH_LIGHT] = w->last.value[1];
+				break;
+			case SENSOR_BMP085:
+				readings.value[CH_TEMPERATURE] = w->last.value[0];
+				readings.value[CH_PRESSURE] = w->last.value[1];
+				break;
+			case SENSOR_DHT22:
+				readings.dht_temperature = w->last.value[0];
+				readings.dht_humidity = w->last.value[1];
+				break;
 			}
+		}
+		if (w == &workers[i] && !sensor_fresh(i, pending))
+			readings.stale |= sensor_channels[i];
+	}
+}
+
+// Waits for the sensors due on this tick, then publishes
+enum { PUBLISH_IDLE, PUBLISH_WAITING };
 
+void task_publish(struct sched_task *task)
+{
+	static unsigned long late_reported;
+	struct timespec t0;
+	unsigned int pending;
+	int64_t last = 0;
+	int failed = 0;
+	int ch, moved, i;
+	int rc;
+
+	if (task->state == PUBLISH_IDLE)
+		readings.ts = sched_time();
+
+	pending = sensors_pending(readings.ts);
+	if (pending && sched_elapsed_ms(&task->started) < ACQ_TIMEOUT_MS) {
+		task->state = PUBLISH_WAITING;
+		sched_defer(task, ACQ_POLL_MS);
+		return;
 	}
-	return 0;
+	for (i = 0; i < sensor_count; i++) {
+		if (pending & (1u << i))
+			log_warn("publishing without %s, it hasn't reported", workers[i].name);
+		else if (workers[i].last_ns > last)
+			last = workers[i].last_ns;
+	}
+	if (last >= (int64_t)readings.ts * 1000000000) {
+		acq_last_ms = (last - (int64_t)readings.ts * 1000000000) / 1e6;
+		hist_record_ms(&hist_acquisition, acq_last_ms);
+		log_debug("acquisition %.1f ms", acq_last_ms);
+	}
+	sensors_apply(pending);
+
+	float t = readings.dht_temperature;
+	float h = readings.dht_humidity;
+	readings.value[CH_DEWPOINT] = calculate_dew_point(t, h);
+	readings.value[CH_ABS_HUM] = absolute_humidity(t, h);
+
+	// A failed sensor's channels keep their last output without going
+	// through the filter again
+	readings.valid = 0;
+	for (ch = 0; ch < CH_COUNT; ch++) {
+		if (readings.stale & (1u << ch))
+			readings.value[ch] = filters[ch].out;
+		else if (filter_apply(ch, &readings.value[ch]))
+			readings.valid |= 1u << ch;
+		if (!(readings.valid & (1u << ch)))
+			log_info("%s not valid", channels[ch].name);
+	}
+	readings.stale = 0;
+
+	log_debug("send data to openhab");
+
+	sched_gettime(CLOCK_MONOTONIC, &t0);
+	if (store_append(&history, readings.ts, readings.value) < 0)
+		log_warn("Unable to write history");
+	if (history.late != late_reported)
+		log_warn("%lu samples dropped from history, stamped in months already packed; is the clock right?",
+			 history.late - late_reported);
+	late_reported = history.late;
+	hist_record_ms(&hist_store, sched_elapsed_ms(&t0));
+	rollup_add(&rollups, readings.ts, readings.value);
+
+	publisher_begin_cycle(&pub);
+	if (payload_mode == PAYLOAD_TOPICS) {
+		for (ch = 0; ch < CH_COUNT; ch++) {
+			float v = readings.value[ch];
+			if (!(readings.valid & (1u << ch)))
+				continue;               // a topic can't say the value is suspect
+			if (!deadband_check(ch, v, readings.ts))
+				deadband_skip(ch);
+			else if (publish_reading(channels[ch].topic, v, channels[ch].decimals) != 0)
+				failed++;
+			else
+				deadband_sent(ch, v, readings.ts);
+		}
+	} else {
+		// One message carries every channel, so it goes if any of them moved
+		for (ch = 0, moved = 0; ch < CH_COUNT; ch++)
+			moved |= deadband_check(ch, readings.value[ch], readings.ts);
+		if (moved && publish_cycle() != 0)
+			failed++;
+		for (ch = 0; ch < CH_COUNT; ch++) {
+			if (!moved)
+				deadband_skip(ch);
+			else if (!failed)
+				deadband_sent(ch, readings.value[ch], readings.ts);
+		}
+	}
+
+	// Collect the acks for everything sent above
+	rc = publisher_flush(&pub, TIMEOUT);
+	hist_record_ms(&hist_mqtt_acks, pub.last_cycle_ms);
+	if (rc > 0)
+		log_warn("%d messages not acknowledged", rc);
+
+	// Keep the cycle for the backlog rather than lose it
+	if (failed || rc > 0) {
+		outbox_push(&outbox, readings.ts, readings.value, readings.valid);
+		outbox_sync(&outbox);
+	}
+	log_debug("publish cycle %.1f ms, %d unacked", pub.last_cycle_ms, rc);
+	if (deadband_enabled && log_enabled(LOG_DEBUG)) {
+		unsigned long sent, suppressed;
+		deadband_totals(&sent, &suppressed);
+		log_debug("deadband %lu sent, %lu held back", sent, suppressed);
+	}
+}
+
+// Backlog batches are sent one at a time and only leave the outbox once
+// the broker has acknowledged them
+static int send_backlog(void *ctx, const char *payload)
+{
+	publisher_begin_cycle(&pub);
+	if (publisher_send(&pub, TOPIC_backlog, payload, TIMEOUT) != 0)
+		return -1;
+	return publisher_flush(&pub, OUTBOX_ACK_TIMEOUT) == 0 ? 0 : -1;
+}
+
+void task_outbox(struct sched_task *task)
+{
+	int n;
+
+	if (outbox_count(&outbox) == 0 || !pub.connected)
+		return;                         // the publish task does the reconnecting
+	n = outbox_drain(&outbox, sched_time(), send_backlog, NULL);
+	if (n > 0) {
+		outbox_sync(&outbox);
+		if (outbox_count(&outbox) == 0)
+			log_info("backlog sent, %llu readings dropped while queued", (unsigned long long)outbox.s->dropped);
+	}
+}
+
+//=======================================================================
+// Metrics.  Every task's cycles plus the stages inside them, and the
+// counters the modules keep.  Collected on the main thread, which owns
+// most of them; what the sensor workers and interrupt threads keep is
+// atomic, or copied out atomically like adc_quality, and the publisher's,
+// the store's and the query server's counters are read under their locks.
+// /metrics is served by a query worker from a copy taken every second in
+// task_pulses(), so it never reads them itself.
+
+#define STAGES_MAX      (TASK_COUNT + HAL_BMP085_MAX - 1 + 4)
+
+struct {
+	pthread_mutex_t lock;
+	struct metric_stage stage[STAGES_MAX];
+	struct metric metric[METRICS_MAX];
+	int stages;
+	int metrics;
+} metrics_copy = { PTHREAD_MUTEX_INITIALIZER };
+
+int collect_stages(struct metric_stage *s)
+{
+	int n = 0;
+	int i;
+
+	for (i = 0; i < TASK_COUNT; i++)
+		s[n++] = (struct metric_stage){ tasks[i].name, &tasks[i].latency };
+	for (i = SENSOR_COUNT; i < sensor_count; i++)
+		s[n++] = (struct metric_stage){ workers[i].task->name, &workers[i].task->latency };
+	s[n++] = (struct metric_stage){ "acquisition", &hist_acquisition };
+	s[n++] = (struct metric_stage){ "adc_scan", &hist_adc_scan };
+	s[n++] = (struct metric_stage){ "store", &hist_store };
+	s[n++] = (struct metric_stage){ "mqtt_acks", &hist_mqtt_acks };
+	return n;
+}
+
+static const char *adc_names[MCP3008_CHANNELS] = { "0", "1", "2", "3", "4", "5", "6", "7" };
+
+#define COUNTER(name, help, v)                  m[n++] = (struct metric){ name, help, NULL, NULL, v, 0 }
+#define COUNTER_BY(name, help, l, lv, v)        m[n++] = (struct metric){ name, help, l, lv, v, 0 }
+#define GAUGE(name, help, v)                    m[n++] = (struct metric){ name, help, NULL, NULL, v, 1 }
+#define GAUGE_BY(name, help, l, lv, v)          m[n++] = (struct metric){ name, help, l, lv, v, 1 }
+
+int collect_metrics(struct metric *m)
+{
+	struct pulse_source *src[2] = { &rain, &wind };
+	unsigned long sent, suppressed, errors;
+	unsigned long mqtt[6], store[4], queries[3];
+	unsigned int adc_mask = atomic_load_explicit(&adc_quality.mask, memory_order_acquire);
+	int n = 0;
+	int i, ch;
+
+	for (i = 0; i < TASK_COUNT; i++)
+		COUNTER_BY("sched_missed", "Task periods skipped because the last cycle was still running.", "task", tasks[i].name, atomic_load(&tasks[i].missed));
+	for (i = SENSOR_COUNT; i < sensor_count; i++)
+		COUNTER_BY("sched_missed", "Task periods skipped because the last cycle was still running.", "task", workers[i].task->name, atomic_load(&workers[i].task->missed));
+	for (i = 0; i < TASK_COUNT; i++)
+		COUNTER_BY("sched_overruns", "Task cycles longer than their deadline.", "task", tasks[i].name, atomic_load(&tasks[i].overruns));
+	for (i = SENSOR_COUNT; i < sensor_count; i++)
+		COUNTER_BY("sched_overruns", "Task cycles longer than their deadline.", "task", workers[i].task->name, atomic_load(&workers[i].task->overruns));
+
+	for (i = 0; i < sensor_count; i++)
+		COUNTER_BY("sensor_samples", "Samples handed over by the sensor workers.", "sensor", workers[i].name, workers[i].samples);
+	for (i = 0; i < sensor_count; i++)
+		COUNTER_BY("sensor_failures", "Sensor reads that failed.", "sensor", workers[i].name, workers[i].failures);
+	for (i = 0; i < sensor_count; i++)
+		COUNTER_BY("sensor_dropped", "Samples lost to a full worker ring.", "sensor", workers[i].name, atomic_load(&workers[i].ring.dropped));
+	for (i = 0; i < sensor_count; i++)
+		COUNTER_BY("sensor_stalls", "Times the watchdog found a sensor stale.", "sensor", workers[i].name, workers[i].stalls);
+	for (i = 0; i < sensor_count; i++)
+		COUNTER_BY("sensor_recoveries", "Stale sensors that came back.", "sensor", workers[i].name, workers[i].recoveries);
+	for (i = 0; i < sensor_count; i++)
+		GAUGE_BY("sensor_stale", "1 while the watchdog has a sensor marked stale.", "sensor", workers[i].name, workers[i].stale);
+	for (i = 0, errors = 0; i < bmp085_count; i++)
+		errors += atomic_load(&bmp085[i].errors);
+	COUNTER("i2c_errors", "BMP085 opens and conversions that failed.", errors);
+	if (bmp085_count > 1) {
+		for (i = 0; i < bmp085_count; i++)
+			GAUGE_BY("bmp085_pressure", "Latest good pressure from each BMP085, Pa.", "sensor",
+				 bmp085[i].name, workers[BMP085_SENSOR(i)].last.value[1]);
+		GAUGE("bmp085_spread", "Pa between the highest and lowest BMP085 pressure.", bmp085_spread);
+		COUNTER("bmp085_disagreements", "Cycles with the BMP085s further apart than BMP085_SPREAD_PA.", bmp085_disagreements);
+		COUNTER("bmp085_failovers", "Cycles published from a backup BMP085.", bmp085_failovers);
+	}
+	COUNTER("adc_errors", "MCP3008 scans that failed.", atomic_load(&adc_errors));
+	COUNTER("dht22_reads", "DHT22 samples attempted.", atomic_load(&dht22_stats.reads));
+	COUNTER("dht22_retries", "DHT22 frames read again after a bad one.", atomic_load(&dht22_stats.retries));
+	COUNTER("dht22_failures", "DHT22 samples given up on.", atomic_load(&dht22_stats.failures));
+
+	for (i = 0; i < 2; i++)
+		COUNTER_BY("pulse_edges", "Edges queued by the interrupt handlers.", "source", src[i]->name, src[i]->edges + atomic_load(&src[i]->ring.dropped));
+	for (i = 0; i < 2; i++)
+		COUNTER_BY("pulse_dropped", "Edges lost to a full ring.", "source", src[i]->name, atomic_load(&src[i]->ring.dropped));
+	for (i = 0; i < 2; i++)
+		COUNTER_BY("pulse_bounces", "Edges discarded by the debounce.", "source", src[i]->name, src[i]->bounces);
+	for (i = 0; i < 2; i++)
+		COUNTER_BY("pulses", "Debounced pulses.", "source", src[i]->name, src[i]->count);
+
+	pthread_mutex_lock(&pub.lock);          // the paho thread updates them too
+	mqtt[0] = pub.sent;
+	mqtt[1] = pub.acked;
+	mqtt[2] = pub.failed;
+	mqtt[3] = pub.lost;
+	mqtt[4] = pub.reconnects;
+	mqtt[5] = pub.connected;
+	pthread_mutex_unlock(&pub.lock);
+	COUNTER("mqtt_sent", "MQTT messages handed to the client.", mqtt[0]);
+	COUNTER("mqtt_acked", "MQTT messages acknowledged by the broker.", mqtt[1]);
+	COUNTER("mqtt_publish_failures", "MQTT publishes that failed.", mqtt[2]);
+	COUNTER("mqtt_lost", "MQTT messages in flight when the connection dropped.", mqtt[3]);
+	COUNTER("mqtt_connects", "Successful connections to the broker.", mqtt[4]);
+	GAUGE("mqtt_connected", "1 while connected to the broker.", mqtt[5]);
+	deadband_totals(&sent, &suppressed);
+	COUNTER("deadband_sent", "Channel values published.", sent);
+	COUNTER("deadband_suppressed", "Channel values held back by the deadband.", suppressed);
+
+	COUNTER("outbox_queued", "Cycles queued for the backlog.", outbox.s->queued);
+	COUNTER("outbox_sent", "Queued cycles delivered.", outbox.s->sent);
+	COUNTER("outbox_dropped", "Queued cycles dropped, full or too old.", outbox.s->dropped);
+	GAUGE("outbox_pending", "Cycles waiting in the backlog.", outbox_count(&outbox));
+
+	pthread_mutex_lock(&history.lock);
+	store[0] = history.appended;
+	store[1] = history.writes;
+	store[2] = history.errors;
+	store[3] = history.late;
+	pthread_mutex_unlock(&history.lock);
+	COUNTER("store_appended", "Samples added to the history.", store[0]);
+	COUNTER("store_writes", "History batch writes.", store[1]);
+	COUNTER("store_errors", "History writes that failed.", store[2]);
+	COUNTER("store_late", "Samples dropped, stamped in a month already packed.", store[3]);
+	pthread_mutex_lock(&query.lock);
+	queries[0] = query.requests;
+	queries[1] = query.errors;
+	queries[2] = query.rejected;
+	pthread_mutex_unlock(&query.lock);
+	COUNTER("query_requests", "Query server requests.", queries[0]);
+	COUNTER("query_errors", "Query server requests that failed.", queries[1]);
+	COUNTER("query_rejected", "Query connections turned away with the queue full.", queries[2]);
+	COUNTER("log_dropped", "Log records lost to a full ring.", atomic_load(&logger.dropped));
+
+	for (ch = 0; ch < CH_COUNT; ch++)
+		COUNTER_BY("filter_rejected", "Readings outside the plausibility bounds.", "channel", channels[ch].name, filters[ch].rejected);
+	for (ch = 0; ch < CH_COUNT; ch++)
+		COUNTER_BY("filter_outliers", "Readings replaced by the hampel filter.", "channel", channels[ch].name, filters[ch].outliers);
+
+	for (ch = 0; ch < MCP3008_CHANNELS; ch++)
+		if (adc_mask & (1 << ch))
+			GAUGE_BY("adc_nominal_bits", "Resolution the last oversampled window should reach if its noise dithers the ADC.", "channel", adc_names[ch],
+				 atomic_load_explicit(&adc_quality.bits[ch], memory_order_relaxed));
+	for (ch = 0; ch < MCP3008_CHANNELS; ch++)
+		if (adc_mask & (1 << ch))
+			GAUGE_BY("adc_variance", "Variance of the last oversampled window, LSB^2.", "channel", adc_names[ch],
+				 atomic_load_explicit(&adc_quality.variance[ch], memory_order_relaxed));
+	return n;
+}
+
+// Main thread.  Refresh the copy /metrics is served from.
+void metrics_update(void)
+{
+	struct metric_stage s[STAGES_MAX];
+	struct metric m[METRICS_MAX];
+	int ns = collect_stages(s);
+	int nm = collect_metrics(m);
+
+	pthread_mutex_lock(&metrics_copy.lock);
+	memcpy(metrics_copy.stage, s, ns * sizeof(s[0]));
+	memcpy(metrics_copy.metric, m, nm * sizeof(m[0]));
+	metrics_copy.stages = ns;
+	metrics_copy.metrics = nm;
+	pthread_mutex_unlock(&metrics_copy.lock);
+}
+
+// Prometheus text for the query server, from the last copy
+void write_metrics(FILE *f, void *ctx)
+{
+	pthread_mutex_lock(&metrics_copy.lock);
+	metrics_prometheus(f, metrics_copy.stage, metrics_copy.stages, metrics_copy.metric, metrics_copy.metrics);
+	pthread_mutex_unlock(&metrics_copy.lock);
 }
 
+// The same as JSON on TOPIC_stats
+void task_stats(struct sched_task *task)
+{
+	struct metric_stage s[STAGES_MAX];
+	struct metric m[METRICS_MAX];
+	FILE *f = fmemopen(stats_payload, sizeof(stats_payload), "w");
+	long len;
+
+	if (f == NULL)
+		return;
+	metrics_json(f, sched_time(), s, collect_stages(s), m, collect_metrics(m));
+	len = ftell(f);
+	fclose(f);
+	if (len >= (long)sizeof(stats_payload) - 1) {
+		log_warn("stats message too long");
+		return;
+	}
+	publisher_begin_cycle(&pub);
+	if (publisher_publish(&pub, TOPIC_stats, stats_payload, len, TIMEOUT) == 0)
+		publisher_flush(&pub, TIMEOUT);
+}
+
+struct sched_task tasks[TASK_COUNT] = {
+	[TASK_ADC]      = { .name = "adc",      .run = task_adc,      .period = SAMPLE_PERIOD, .deadline_ms = 1000 },
+	[TASK_BMP085]   = { .name = "bmp085",   .run = task_bmp085,   .period = SAMPLE_PERIOD, .deadline_ms = 1000, .data = &bmp085[0] },
+	[TASK_DHT22]    = { .name = "dht22",    .run = task_dht22,    .period = SAMPLE_PERIOD, .deadline_ms = DHT22_DEADLINE_MS + 1000 },
+	[TASK_PULSES]   = { .name = "pulses",   .run = task_pulses,   .period = PULSE_PERIOD,  .deadline_ms = 100 },
+	[TASK_COUNTERS] = { .name = "counters", .run = task_counters, .period = SAMPLE_PERIOD, .deadline_ms = 100 },
+	[TASK_PUBLISH]  = { .name = "publish",  .run = task_publish,  .period = SAMPLE_PERIOD, .deadline_ms = ACQ_TIMEOUT_MS + TIMEOUT },
+	[TASK_OUTBOX]   = { .name = "outbox",   .run = task_outbox,   .period = PULSE_PERIOD,  .deadline_ms = OUTBOX_ACK_TIMEOUT },
+	[TASK_STATS]    = { .name = "stats",    .run = task_stats,    .period = STATS_INTERVAL, .deadline_ms = TIMEOUT },
+};
+
+//=======================================================================
+int main(int argc, char **argv)
+{
+	int result;
+	struct sched sched;
+	struct timespec wall, now;		//how long a virtual run took
+	int64_t started_ns;
+	int history_ok = 1;
+	unsigned int i;
+
+	int opt = 0;
+        int longIndex = 0;
+
+	oversample_init(&adc_window);
+	filter_init();
+	hal.adc_channels = ADC_CHANNELS;
+
+        opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
+        while( opt != -1 ) {
+                switch (opt) {
+                        case 'v':
+                                printf("Version 1.4\n");
+                                exit(0);
+                        case 'g':                       // mcp3008 GPIO backend
+                                if (gpio_select(optarg) != 0) {
+                                        printf("Unknown or unavailable GPIO backend %s\n", optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                break;
+                        case 'a':                       // mcp3008 on hardware SPI
+                                hal.adc_use_spi = 1;
+                                break;
+                        case 'c':
+                                if ((result = parse_channels(optarg)) <= 0) {
+                                        printf("Bad channel list %s\n", optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                hal.adc_channels = result | ADC_CHANNELS;
+                                break;
+                        case 's':                       // where state survives restarts
+                                state_dir = optarg;
+                                break;
+                        case 'f':                       // seconds between history writes
+                                fsync_interval = atoi(optarg);
+                                break;
+                        case 'q':                       // history queries, Unix socket
+                                query_socket = optarg;
+                                break;
+                        case 'p':                       // and HTTP on 127.0.0.1
+                                http_port = atoi(optarg);
+                                break;
+                        case 'm':                       // seconds a missed reading is kept
+                                outbox_max_age = atoi(optarg);
+                                break;
+                        case 'r':                       // backlog messages a second
+                                drain_rate = atoi(optarg);
+                                break;
+                        case 'P':                       // topics, json or cbor
+                                if ((payload_mode = payload_parse_mode(optarg)) < 0) {
+                                        printf("Unknown payload mode %s\n", optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                break;
+                        case 'd':                       // publish on change only
+                                if (deadband_parse(optarg) != 0) {
+                                        printf("Bad deadband %s\n", optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                break;
+                        case 'H':                       // longest silence per channel
+                                deadband_heartbeat = atoi(optarg);
+                                break;
+                        case 'o':                       // mcp3008 scans per reading
+                                adc_window.n = atoi(optarg);
+                                break;
+                        case 'R':                       // scans a second
+                                adc_window.rate = atoi(optarg);
+                                break;
+                        case 'F':                       // mean, median or trim[=pct]
+                                if (oversample_parse_filter(&adc_window, optarg) != 0) {
+                                        printf("Unknown ADC filter %s\n", optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                break;
+                        case 'L':                       // channel=none, median, hampel or kalman
+                                if (filter_parse(optarg) != 0) {
+                                        printf("Bad filter %s\n", optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                break;
+                        case 'b':                       // channel=lo:hi
+                                if (filter_parse_bounds(optarg) != 0) {
+                                        printf("Bad bounds %s\n", optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                break;
+                        case 'w':                       // real, sim[:opts] or replay:FILE
+                                if (hal_select(optarg) != 0) {
+                                        printf("Unknown hardware backend %s\n", optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                break;
+                        case 'k':                       // raw samples to FILE
+                                record_file = optarg;
+                                break;
+                        case 'B':                       // tcp://host:port
+                                broker = optarg;
+                                break;
+                        case 'S':                       // seconds between stats messages, 0 for none
+                                stats_interval = atoi(optarg);
+                                break;
+                        case 'l':                       // log file
+                                log_file = optarg;
+                                break;
+                        case 'V':                       // error, warn, info or debug
+                                if ((result = log_parse_level(optarg)) < 0) {
+                                        printf("Unknown log level %s\n", optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                atomic_store(&log_level, result);
+                                break;
+                        case 'z':                       // bytes before the log is rotated
+                                log_size = atol(optarg);
+                                break;
+                        case 'i':                       // bus[:address[:oss]], again for more
+                                if (parse_bmp085(optarg) != 0) {
+                                        printf("Bad BMP085 %s\n", optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                break;
+                        case 'I':                       // sensor=seconds,...
+                                if (parse_sensor_periods(optarg, tasks, SENSOR_COUNT) != 0) {
+                                        printf("Bad sensor periods %s\n", optarg);
+                                        exit(EXIT_FAILURE);
+                                }
+                                break;
+                        default:
+                                exit(0);
+                }
+                opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
+        }
+
+	deadband_init();
+
+	// The window has to close before publish stops waiting for it
+	if (adc_window.n < 1 || adc_window.n > OVERSAMPLE_MAX || adc_window.rate < 1 || adc_window.rate > 1000 ||
+	    adc_window.n * oversample_interval_ms(&adc_window) > ACQ_TIMEOUT_MS - 1000) {
+		printf("ADC oversampling needs 1-%d scans at 1-1000 Hz, done within %d ms\n", OVERSAMPLE_MAX, ACQ_TIMEOUT_MS - 1000);
+		exit(EXIT_FAILURE);
+	}
+	tasks[TASK_ADC].deadline_ms = adc_window.n * oversample_interval_ms(&adc_window) + 1000;
+
+	if (log_open(log_file, log_size) != 0)
+		printf("Unable to open %s, only warnings and errors will be shown\n", log_file);
+	log_info("Program Startup, version 1.4, log level %s", log_levels[atomic_load(&log_level)]);
+
+	//Setup the hardware, or its stand-in, and the interrupts
+	hal.rain = &rain;
+	hal.wind = &wind;
+	hal.rain_isr = rainInterrupt;
+	hal.wind_isr = windInterrupt;
+	hal.rain_pin = RAIN_PIN;
+	hal.wind_pin = WIND_PIN;
+	hal.dht22_pin = DHT22_PIN;
+	if (hal_open(record_file) != 0) {
+		log_error("Unable to open the %s hardware backend, quitting", hal.backend ? hal.backend->name : HAL_DEFAULT_BACKEND);
+		log_close();
+		return 0;
+	}
+
+	//Setup MQTT.  The client lives for the whole run and reconnects by itself
+	if (publisher_init(&pub, broker, CLIENTID, QOS) != MQTTCLIENT_SUCCESS)
+	{
+		log_error("Failed to create MQTT client");
+		log_close();
+		exit(EXIT_FAILURE);
+	}
+	if (publisher_connect(&pub) != 0)
+		log_warn("Failed to connect to %s, will retry", broker);
+
+	log_info("Setup MQTT Complete");
+
+	wind_init(&wind_stats, pulse_now_ns() / 1000000000ULL);
+
+	char path[256];
+	mkdir(state_dir, 0755);
+	snprintf(path, sizeof(path), "%s/%s", state_dir, RAIN_STATE_FILE);
+	if (rain_open(&rain_totals, path, RAIN_CALIBRATION) != 0)
+		log_warn("Unable to map %s, rain totals will not survive a restart", path);
+	snprintf(path, sizeof(path), "%s/%s", state_dir, OUTBOX_FILE);
+	if (outbox_open(&outbox, path, outbox_max_age, drain_rate) != 0)
+		log_warn("Unable to map %s, the backlog will not survive a restart", path);
+	else if (outbox_count(&outbox) > 0)
+		log_info("%u readings waiting in the backlog", outbox_count(&outbox));
+	snprintf(path, sizeof(path), "%s/%s", state_dir, HISTORY_DIR);
+	if (store_open(&history, path, fsync_interval) != 0) {
+		log_warn("Unable to create %s", path);
+		history_ok = 0;
+	} else if (rollup_open(&rollups, &history) != 0)
+		log_warn("Unable to open rollups in %s", path);
+
+	// Metrics are served whether or not there is any history
+	snprintf(path, sizeof(path), "%s/%s", state_dir, QUERY_SOCKET_NAME);
+	if (query_start(&query, history_ok ? &history : NULL, history_ok ? &rollups : NULL,
+			query_socket ? query_socket : path, http_port, write_metrics, NULL) != 0)
+		log_warn("Unable to start the query server");
+	metrics_update();
+
+	readings.dht_temperature = NAN;
+	readings.dht_humidity = NAN;
+
+	//Setup the task timers and sleep until they fire
+	if (sched_init(&sched) != 0) {
+		log_error("Unable to create epoll instance");
+		log_close();
+		exit(EXIT_FAILURE);
+	}
+	tasks[TASK_STATS].period = stats_interval;
+	for (i = 1; i < (unsigned int)bmp085_count; i++) {
+		bmp085_tasks[i - 1] = tasks[TASK_BMP085];       // its --sensor-period too
+		bmp085_tasks[i - 1].name = bmp085[i].name;
+		bmp085_tasks[i - 1].data = &bmp085[i];
+	}
+	for (i = 0; i < TASK_COUNT; i++) {
+		if (i == TASK_STATS && stats_interval <= 0)
+			break;                          // last, so the indexes still match
+		if (i < SENSOR_COUNT ? worker_start(&workers[i], &tasks[i], &sched) != 0 : sched_add(&sched, &tasks[i]) != 0) {
+			log_error("Unable to schedule %s", tasks[i].name);
+			log_close();
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 1; i < (unsigned int)bmp085_count; i++) {
+		workers[sensor_count].name = bmp085[i].name;
+		workers[sensor_count].reset = bmp085_reset;
+		if (worker_start(&workers[sensor_count], &bmp085_tasks[i - 1], &sched) != 0) {
+			log_error("Unable to schedule %s", bmp085[i].name);
+			log_close();
+			exit(EXIT_FAILURE);
+		}
+		sensor_count++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	started_ns = sched_now_ns;
+	sched_run(&sched);
+
+	// Only a simulation or a replay comes back
+	store_flush(&history);
+	rain_sync(&rain_totals);
+	outbox_sync(&outbox);
+	hal_close();
+	log_close();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	printf("%s: %.0f s of readings in %.1f s\n", hal.backend->name, (sched_now_ns - started_ns) / 1e9,
+	       (now.tv_sec - wall.tv_sec) + (now.tv_nsec - wall.tv_nsec) / 1e9);
+	return 0;
+}
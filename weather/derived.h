@@ -0,0 +1,34 @@
+/*
+Derived humidity metrics
+
+Dew point by the Magnus formula and absolute humidity in g/m^3, from the
+DHT22's temperature (C) and relative humidity (%).
+*/
+
+#ifndef DERIVED_H
+#define DERIVED_H
+
+#include <math.h>
+
+//=======================================================================
+float calculate_dew_point(float temp, float rel_humidity)
+{
+  float a = 17.27;
+  float b = 237.7;
+  float dp;
+  float gamma = ((a * temp)/(b+temp)) + log(rel_humidity/100.0);
+  if(a == gamma)
+    dp = 0;
+  else
+    dp= (b*gamma)/(a-gamma);
+  return dp;
+}
+
+//=======================================================================
+float absolute_humidity(float temp, float rh)
+{
+  float abs_hum = ((6.112 * exp((17.67 * temp)/(temp + 243.5)) * 2.164 * rh) / (273.15 + temp));
+  return abs_hum;
+}
+
+#endif
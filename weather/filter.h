@@ -0,0 +1,273 @@
+/*
+Per channel filters
+
+Runs on every channel between acquisition and publishing.  A value first
+has to fall inside the channel's plausibility bounds; one that doesn't is
+rejected, and the channel keeps its last output.  What passes goes through
+the channel's filter:
+
+  none          as read
+  median        median of the last FILTER_WINDOW values
+  hampel        as read unless it is more than FILTER_HAMPEL_K scaled
+                MADs from the window median, then the median instead
+  kalman        scalar Kalman smoother on a random walk, q the process and
+                r the measurement variance
+
+  --filter pressure=kalman:0.5:25       q and r optional
+  --filter temperature=none
+  --bounds light=0:1000
+
+The window is a ring in arrival order plus the same values kept sorted,
+so a new value costs a binary search and a short memmove, and the MAD is
+read off the sorted window by merging outwards from the median.  Memory is
+fixed per channel.
+
+filter_apply() returns whether the value read was accepted.  A channel is
+published as valid only if it was, and its sensor didn't fail this cycle.
+*/
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "../readings.h"
+
+#define FILTER_WINDOW           7               // odd
+#define FILTER_HAMPEL_K         3.0
+
+enum filter_kind { FILTER_NONE, FILTER_MEDIAN, FILTER_HAMPEL, FILTER_KALMAN };
+
+static const char *filter_kinds[] = { "none", "median", "hampel", "kalman", NULL };
+
+struct filter {
+	int kind;
+	float lo, hi;                           // plausibility bounds
+	float q, r;                             // kalman variances
+
+	float ring[FILTER_WINDOW];              // arrival order
+	float sorted[FILTER_WINDOW];
+	int count;
+	int next;
+
+	float x, p;                             // kalman estimate and its variance
+	float out;                              // last output, NAN before the first
+
+	unsigned long rejected;                 // out of bounds
+	unsigned long outliers;                 // replaced by hampel
+};
+
+struct filter filters[CH_COUNT];
+
+// Defaults: the sensors' ranges, and hampel on the I2C and one-wire
+// sensors, which are the ones that glitch
+static const struct { int kind; float lo, hi; } filter_defaults[CH_COUNT] = {
+	[CH_TEMPERATURE]   = { FILTER_HAMPEL, -40, 85 },        // BMP085 operating range
+	[CH_DEWPOINT]      = { FILTER_HAMPEL, -60, 60 },
+	[CH_PRESSURE]      = { FILTER_HAMPEL, 30000, 110000 },  // Pa
+	[CH_LIGHT]         = { FILTER_NONE, 0, 1000 },
+	[CH_UVI]           = { FILTER_NONE, 0, 20 },
+	[CH_ABS_HUM]       = { FILTER_HAMPEL, 0, 100 },         // g/m3
+	[CH_WINDSPEED]     = { FILTER_NONE, 0, 250 },           // km/h
+	[CH_WINDSPEED_10M] = { FILTER_NONE, 0, 250 },
+	[CH_WINDGUST]      = { FILTER_NONE, 0, 300 },
+	[CH_WINDLULL]      = { FILTER_NONE, 0, 250 },
+	[CH_RAIN]          = { FILTER_NONE, 0, 1000 },          // mm
+	[CH_RAIN_1H]       = { FILTER_NONE, 0, 500 },
+	[CH_RAIN_24H]      = { FILTER_NONE, 0, 1000 },
+	[CH_RAIN_RATE]     = { FILTER_NONE, 0, 2000 },          // mm/h
+};
+
+void filter_init(void)
+{
+	int c;
+
+	for (c = 0; c < CH_COUNT; c++) {
+		filters[c].kind = filter_defaults[c].kind;
+		filters[c].lo = filter_defaults[c].lo;
+		filters[c].hi = filter_defaults[c].hi;
+		filters[c].out = NAN;
+	}
+}
+
+static int filter_channel(const char *spec, const char **rest)
+{
+	const char *eq = strchr(spec, '=');
+	int c;
+
+	if (eq == NULL)
+		return -1;
+	for (c = 0; c < CH_COUNT; c++) {
+		if (strlen(channels[c].name) == (size_t)(eq - spec) && strncmp(spec, channels[c].name, eq - spec) == 0) {
+			*rest = eq + 1;
+			return c;
+		}
+	}
+	return -1;
+}
+
+// "name=kind" or "name=kalman:q:r".  Call after filter_init().
+int filter_parse(const char *spec)
+{
+	const char *arg;
+	char *end;
+	size_t len;
+	int c, k;
+
+	if ((c = filter_channel(spec, &arg)) < 0)
+		return -1;
+	len = strcspn(arg, ":");
+	for (k = 0; filter_kinds[k]; k++) {
+		if (strlen(filter_kinds[k]) == len && strncmp(arg, filter_kinds[k], len) == 0)
+			break;
+	}
+	if (filter_kinds[k] == NULL || (arg[len] && k != FILTER_KALMAN))
+		return -1;
+	filters[c].kind = k;
+	if (arg[len]) {
+		filters[c].q = strtof(arg + len + 1, &end);
+		if (*end != ':' || filters[c].q <= 0)
+			return -1;
+		filters[c].r = strtof(end + 1, &end);
+		if (*end || filters[c].r <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+// "name=lo:hi"
+int filter_parse_bounds(const char *spec)
+{
+	const char *arg;
+	char *end;
+	int c;
+
+	if ((c = filter_channel(spec, &arg)) < 0)
+		return -1;
+	filters[c].lo = strtof(arg, &end);
+	if (end == arg || *end != ':')
+		return -1;
+	arg = end + 1;
+	filters[c].hi = strtof(arg, &end);
+	if (end == arg || *end || filters[c].hi < filters[c].lo)
+		return -1;
+	return 0;
+}
+
+// First index in the sorted window not less than v
+static int filter_search(const struct filter *f, float v)
+{
+	int lo = 0, hi = f->count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (f->sorted[mid] < v)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void filter_push(struct filter *f, float v)
+{
+	int i;
+
+	if (f->count == FILTER_WINDOW) {
+		i = filter_search(f, f->ring[f->next]);         // drop the oldest
+		memmove(&f->sorted[i], &f->sorted[i + 1], (f->count - i - 1) * sizeof(float));
+		f->count--;
+	}
+	i = filter_search(f, v);
+	memmove(&f->sorted[i + 1], &f->sorted[i], (f->count - i) * sizeof(float));
+	f->sorted[i] = v;
+	f->count++;
+	f->ring[f->next] = v;
+	f->next = (f->next + 1) % FILTER_WINDOW;
+}
+
+static float filter_median(const struct filter *f)
+{
+	int m = f->count / 2;
+
+	return f->count % 2 ? f->sorted[m] : (f->sorted[m - 1] + f->sorted[m]) / 2;
+}
+
+// Median absolute deviation.  Deviations grow going out from the median on
+// either side, so the k-th smallest comes from merging the two runs.
+static float filter_mad(const struct filter *f, float median)
+{
+	int m = f->count / 2, want = f->count / 2;
+	int left = m - 1, right = m, k = 0;
+	float d = 0;
+
+	if (f->count % 2) {
+		right = m + 1;                  // the median itself, deviation 0
+		k = 1;
+	}
+	for (; k <= want; k++) {
+		if (right >= f->count || (left >= 0 && median - f->sorted[left] <= f->sorted[right] - median))
+			d = median - f->sorted[left--];
+		else
+			d = f->sorted[right++] - median;
+	}
+	return d;
+}
+
+// Filter channel c's value in place.  Returns 1 if the value read was accepted.
+int filter_apply(int c, float *v)
+{
+	struct filter *f = &filters[c];
+	float median, mad, step;
+	int ok = 1;
+
+	if (isnan(*v) || *v < f->lo || *v > f->hi) {
+		if (!isnan(*v))
+			f->rejected++;
+		*v = f->out;
+		return 0;
+	}
+
+	switch (f->kind) {
+	case FILTER_MEDIAN:
+		filter_push(f, *v);
+		*v = filter_median(f);
+		break;
+	case FILTER_HAMPEL:
+		filter_push(f, *v);
+		if (f->count < 3)
+			break;
+		median = filter_median(f);
+		// Quantized readings often sit on one value; don't call a one
+		// step change an outlier
+		step = 1 / powf(10, channels[c].decimals);
+		mad = fmaxf(filter_mad(f, median), step);
+		if (fabsf(*v - median) > FILTER_HAMPEL_K * 1.4826 * mad) {
+			f->outliers++;
+			*v = median;
+			ok = 0;
+		}
+		break;
+	case FILTER_KALMAN:
+		if (f->r == 0) {
+			step = 1 / powf(10, channels[c].decimals);
+			f->r = step * step;
+			f->q = f->r / 10;
+		}
+		if (isnan(f->out)) {
+			f->x = *v;
+			f->p = f->r;
+		} else {
+			f->p += f->q;
+			f->x += f->p / (f->p + f->r) * (*v - f->x);
+			f->p *= f->r / (f->p + f->r);
+		}
+		*v = f->x;
+		break;
+	}
+	f->out = *v;
+	return ok;
+}
+
+#endif
@@ -0,0 +1,172 @@
+/*
+Rain accumulator
+
+Tip times (wall clock seconds) go into a fixed ring.  Each rolling window
+keeps the index of its oldest tip, which moves forward as tips age out, so
+the 10 minute, 1 hour and 24 hour totals are the distance from that index
+to the head and cost nothing to read.  The since-midnight count is reset
+when a tip or a refresh lands on a new local day.
+
+The whole state is one struct in a memory-mapped file, updated in place.
+A restart maps it back and only has to age out tips that expired while we
+were down; nothing is replayed.  The kernel writes the page back on its
+own, rain_sync() pushes it out sooner.
+*/
+
+#ifndef RAIN_H
+#define RAIN_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define RAIN_TIPS               4096            // >1m of rain a day at 0.2794mm a tip
+#define RAIN_STATE_MAGIC        0x4E494152      // "RAIN"
+#define RAIN_STATE_VERSION      1
+
+enum { RAIN_RATE_WINDOW, RAIN_1H, RAIN_24H, RAIN_WINDOWS };
+
+static const int rain_window_secs[RAIN_WINDOWS] = { 600, 3600, 86400 };
+
+struct rain_state {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t head;                          // tips ever pushed, slot is head % RAIN_TIPS
+	uint32_t tail[RAIN_WINDOWS];            // oldest tip still inside each window
+	uint32_t day_tips;
+	int64_t day_start;                      // local midnight day_tips belongs to
+	uint64_t total_tips;
+	int64_t tip[RAIN_TIPS];
+};
+
+struct rain {
+	struct rain_state *s;
+	int mapped;
+	double mm_per_tip;
+};
+
+struct rain_report {
+	float day;                              // since local midnight, mm
+	float hour;
+	float day24;
+	float rate;                             // mm/h over the last 10 minutes
+};
+
+static int64_t rain_midnight(int64_t t)
+{
+	time_t now = t;
+	struct tm tm;
+
+	localtime_r(&now, &tm);
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+// Whether the counters are ones rain_tip() and rain_advance() could have
+// left: every window at most the ring behind the head, plus the tip pushed
+// since it was last advanced, a shorter window never holding more than a
+// longer one, and no more tips today than ever.  Slots are taken modulo
+// RAIN_TIPS, so these are all the indices there are.
+static int rain_state_valid(const struct rain_state *s)
+{
+	uint32_t held = 0;
+	int w;
+
+	if (s->magic != RAIN_STATE_MAGIC || s->version != RAIN_STATE_VERSION)
+		return 0;
+	for (w = 0; w < RAIN_WINDOWS; w++) {
+		if (s->head - s->tail[w] < held || s->head - s->tail[w] > RAIN_TIPS + 1)
+			return 0;
+		held = s->head - s->tail[w];
+	}
+	return s->day_tips <= s->total_tips;
+}
+
+// Map the state file, creating or resetting it if it is missing, from
+// another version or its counters are out of range.  Falls back to memory
+// only if the file can't be used.  Returns 0 if the state is persistent.
+int rain_open(struct rain *r, const char *path, double mm_per_tip)
+{
+	void *map = MAP_FAILED;
+	int fd;
+
+	r->mm_per_tip = mm_per_tip;
+	r->mapped = 0;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd >= 0) {
+		if (ftruncate(fd, sizeof(struct rain_state)) == 0)
+			map = mmap(NULL, sizeof(struct rain_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (map != MAP_FAILED) {
+		r->s = map;
+		r->mapped = 1;
+	} else {
+		r->s = calloc(1, sizeof(struct rain_state));
+	}
+
+	if (!rain_state_valid(r->s)) {
+		memset(r->s, 0, sizeof(struct rain_state));
+		r->s->magic = RAIN_STATE_MAGIC;
+		r->s->version = RAIN_STATE_VERSION;
+	}
+	return r->mapped ? 0 : -1;
+}
+
+// Age tips out of the windows and roll the daily total over at midnight
+void rain_advance(struct rain *r, int64_t now)
+{
+	struct rain_state *s = r->s;
+	int64_t midnight = rain_midnight(now);
+	int w;
+
+	if (midnight > s->day_start) {
+		s->day_start = midnight;
+		s->day_tips = 0;
+	}
+
+	for (w = 0; w < RAIN_WINDOWS; w++) {
+		if (s->head - s->tail[w] > RAIN_TIPS)
+			s->tail[w] = s->head - RAIN_TIPS;       // overwritten, count what we still have
+		while (s->tail[w] != s->head && s->tip[s->tail[w] % RAIN_TIPS] <= now - rain_window_secs[w])
+			s->tail[w]++;
+	}
+}
+
+void rain_tip(struct rain *r, int64_t when)
+{
+	struct rain_state *s = r->s;
+
+	rain_advance(r, when);
+	s->tip[s->head % RAIN_TIPS] = when;
+	s->head++;
+	if (when >= s->day_start)
+		s->day_tips++;
+	s->total_tips++;
+}
+
+void rain_report(struct rain *r, int64_t now, struct rain_report *rep)
+{
+	struct rain_state *s = r->s;
+
+	rain_advance(r, now);
+	rep->day = s->day_tips * r->mm_per_tip;
+	rep->hour = (s->head - s->tail[RAIN_1H]) * r->mm_per_tip;
+	rep->day24 = (s->head - s->tail[RAIN_24H]) * r->mm_per_tip;
+	rep->rate = (s->head - s->tail[RAIN_RATE_WINDOW]) * r->mm_per_tip * 3600.0 / rain_window_secs[RAIN_RATE_WINDOW];
+}
+
+// Schedule write back of the state page
+void rain_sync(struct rain *r)
+{
+	if (r->mapped)
+		msync(r->s, sizeof(struct rain_state), MS_ASYNC);
+}
+
+#endif
@@ -0,0 +1,129 @@
+/*
+Windowed wind statistics
+
+Pulses are binned into one second buckets kept in a ring covering the
+longest window.  Every window keeps a running sum that gets the newest
+bucket added and the bucket falling out of it subtracted as each second
+closes, so an event costs O(1) and no history is rescanned.
+
+  gust    3 second mean, WMO's gust definition
+  mean    2 and 10 minute means
+  peak    highest 3 second gust since the last report
+  lull    lowest 3 second gust since the last report
+
+Speeds are in km/h: the anemometer closes WIND_PULSES_PER_REV times per
+revolution and one revolution per second is WIND_CALIBRATION.
+*/
+
+#ifndef WIND_H
+#define WIND_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define WIND_PULSES_PER_REV     4
+#define WIND_CALIBRATION        2.4             // km/h per revolution per second
+#define WIND_GUST_SECS          3
+#define WIND_SHORT_SECS         120
+#define WIND_LONG_SECS          600             // ring size, the longest window
+
+struct wind_stats {
+	uint16_t bucket[WIND_LONG_SECS];        // pulses per second
+	uint64_t second;                        // second the open bucket covers
+	unsigned int open;                      // pulses in the open bucket
+	unsigned int pos;                       // ring slot the next closed bucket goes in
+	unsigned int filled;                    // closed buckets so far, up to WIND_LONG_SECS
+	uint32_t sum_gust;
+	uint32_t sum_short;
+	uint32_t sum_long;
+	uint32_t peak;                          // highest sum_gust this interval
+	uint32_t lull;                          // lowest sum_gust this interval
+};
+
+struct wind_report {
+	float gust;                             // current 3s gust
+	float mean_short;
+	float mean_long;
+	float peak;                             // since the last report
+	float lull;
+};
+
+void wind_init(struct wind_stats *ws, uint64_t now_s)
+{
+	memset(ws, 0, sizeof(*ws));
+	ws->second = now_s;
+	ws->lull = UINT32_MAX;
+}
+
+static uint16_t wind_bucket_back(const struct wind_stats *ws, unsigned int age)
+{
+	// bucket closed age seconds ago, 1 = newest; zero if not filled yet
+	if (age > ws->filled)
+		return 0;
+	return ws->bucket[(ws->pos + WIND_LONG_SECS - age) % WIND_LONG_SECS];
+}
+
+// Close buckets up to now_s.  After a long gap only the last window's
+// worth of (empty) seconds is stepped through.
+void wind_advance(struct wind_stats *ws, uint64_t now_s)
+{
+	if (now_s > ws->second + WIND_LONG_SECS + 1)
+		ws->second = now_s - WIND_LONG_SECS - 1;
+
+	while (ws->second < now_s) {
+		uint16_t closed = ws->open > UINT16_MAX ? UINT16_MAX : ws->open;
+
+		// Buckets leaving each window once this one is added
+		ws->sum_gust -= wind_bucket_back(ws, WIND_GUST_SECS);
+		ws->sum_short -= wind_bucket_back(ws, WIND_SHORT_SECS);
+		ws->sum_long -= wind_bucket_back(ws, WIND_LONG_SECS);
+
+		ws->bucket[ws->pos] = closed;
+		ws->pos = (ws->pos + 1) % WIND_LONG_SECS;
+		if (ws->filled < WIND_LONG_SECS)
+			ws->filled++;
+		ws->sum_gust += closed;
+		ws->sum_short += closed;
+		ws->sum_long += closed;
+
+		if (ws->filled >= WIND_GUST_SECS) {
+			if (ws->sum_gust > ws->peak)
+				ws->peak = ws->sum_gust;
+			if (ws->sum_gust < ws->lull)
+				ws->lull = ws->sum_gust;
+		}
+		ws->open = 0;
+		ws->second++;
+	}
+}
+
+// Count one debounced pulse at ts_ns (CLOCK_MONOTONIC)
+void wind_pulse(struct wind_stats *ws, uint64_t ts_ns)
+{
+	wind_advance(ws, ts_ns / 1000000000ULL);
+	ws->open++;
+}
+
+static float wind_speed(uint32_t pulses, unsigned int seconds)
+{
+	if (seconds == 0)
+		return 0;
+	return (float)pulses / seconds / WIND_PULSES_PER_REV * WIND_CALIBRATION;
+}
+
+// Current statistics, and start a new peak/lull interval
+void wind_report(struct wind_stats *ws, struct wind_report *r)
+{
+	unsigned int n_short = ws->filled < WIND_SHORT_SECS ? ws->filled : WIND_SHORT_SECS;
+
+	r->gust = wind_speed(ws->sum_gust, WIND_GUST_SECS);
+	r->mean_short = wind_speed(ws->sum_short, n_short);
+	r->mean_long = wind_speed(ws->sum_long, ws->filled);
+	r->peak = wind_speed(ws->peak, WIND_GUST_SECS);
+	r->lull = ws->lull == UINT32_MAX ? r->gust : wind_speed(ws->lull, WIND_GUST_SECS);
+
+	ws->peak = 0;
+	ws->lull = UINT32_MAX;
+}
+
+#endif